@@ -0,0 +1,18 @@
+(defun nest-lets (n)
+  (let ((a n))
+    (let ((b (+ a 1)))
+      (let ((c (+ b 1)))
+        (let ((d (+ c 1)))
+          (let ((e (+ d 1)))
+            (let ((f (+ e 1)))
+              (let ((g (+ f 1)))
+                (let ((h (+ g 1)))
+                  (+ a b c d e f g h))))))))))
+
+(defun loop-lets (n acc)
+  (if (equal n 0)
+      acc
+      (loop-lets (- n 1) (+ acc (nest-lets n)))))
+
+(defun bench ()
+  (loop-lets 20000 0))
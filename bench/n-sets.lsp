@@ -0,0 +1,2 @@
+(defun bench ()
+  (reduce + (mapcar (lambda (s) (reduce + s 0)) (n-sets 150)) 0))
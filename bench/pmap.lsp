@@ -0,0 +1,5 @@
+(defun score (n)
+  (reduce + (range n) 0))
+
+(defun bench ()
+  (preduce + (pmapcar score (range 400)) 0))
@@ -0,0 +1,7 @@
+(defun sum-range (k acc)
+  (if (equal k 0)
+      acc
+      (sum-range (- k 1) (+ acc (reduce + (range 2000) 0)))))
+
+(defun bench ()
+  (sum-range 20 0))
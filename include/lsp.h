@@ -3,15 +3,78 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 typedef struct lsp_obj lsp_obj;
 typedef struct lsp_context lsp_context;
 
-typedef enum lsp_mark_type_ {UNUSED = 1, EXTERNAL, INTERNAL} lsp_mark_type;
+/* Heap sizes are counted in bytes, a zero initial size selects the
+   default and a zero maximum lets the heap grow without limit. pmapcar
+   and preduce run on n_workers threads, zero starts one per processor
+   and a negative count runs them in the calling thread. Major
+   collections run in steps of about pause_us microseconds after minor
+   ones, zero selects the default and a negative budget stops the
+   program for whole collections. */
+typedef struct lsp_config {
+    size_t heap_initial;
+    size_t heap_max;
+    int n_workers;
+    long pause_us;
+} lsp_config;
 
-lsp_context * lsp_init();
+#define LSP_STATS_TYPES 16
+
+/* Allocation and collector counters, times are in seconds. A pause is
+   one minor collection with the major step that follows it, or a whole
+   major collection. The unmark time is spent starting major cycles.
+   Objects count conses too. */
+typedef struct lsp_gc_stats {
+    unsigned long allocated[LSP_STATS_TYPES];  /* by lsp_type_name */
+    unsigned long n_allocated;
+    unsigned long n_minor;
+    unsigned long n_major;
+    unsigned long n_promoted;
+    unsigned long n_freed;
+    double minor_time;
+    double unmark_time;
+    double mark_time;
+    double sweep_time;
+    double pause_time;
+    double max_pause;
+    size_t in_use;          /* now, reachable or not */
+    size_t heap_size;       /* bytes of old space chunks, in use or free */
+    size_t peak_live;       /* most held by the old space after a collection */
+    size_t last_marked;     /* by the last major collection */
+    size_t last_swept;
+    size_t mark_stack_max;
+} lsp_gc_stats;
+
+/* config may be NULL for the defaults. Contexts share no mutable
+   state, so separate contexts may run at the same time in different
+   threads. A context and its objects must only be used by one thread
+   at a time, and objects never pass from one context to another.
+   The workers of pmapcar and preduce have contexts of their own and
+   are started by the first call. */
+lsp_context * lsp_init(const lsp_config *config);
 void lsp_shutdown(lsp_context *c);
 
+/* Loads an image written by (save-image "file") into a context fresh
+   from lsp_init, its globals bound over the builtins. Natives are
+   saved by name only, so the host registers those the image holds
+   before loading it. False when the file is not a readable image or
+   names a primitive the context lacks, the context is then only fit
+   to be shut down. */
+bool lsp_load_image(lsp_context *ctx, const char *path);
+
+/* lsp_init and lsp_load_image in one, for images without natives.
+   NULL when the image does not load. */
+lsp_context * lsp_init_from_image(const char *path,
+                                  const lsp_config *config);
+
+void lsp_stats(lsp_context *ctx, lsp_gc_stats *out);
+/* NULL for types that are not allocated */
+const char * lsp_type_name(int type);
+
 lsp_obj * lsp_env_create(lsp_obj *names, lsp_obj *values,
                                lsp_context *ctx);
 void lsp_context_push_env(lsp_context *c, lsp_obj *e);
@@ -20,22 +83,61 @@ long int lsp_obj_as_num(lsp_obj *o);
 const char * lsp_obj_as_string(lsp_obj *o);
 
 lsp_obj * lsp_obj_num(long int val, lsp_context *ctx);
+lsp_obj * lsp_obj_string(const char *str, lsp_context *ctx);
 lsp_obj * lsp_obj_cons(lsp_obj *car, lsp_obj *cdr,
                              lsp_context *ctx);
+/* The items are updated if they move while the list is built */
+lsp_obj * lsp_obj_list(lsp_obj **items, int n, lsp_context *ctx);
 
 void lsp_obj_delete(lsp_obj *o);
 
-int lsp_obj_mark(lsp_obj *o, lsp_mark_type mark);
+/* Objects returned by lsp_read, lsp_eval and lsp_vm_eval are held by
+   the context until released and do not move. Other objects may be
+   moved by the next allocation unless they are held. */
+lsp_obj * lsp_obj_hold(lsp_obj *o, lsp_context *ctx);
+void lsp_obj_release(lsp_obj *o, lsp_context *ctx);
     
 lsp_obj * lsp_read(char *txt, lsp_context *ctx);
 
-char * lsp_print(lsp_obj *o);
+/* A native gets its evaluated arguments in argv. The collector updates
+   argv when objects move, but argv itself is only valid until the
+   native evaluates Lisp code. */
+typedef lsp_obj * (*lsp_native)(lsp_obj **argv, int argc,
+                                lsp_context *ctx);
+
+/* Binds name to fn in the global environment, a max_arity of -1 takes
+   any number of arguments */
+void lsp_register_native(lsp_context *ctx, const char *name,
+                         lsp_native fn, int min_arity, int max_arity);
+
+/* Text the printer appends to. With a file the buffer is written out
+   whenever it fills up, otherwise it grows. */
+typedef struct lsp_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    FILE *fp;
+} lsp_buf;
+
+void lsp_buf_init(lsp_buf *b, FILE *fp);
+void lsp_buf_flush(lsp_buf *b);
+void lsp_buf_free(lsp_buf *b);
+
+/* Appends the printed object, the text stays zero terminated */
+void lsp_print_to(lsp_obj *o, lsp_buf *b);
+void lsp_print_file(lsp_obj *o, FILE *fp);
+
+/* The text is valid until the next call on the same context */
+char * lsp_print(lsp_obj *o, lsp_context *ctx);
 
 lsp_obj * lsp_eval(lsp_obj *expr, lsp_context *ctx);
 
+/* Compiles expr to bytecode and runs it on the VM */
+lsp_obj * lsp_vm_eval(lsp_obj *expr, lsp_context *ctx);
+
 /* private - TODO: Move to other header? */
 lsp_obj * lsp_read_obj(char *txt, char **next, lsp_context *ctx);
-char * lsp_print_obj(lsp_obj *obj, char *buf);
+void lsp_print_obj(lsp_obj *obj, lsp_buf *b);
 lsp_obj * lsp_obj_nil();
 
 char * lsp_eat_space(char *txt);
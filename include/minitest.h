@@ -1,10 +1,10 @@
 #ifndef _MINITEST_H_
 #define _MINITEST_H_
 
-#include <string.h>
-
 #include "trace.h"
 
+#include <string.h>
+
 static int test_count = 0, test_error_count = 0;
 
 static void test_progress(const char *c) {
@@ -1,33 +1,48 @@
 #ifndef _TRACE_H_
 #define _TRACE_H_
 
+/* localtime_r, for headers included before any system header */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdio.h>
 #include <time.h>
 
+/* Each translation unit has its own name. A program sets it in main
+   before starting threads, the library never does. */
 static const char *trace_name = "";
 
 #define TRACE_INIT(_name) trace_name = #_name
 
 #define TRACE_SIMPLE(...) printf(__VA_ARGS__)
-#define TRACE_NL TRACE_SIMPLE("\n")
 #define TRACE_PROMPT TRACE_TIME; TRACE_SIMPLE("%s > ", trace_name);
-#define TRACE_TIME do {                            \
-        time_t t = time(NULL);                     \
-        char buf[32];                              \
-        strftime(buf, 32, "%T", localtime(&t));    \
-        TRACE_SIMPLE("%s - ", buf);                \
+#define TRACE_TIME do {                                 \
+        time_t t = time(NULL);                          \
+        struct tm tm;                                   \
+        char buf[32];                                   \
+        strftime(buf, 32, "%T", localtime_r(&t, &tm));  \
+        TRACE_SIMPLE("%s - ", buf);                     \
     } while(0)
       
+/* Builds that measure time leave the traces out, errors are still
+   reported */
+#ifdef TRACE_OFF
+#define TRACE_NL do {} while (0)
+#define TRACE(...) do {} while (0)
+#else
+#define TRACE_NL TRACE_SIMPLE("\n")
 #define TRACE(...)                              \
     TRACE_PROMPT;                               \
     TRACE_SIMPLE(__VA_ARGS__);                  \
     TRACE_NL
+#endif
 
 #define ERROR(...)                                              \
     TRACE_PROMPT;                                               \
     TRACE_SIMPLE("%s:%s:%d - "                                  \
                  , __FILE__, __FUNCTION__, __LINE__);           \
     TRACE_SIMPLE(__VA_ARGS__);                                  \
-    TRACE_NL
+    TRACE_SIMPLE("\n")
 
 #endif /* _TRACE_H_ */
@@ -0,0 +1,246 @@
+/* Runs benchmark workloads and prints one tab separated line for each
+   workload and evaluator:
+
+   workload engine runs best_ms median_ms allocated minor major
+   peak_live result
+
+   A workload file defines (bench), which is timed after the library
+   and the file are loaded. The counters are those of one run, and
+   peak_live is the most the heap held at the end of a run, while its
+   result was still held.
+
+   With -t the workload runs in that many threads at once, each with
+   its own context, and the line gives the throughput instead:
+
+   workload engine threads runs wall_ms runs_per_s result
+
+   The result is "mismatch" when the threads disagree. */
+
+/* clock_gettime and pthread barriers */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lsp.h"
+
+#define BENCH_RUNS 5
+#define BENCH_MAX_RUNS 100
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int compare_times(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static lsp_obj * run(char *text, bool vm, lsp_context *ctx) {
+    lsp_obj *ro = lsp_read(text, ctx);
+    lsp_obj *eo = vm ? lsp_vm_eval(ro, ctx) : lsp_eval(ro, ctx);
+    lsp_obj_release(ro, ctx);
+    return eo;
+}
+
+static void load(const char *file_name, bool vm, lsp_context *ctx) {
+    char text[1024];
+    snprintf(text, sizeof(text), "(load \"%s\")", file_name);
+    lsp_obj_release(run(text, vm, ctx), ctx);
+}
+
+static void workload_name(const char *file_name, char *name, size_t size) {
+    const char *base = strrchr(file_name, '/');
+    base = base ? base + 1 : file_name;
+
+    size_t len = strcspn(base, ".");
+    if (len >= size)
+        len = size - 1;
+    memcpy(name, base, len);
+    name[len] = '\0';
+}
+
+static void bench(const char *file_name, const char *library, bool vm,
+                  int runs) {
+    lsp_context *ctx = lsp_init(NULL);
+    load(library, vm, ctx);
+    load(file_name, vm, ctx);
+
+    double times[BENCH_MAX_RUNS];
+    lsp_gc_stats before, after;
+    lsp_stats(ctx, &before);
+    lsp_buf result;
+    lsp_buf_init(&result, NULL);
+
+    size_t peak_live = 0;
+
+    for (int i = 0; i < runs; i++) {
+        double start = now();
+        lsp_obj *eo = run("(bench)", vm, ctx);
+        times[i] = now() - start;
+
+        lsp_stats(ctx, &after);
+        if (after.in_use > peak_live)
+            peak_live = after.in_use;
+
+        if (i == 0)
+            lsp_print_to(eo, &result);
+        lsp_obj_release(eo, ctx);
+    }
+
+    lsp_stats(ctx, &after);
+    qsort(times, runs, sizeof(double), compare_times);
+
+    char name[256];
+    workload_name(file_name, name, sizeof(name));
+    printf("%s\t%s\t%d\t%.3f\t%.3f\t%lu\t%lu\t%lu\t%lu\t%s\n",
+           name, vm ? "vm" : "eval", runs,
+           times[0] * 1e3, times[runs / 2] * 1e3,
+           (after.n_allocated - before.n_allocated) / runs,
+           (after.n_minor - before.n_minor) / runs,
+           (after.n_major - before.n_major) / runs,
+           (unsigned long) peak_live, result.data);
+    fflush(stdout);
+
+    lsp_buf_free(&result);
+    lsp_shutdown(ctx);
+}
+
+/* One thread of a throughput run. The context is set up before the
+   ready barrier and shut down after the done barrier. The clock starts
+   between ready and go, before any thread runs, so the wall time
+   covers all the runs. */
+typedef struct worker {
+    const char *file_name;
+    const char *library;
+    bool vm;
+    int runs;
+    pthread_barrier_t *ready;
+    pthread_barrier_t *go;
+    pthread_barrier_t *done;
+    lsp_buf result;
+} worker;
+
+static void * work(void *arg) {
+    worker *w = arg;
+    lsp_context *ctx = lsp_init(NULL);
+    load(w->library, w->vm, ctx);
+    load(w->file_name, w->vm, ctx);
+
+    pthread_barrier_wait(w->ready);
+    pthread_barrier_wait(w->go);
+    for (int i = 0; i < w->runs; i++) {
+        lsp_obj *eo = run("(bench)", w->vm, ctx);
+        if (i == 0)
+            lsp_print_to(eo, &w->result);
+        lsp_obj_release(eo, ctx);
+    }
+    pthread_barrier_wait(w->done);
+
+    lsp_shutdown(ctx);
+    return NULL;
+}
+
+static void bench_threads(const char *file_name, const char *library,
+                          bool vm, int runs, int n_threads) {
+    pthread_barrier_t ready, go, done;
+    pthread_barrier_init(&ready, NULL, n_threads + 1);
+    pthread_barrier_init(&go, NULL, n_threads + 1);
+    pthread_barrier_init(&done, NULL, n_threads + 1);
+
+    worker *workers = calloc(n_threads, sizeof(worker));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    for (int i = 0; i < n_threads; i++) {
+        workers[i].file_name = file_name;
+        workers[i].library = library;
+        workers[i].vm = vm;
+        workers[i].runs = runs;
+        workers[i].ready = &ready;
+        workers[i].go = &go;
+        workers[i].done = &done;
+        lsp_buf_init(&workers[i].result, NULL);
+        if (pthread_create(&threads[i], NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "unable to start thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+    double start_time = now();
+    pthread_barrier_wait(&go);
+    pthread_barrier_wait(&done);
+    double wall = now() - start_time;
+
+    bool same = true;
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+        if (strcmp(workers[i].result.data, workers[0].result.data) != 0)
+            same = false;
+    }
+
+    char name[256];
+    workload_name(file_name, name, sizeof(name));
+    printf("%s\t%s\t%d\t%d\t%.3f\t%.1f\t%s\n",
+           name, vm ? "vm" : "eval", n_threads, runs, wall * 1e3,
+           n_threads * runs / wall,
+           same ? workers[0].result.data : "mismatch");
+    fflush(stdout);
+
+    for (int i = 0; i < n_threads; i++)
+        lsp_buf_free(&workers[i].result);
+    free(workers);
+    free(threads);
+    pthread_barrier_destroy(&ready);
+    pthread_barrier_destroy(&go);
+    pthread_barrier_destroy(&done);
+}
+
+int main(int argc, char **argv) {
+    const char *library = "bs.lsp";
+    int runs = BENCH_RUNS;
+    int n_threads = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            library = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            n_threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [-n runs] [-l library] [-t threads] "
+                    "file...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (runs < 1 || runs > BENCH_MAX_RUNS) {
+        fprintf(stderr, "runs must be between 1 and %d\n", BENCH_MAX_RUNS);
+        return 1;
+    }
+
+    if (n_threads > 0) {
+        printf("workload\tengine\tthreads\truns\twall_ms\truns_per_s\t"
+               "result\n");
+        for (; i < argc; i++) {
+            bench_threads(argv[i], library, false, runs, n_threads);
+            bench_threads(argv[i], library, true, runs, n_threads);
+        }
+        return 0;
+    }
+
+    printf("workload\tengine\truns\tbest_ms\tmedian_ms\tallocated\t"
+           "minor\tmajor\tpeak_live\tresult\n");
+    for (; i < argc; i++) {
+        bench(argv[i], library, false, runs);
+        bench(argv[i], library, true, runs);
+    }
+    return 0;
+}
@@ -1,9 +1,20 @@
+/* posix_memalign, mmap, clock_gettime and threads */
+#define _POSIX_C_SOURCE 200112L
+
 #include "lsp.h"
 #include "check.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 static void * lsp_alloc(size_t size) {
     return malloc(size);
@@ -18,17 +29,20 @@ typedef struct lsp_env {
     lsp_obj *values;
 } lsp_env;
 
-typedef struct lsp_cons {
+/* Conses are two words without a header. Pointers to them carry the
+   LSP_TAG_CONS bit and their marks and flags are kept in bitmaps on
+   the side. */
+typedef struct lsp_cell {
     lsp_obj *car;
     lsp_obj *cdr;
-} lsp_cons;
+} lsp_cell;
 
 enum lsp_obj_type {FREELIST, NIL, SYMBOL, STRING, NUM, CONS,
-                   QUOTE, ENV, LAMBDA,
+                   QUOTE, ENV, LAMBDA, CODE, LOCAL, PRIMITIVE, GLOBAL,
                    OBJ_TYPE_MAX_};
 
 const char * obj_type_to_str(int t) {
-    static char *str[] = {
+    static const char *const str[] = {
         "FREELIST",
         "NIL",
         "SYMBOL",
@@ -38,940 +52,5637 @@ const char * obj_type_to_str(int t) {
         "QUOTE",
         "ENV",
         "LAMBDA",
+        "CODE",
+        "LOCAL",
+        "PRIMITIVE",
+        "GLOBAL",
         "UNDEFINED"
     };
 
     return str[t];
 }
 
+/* Variable reference resolved to a frame depth and slot. A captured
+   reference is the slot of the closed values of the procedure whose
+   parameters are at that depth. */
+typedef struct lsp_local {
+    int depth;
+    int slot;
+    bool captured;
+    lsp_obj *name;
+} lsp_local;
+
+/* Global called from resolved or compiled code, with the value found
+   by the last lookup and the version of the globals it was found in */
+typedef struct lsp_global_ref {
+    lsp_obj *name;
+    lsp_obj *value;
+    unsigned long version;
+} lsp_global_ref;
+
+/* A lambda form in a resolved body is replaced by a template, whose
+   closed list holds the references to capture where it is evaluated.
+   Closures share the template's parameters, body and code. */
 typedef struct lsp_lambda {
     lsp_obj *args;
     lsp_obj *body;
+    lsp_obj *code;   /* compiled CODE object, NULL until the VM needs it */
+    lsp_obj *closed; /* captured values, in free variable order */
 } lsp_lambda;
 
-#define LSP_STRING_SIZE 32
+/* Builtin or native procedure, a max_arity of -1 takes any number of
+   arguments */
+typedef struct lsp_primitive {
+    const char *name;
+    lsp_native fn;
+    int min_arity;
+    int max_arity;
+    bool pure;      /* may be folded when its arguments are constant */
+} lsp_primitive;
+
+/* Bytecode for one procedure body (or one top-level form). */
+typedef struct lsp_code {
+    unsigned char *ops;
+    int n_ops;
+    int ops_size;
+    lsp_obj **consts;
+    int n_consts;
+    int consts_size;
+    int n_params;
+    int n_locals;
+    lsp_obj *args;
+    lsp_obj *body;
+} lsp_code;
+
+typedef enum lsp_form {NOT_A_FORM, FORM_IF, FORM_LIST, FORM_LET, FORM_SET,
+                       FORM_LAMBDA, FORM_DEFUN, FORM_PROGN, FORM_CONS,
+                       FORM_CAR, FORM_CDR, FORM_EQUAL, FORM_LOAD,
+                       FORM_MAX_} lsp_form;
+
+/* Symbols are interned, the name is owned by the symbol table */
+typedef struct lsp_symbol {
+    char *name;
+    lsp_form form;
+    lsp_obj *next;  /* in the same bucket */
+} lsp_symbol;
+
+/* The marks of old objects take turns: the one a major collection
+   gives to what it reaches is black, the other one white */
+typedef enum lsp_mark_type_ {MARK_EVEN = 1, MARK_ODD, FORWARDED} lsp_mark_type;
+
+/* Objects built by the reader are code or quoted constants, they are
+   shared and must never be modified */
+#define LSP_FLAG_CONST 1
+/* Old object in the remembered set */
+#define LSP_FLAG_REMEMBERED 2
 
 typedef struct lsp_obj {
     enum lsp_obj_type type;
-    lsp_mark_type mark;
-    lsp_obj *next;
+    unsigned char mark;
+    unsigned char flags;
     union {
-        char str[LSP_STRING_SIZE];
+        char *str;
+        lsp_symbol sym;
         long int num;
-        lsp_cons con;
         lsp_env env;
         lsp_lambda lambda;
+        lsp_local local;
+        lsp_global_ref global;
+        lsp_code *code;
+        const lsp_primitive *prim;
         lsp_obj *expr;
+        lsp_obj *next;  /* free list and forwarding address */
     } value;
 } lsp_obj;
 
-static lsp_obj static_obj_nil = {.type = NIL};
+/* Shared by every context, so never written: the collector leaves
+   nil alone and the forwarding mark is only compared */
+static const lsp_obj static_obj_nil = {.type = NIL};
+
+/* The car of a young cons that has been promoted */
+static const lsp_obj static_obj_forwarded = {.type = NIL};
 
 lsp_obj * lsp_obj_nil() {
-    return &static_obj_nil;
+    return (lsp_obj *) &static_obj_nil;
 }
 
 bool lsp_obj_is_nil(lsp_obj *o) {
     return o == &static_obj_nil;
 }
 
+/* Integers that fit in a word with the lowest bit set are stored in
+   the pointer itself and conses are tagged with the next bit, objects
+   and cells are aligned so both bits are clear */
+#define LSP_FIXNUM_MAX (LONG_MAX >> 1)
+#define LSP_FIXNUM_MIN (LONG_MIN >> 1)
+#define LSP_TAG_FIXNUM 1
+#define LSP_TAG_CONS 2
+
+static inline bool lsp_obj_is_fixnum(lsp_obj *o) {
+    return ((uintptr_t) o & LSP_TAG_FIXNUM) != 0;
+}
+
+static inline bool lsp_obj_is_cons(lsp_obj *o) {
+    return ((uintptr_t) o & 3) == LSP_TAG_CONS;
+}
+
+static inline lsp_cell * lsp_cell_of(lsp_obj *o) {
+    return (lsp_cell *) ((uintptr_t) o - LSP_TAG_CONS);
+}
+
+static inline lsp_obj * lsp_cell_obj(lsp_cell *c) {
+    return (lsp_obj *) ((uintptr_t) c + LSP_TAG_CONS);
+}
+
+static inline lsp_obj * lsp_fixnum(long int num) {
+    return (lsp_obj *) (((uintptr_t) num << 1) | 1);
+}
+
+static inline long int lsp_fixnum_value(lsp_obj *o) {
+    return (long int) ((intptr_t) o >> 1);
+}
+
+static inline enum lsp_obj_type lsp_obj_type(lsp_obj *o) {
+    if (lsp_obj_is_fixnum(o))
+        return NUM;
+    return lsp_obj_is_cons(o) ? CONS : o->type;
+}
+
 lsp_obj * lsp_car(lsp_obj *cons) {
     if (lsp_obj_is_nil(cons))
         return lsp_obj_nil();
     else
-        return cons->value.con.car;
+        return lsp_cell_of(cons)->car;
 }
 
 lsp_obj * lsp_cdr(lsp_obj *cons) {
     if (lsp_obj_is_nil(cons))
         return lsp_obj_nil();
     else
-        return cons->value.con.cdr;
+        return lsp_cell_of(cons)->cdr;
+}
+
+int lsp_list_length(lsp_obj *l) {
+    int len = 0;
+    while (! lsp_obj_is_nil(l)) {
+        len++;
+        l = lsp_cdr(l);
+    }
+    return len;
+}
+
+/* The old space is made of chunks that are allocated when the live
+   data outgrows it and released when they become empty. Conses have
+   chunks of their own, aligned on their size so that the side bitmaps
+   of a cell are found from its address. New objects and conses are
+   bump allocated in nurseries and the survivors of a minor collection
+   are copied to the chunks. Sizes are in bytes.
+
+   A major collection marks the old space from a snapshot of the roots
+   taken after a minor one, then sweeps it. Objects allocated in the
+   old space or promoted while it runs are black. Incremental
+   collections do the marking and sweeping in steps of bounded time
+   after minor collections, the sweep rebuilds the free lists a chunk
+   at a time and allocation sweeps ahead when they run dry. The heap
+   grows by a few chunks per step, a cycle that falls behind grows it
+   while it may or is finished in one pause. Conses are only written
+   while a list is built, so the only field that can lose an old
+   object is the value cached by a global reference, which is shaded
+   when overwritten. */
+#define LSP_CHUNK_SIZE 4096
+#define LSP_CELL_CHUNK_BYTES (1 << 16)
+#define LSP_CELL_CHUNK_SIZE 3968
+#define LSP_CELL_WORDS (LSP_CELL_CHUNK_SIZE / 32)
+#define LSP_HEAP_INITIAL (1 << 20)
+#define LSP_NURSERY_MAX (1 << 20)
+#define LSP_NURSERY_MIN (1 << 14)
+#define LSP_PAUSE_US 1000
+/* Objects marked between two looks at the clock */
+#define LSP_MARK_CHECK 256
+
+typedef struct lsp_chunk {
+    lsp_obj objs[LSP_CHUNK_SIZE];
+    lsp_obj *free_first;
+    lsp_obj *free_last;
+    int n_live;
+    bool spare;         /* swept empty, off the free list */
+} lsp_chunk;
+
+typedef struct lsp_cell_chunk {
+    uint32_t used[LSP_CELL_WORDS];
+    uint32_t marked[LSP_CELL_WORDS];
+    uint32_t constant[LSP_CELL_WORDS];
+    uint32_t remembered[LSP_CELL_WORDS];
+    lsp_cell *free_first;
+    lsp_cell *free_last;
+    int n_live;
+    bool spare;
+    lsp_cell cells[LSP_CELL_CHUNK_SIZE];
+} lsp_cell_chunk;
+
+#define LSP_BIT_GET(bits_, i_) (((bits_)[(i_) / 32] >> ((i_) % 32)) & 1)
+#define LSP_BIT_SET(bits_, i_) ((bits_)[(i_) / 32] |= 1u << ((i_) % 32))
+#define LSP_BIT_CLEAR(bits_, i_) ((bits_)[(i_) / 32] &= ~(1u << ((i_) % 32)))
+
+static inline lsp_cell_chunk * lsp_cell_chunk_of(lsp_cell *c) {
+    return (lsp_cell_chunk *)
+        ((uintptr_t) c & ~(uintptr_t) (LSP_CELL_CHUNK_BYTES - 1));
 }
 
-#define LSP_HEAP_SIZE 100000
+typedef struct lsp_obj_stack {
+    lsp_obj **objs;
+    size_t n;
+    size_t size;
+} lsp_obj_stack;
+
+typedef enum lsp_gc_phase {GC_IDLE, GC_MARK, GC_SWEEP} lsp_gc_phase;
 
 typedef struct lsp_mem {
-    lsp_obj heap[LSP_HEAP_SIZE];
+    lsp_chunk **chunks;
+    int n_chunks;
+    int chunks_size;
+    int min_chunks;
+    int n_live;
+    int n_free;
     lsp_obj *free_list;
+
+    lsp_cell_chunk **cell_chunks;
+    int n_cell_chunks;
+    int cell_chunks_size;
+    int min_cell_chunks;
+    int n_live_cells;
+    int n_free_cells;
+    lsp_cell *free_cells;
+
+    size_t max_bytes;   /* 0 for no limit */
+    int grow_chunks;    /* left to add after a major collection */
+    int grow_cell_chunks;
+
+    lsp_obj *nursery;
+    int nursery_size;
+    int nursery_top;
+    lsp_cell *cell_nursery;
+    int cell_nursery_size;
+    int cell_nursery_top;
+    int pretenure;      /* allocate in the old space while > 0 */
+
+    lsp_obj_stack remembered; /* old objects pointing into the nursery */
+    lsp_obj_stack gray;       /* promoted objects left to scan */
+
+    lsp_gc_phase phase;       /* of the major collection */
+    unsigned char black;
+    double step_time;         /* of an incremental step, 0 for none */
+    lsp_obj_stack marking;    /* gray old objects */
+    size_t n_marked;
+    size_t n_used;            /* when the collection began */
+    int sweep_chunk;          /* next chunk to sweep */
+    int sweep_cell_chunk;
+    lsp_gc_stats stats;
 } lsp_mem;
 
+typedef struct lsp_frame {
+    lsp_code *code;
+    unsigned char *pc;
+    int base;
+} lsp_frame;
+
+typedef struct lsp_vm {
+    lsp_obj **stack;
+    int sp;
+    int stack_size;
+    lsp_frame *frames;
+    int fp;
+    int frames_size;
+} lsp_vm;
+
+static inline void lsp_vm_push(lsp_vm *vm, lsp_obj *o) {
+    if (vm->sp == vm->stack_size) {
+        vm->stack_size *= 2;
+        vm->stack = realloc(vm->stack, vm->stack_size * sizeof(lsp_obj *));
+        CHECK(vm->stack != NULL);
+    }
+    vm->stack[vm->sp++] = o;
+}
+
+static inline lsp_obj * lsp_vm_pop(lsp_vm *vm) {
+    return vm->stack[--vm->sp];
+}
+
+static inline lsp_obj * lsp_vm_top(lsp_vm *vm) {
+    return vm->stack[vm->sp - 1];
+}
+
+/* Frame of the tree walker for a call or a let, its values are the
+   slots of the VM stack from base */
+typedef struct lsp_env_frame {
+    lsp_obj *owner;     /* the LAMBDA applied or the bindings of the let */
+    int base;
+    int n;              /* values bound so far */
+} lsp_env_frame;
+
+typedef struct lsp_env_stack {
+    lsp_env_frame *frames;
+    int fp;
+    int size;
+    int tail_sp;        /* where the expression being evaluated began */
+    int tail_fp;
+} lsp_env_stack;
+
+/* Symbols are chained through their next pointer */
+typedef struct lsp_symtab {
+    lsp_obj **buckets;
+    size_t n_buckets;
+    size_t n_symbols;
+} lsp_symtab;
+
+/* Global bindings, open addressing with linear probing. Symbols never
+   move, so their address is the key. */
+typedef struct lsp_globals {
+    lsp_obj **names;    /* NULL for an empty slot */
+    lsp_obj **values;
+    lsp_obj **sources;  /* source of an optimized defun, or NULL */
+    lsp_obj **depends;  /* names of the procedures that relied on it */
+    size_t n_slots;
+    size_t n_globals;
+    unsigned long version;  /* bumped when a binding changes */
+} lsp_globals;
+
+/* Addresses of C variables holding objects across allocations */
+typedef struct lsp_roots {
+    lsp_obj ***vars;
+    int n;
+    int size;
+} lsp_roots;
+
+/* Objects held by the host */
+typedef struct lsp_handles {
+    lsp_obj **objs;
+    int n;
+    int size;
+} lsp_handles;
+
+/* Natives registered by the host */
+typedef struct lsp_natives {
+    lsp_primitive **prims;
+    int n;
+    int size;
+} lsp_natives;
+
+/* Copies of the objects of another context by their address there,
+   so that what is shared is copied once. Kept while the objects of a
+   parallel job are copied, the copies are roots. */
+typedef struct lsp_copies {
+    lsp_obj **keys;
+    lsp_obj **objs;
+    size_t n_slots;
+    size_t n_keys;
+    bool active;        /* while a job copies */
+} lsp_copies;
+
+typedef struct lsp_pool lsp_pool;
+
 typedef struct lsp_context {
-    lsp_obj *env_top;
+    lsp_env_stack env;
+    lsp_obj *sym_t;
+    lsp_symtab symbols;
+    lsp_globals globals;
+    lsp_natives natives;
+    lsp_roots roots;
+    lsp_handles handles;
+    lsp_copies copies;
+    lsp_vm vm;
     lsp_mem mem;
+    lsp_buf print;      /* text returned by lsp_print */
+    int n_workers;      /* threads for pmapcar and preduce */
+    lsp_pool *pool;     /* started by the first parallel call */
+    lsp_context *parent;    /* the context a worker runs tasks for */
 } lsp_context;
 
-void lsp_mem_free(lsp_mem *m, lsp_obj *o) {
+/* Every function that allocates protects the objects it still needs
+   after the allocation, the collector only sees what is reachable
+   from the environment, the VM stack, protected variables and host
+   handles */
+void lsp_protect(lsp_obj **var, lsp_context *ctx) {
+    lsp_roots *r = &ctx->roots;
+    if (r->n == r->size) {
+        r->size = r->size ? r->size * 2 : 64;
+        r->vars = realloc(r->vars, r->size * sizeof(lsp_obj **));
+        CHECK(r->vars != NULL);
+    }
+    r->vars[r->n++] = var;
+}
+
+void lsp_unprotect(int n, lsp_context *ctx) {
+    ctx->roots.n -= n;
+}
+
+void lsp_code_delete(lsp_code *code);
+
+/* Releases what an object owns outside the heap */
+void lsp_obj_finalize(lsp_obj *o) {
+    if (o->type == CODE)
+        lsp_code_delete(o->value.code);
+    else if (o->type == STRING)
+        lsp_free(o->value.str);
+}
+
+void lsp_mem_free(lsp_chunk *c, lsp_obj *o) {
+    lsp_obj_finalize(o);
     memset(o, 0, sizeof(lsp_obj));
-    
-    o->next = m->free_list;
-    m->free_list = o;
+
+    if (c->free_first == NULL)
+        c->free_last = o;
+    o->value.next = c->free_first;
+    c->free_first = o;
 }
 
 lsp_obj * lsp_mem_alloc(lsp_mem *m) {
     lsp_obj *o = m->free_list;
-    m->free_list = o->next;
-    
+    m->free_list = o->value.next;
+    m->n_free--;
+
     return o;
 }
 
+/* Free cells are chained through their car */
+lsp_cell * lsp_mem_alloc_cell(lsp_mem *m) {
+    lsp_cell *c = m->free_cells;
+    m->free_cells = (lsp_cell *) c->car;
+    m->n_free_cells--;
 
-bool lsp_obj_is_unused(lsp_obj *o);
-bool lsp_obj_is_internal(lsp_obj *o);
-void lsp_obj_set_mark(lsp_obj *o, lsp_mark_type value);
-
-void lsp_mem_unmark_all_(lsp_mem *m, bool force) {
-    TRACE("Unmarking all memory...");
-    for (int i = 0; i < LSP_HEAP_SIZE; i++) {
-        if (force || (! lsp_obj_is_internal(&m->heap[i])))
-            lsp_obj_set_mark(&(m->heap[i]), UNUSED);
-    }
+    /* Black, the marks are cleared when a collection begins */
+    lsp_cell_chunk *k = lsp_cell_chunk_of(c);
+    LSP_BIT_SET(k->used, c - k->cells);
+    LSP_BIT_SET(k->marked, c - k->cells);
+    return c;
 }
 
-void lsp_mem_force_unmark_all(lsp_mem *m) {
-    lsp_mem_unmark_all_(m, true);
+size_t lsp_mem_bytes(lsp_mem *m) {
+    return m->n_chunks * sizeof(lsp_chunk) +
+        m->n_cell_chunks * (size_t) LSP_CELL_CHUNK_BYTES;
 }
 
-void lsp_mem_unmark_all(lsp_mem *m) {
-    lsp_mem_unmark_all_(m, false);
+bool lsp_mem_can_grow(lsp_mem *m, size_t bytes) {
+    return m->max_bytes == 0 || lsp_mem_bytes(m) + bytes <= m->max_bytes;
 }
 
-void lsp_mem_collect(lsp_mem *m) {
-    CHECK(m->free_list == NULL);
+void lsp_mem_add_chunk(lsp_mem *m) {
+    if (m->n_chunks == m->chunks_size) {
+        m->chunks_size = m->chunks_size ? m->chunks_size * 2 : 16;
+        m->chunks = realloc(m->chunks, m->chunks_size * sizeof(lsp_chunk *));
+        CHECK(m->chunks != NULL);
+    }
 
-    TRACE("Collecting garbage...");
-    int count = 0;
-    for (int i = 0; i < LSP_HEAP_SIZE; i++) {
-        if (lsp_obj_is_unused(&(m->heap[i]))) {
-            lsp_mem_free(m, &(m->heap[i]));
-            count++;
-        }
+    lsp_chunk *c = lsp_alloc(sizeof(lsp_chunk));
+    CHECK(c != NULL);
+    memset(c, 0, sizeof(lsp_chunk));
+
+    for (int i = LSP_CHUNK_SIZE - 1; i >= 0; i--) {
+        c->objs[i].value.next = m->free_list;
+        m->free_list = &c->objs[i];
     }
-    TRACE("%d objects freed", count);
-}
 
-bool lsp_mem_no_free(lsp_mem *m) {
-    return m->free_list == NULL;
+    /* Its objects are on the free list already, so a sweep under way
+       counts it as swept */
+    m->chunks[m->n_chunks++] = c;
+    if (m->phase == GC_SWEEP) {
+        m->chunks[m->n_chunks - 1] = m->chunks[m->sweep_chunk];
+        m->chunks[m->sweep_chunk++] = c;
+    }
+    m->n_free += LSP_CHUNK_SIZE;
+    if (m->grow_chunks > 0)
+        m->grow_chunks--;
+    TRACE("Heap grown to %d chunks", m->n_chunks);
 }
 
-int lsp_obj_mark(lsp_obj *o, lsp_mark_type mark) {
-    int marked = 0;
-    if (! lsp_obj_is_nil(o)) {
-        lsp_obj_set_mark(o, mark);
-        marked++;
+void lsp_mem_add_cell_chunk(lsp_mem *m) {
+    if (m->n_cell_chunks == m->cell_chunks_size) {
+        m->cell_chunks_size = m->cell_chunks_size ?
+            m->cell_chunks_size * 2 : 16;
+        m->cell_chunks = realloc(m->cell_chunks, m->cell_chunks_size *
+                                 sizeof(lsp_cell_chunk *));
+        CHECK(m->cell_chunks != NULL);
     }
 
-    switch (o->type) {
-    case STRING:
-    case NUM:
-    case SYMBOL:
-    case NIL:
-        break;
-    case CONS:
-        marked += lsp_obj_mark(lsp_car(o), mark);
-        marked += lsp_obj_mark(lsp_cdr(o), mark);
-        break;
-    case ENV:
-        marked += lsp_obj_mark(o->value.env.names, mark);
-        marked += lsp_obj_mark(o->value.env.values, mark);
-        break;
-    case QUOTE:
-        marked += lsp_obj_mark(o->value.expr, mark);
-        break;
-    case LAMBDA:
-        marked += lsp_obj_mark(o->value.lambda.args, mark);
-        marked += lsp_obj_mark(o->value.lambda.body, mark);
-        break;
-    default:
-        SHOULD_NEVER_BE_HERE;
+    void *p = NULL;
+    CHECK(posix_memalign(&p, LSP_CELL_CHUNK_BYTES,
+                         sizeof(lsp_cell_chunk)) == 0);
+    lsp_cell_chunk *k = p;
+    memset(k, 0, sizeof(lsp_cell_chunk));
+
+    for (int i = LSP_CELL_CHUNK_SIZE - 1; i >= 0; i--) {
+        k->cells[i].car = (lsp_obj *) m->free_cells;
+        m->free_cells = &k->cells[i];
     }
-    return marked;
+
+    m->cell_chunks[m->n_cell_chunks++] = k;
+    if (m->phase == GC_SWEEP) {
+        m->cell_chunks[m->n_cell_chunks - 1] =
+            m->cell_chunks[m->sweep_cell_chunk];
+        m->cell_chunks[m->sweep_cell_chunk++] = k;
+    }
+    m->n_free_cells += LSP_CELL_CHUNK_SIZE;
+    if (m->grow_cell_chunks > 0)
+        m->grow_cell_chunks--;
+    TRACE("Cons space grown to %d chunks", m->n_cell_chunks);
 }
 
-int lsp_mem_mark_used(lsp_context *ctx) {
-    lsp_obj *env = ctx->env_top;
-    int marked = lsp_obj_mark(env, EXTERNAL);
+/* A new collection makes every old object and cons white */
+void lsp_mem_whiten(lsp_mem *m) {
+    m->black = m->black == MARK_EVEN ? MARK_ODD : MARK_EVEN;
+    for (int i = 0; i < m->n_cell_chunks; i++) {
+        lsp_cell_chunk *k = m->cell_chunks[i];
+        memset(k->marked, 0, sizeof(k->marked));
+    }
+}
 
-    TRACE("%d objects in use", marked);
+/* Rebuilds the free list of a chunk, free objects are white too.
+   Returns the number of objects that died. */
+int lsp_mem_sweep(lsp_mem *m, lsp_chunk *c) {
+    c->free_first = NULL;
+    c->free_last = NULL;
+    c->n_live = 0;
+    int n_dead = 0;
+
+    for (int i = LSP_CHUNK_SIZE - 1; i >= 0; i--) {
+        lsp_obj *o = &c->objs[i];
+
+        /* Interned symbols live as long as the context */
+        if (o->mark != m->black && o->type != SYMBOL) {
+            n_dead += o->type != FREELIST;
+            lsp_mem_free(c, o);
+        } else {
+            c->n_live++;
+        }
+    }
+    return n_dead;
 }
 
-lsp_obj *lsp_mem_get(lsp_context *ctx) {
-    lsp_mem *m = &ctx->mem;
-    
-    if (lsp_mem_no_free(m)) {
-        TRACE_NL;
-        lsp_mem_unmark_all(m);
-        lsp_mem_mark_used(ctx);
-        lsp_mem_collect(m);
+int lsp_mem_sweep_cells(lsp_cell_chunk *k) {
+    k->free_first = NULL;
+    k->free_last = NULL;
+    k->n_live = 0;
+    int n_dead = 0;
+
+    for (int w = 0; w < LSP_CELL_WORDS; w++) {
+        for (uint32_t dead = k->used[w] & ~k->marked[w]; dead != 0;
+             dead &= dead - 1)
+            n_dead++;
+        k->used[w] &= k->marked[w];
+        k->constant[w] &= k->used[w];
     }
 
-    CHECK(lsp_mem_no_free(m) == false);
+    for (int i = LSP_CELL_CHUNK_SIZE - 1; i >= 0; i--) {
+        if (LSP_BIT_GET(k->used, i)) {
+            k->n_live++;
+            continue;
+        }
 
-    return lsp_mem_alloc(m);
+        lsp_cell *c = &k->cells[i];
+        if (k->free_first == NULL)
+            k->free_last = c;
+        c->car = (lsp_obj *) k->free_first;
+        c->cdr = NULL;
+        k->free_first = c;
+    }
+    return n_dead;
 }
 
-void lsp_mem_init(lsp_mem *m) {
-    TRACE("Initializing heap...");
-
-    m->free_list = NULL;
-    lsp_mem_force_unmark_all(m);
-    lsp_mem_collect(m);
+void lsp_mem_link_chunk(lsp_mem *m, lsp_chunk *c) {
+    c->spare = false;
+    if (c->free_first != NULL) {
+        c->free_last->value.next = m->free_list;
+        m->free_list = c->free_first;
+    }
 }
 
-void lsp_context_push_env(lsp_context *ctx, lsp_obj *env);
-
-static lsp_context * lsp_context_create() {
-    lsp_context *c = lsp_alloc(sizeof(lsp_context));
-    lsp_mem_init(&c->mem);
-
-    c->env_top = lsp_obj_nil();
-    return c;
+void lsp_mem_link_cell_chunk(lsp_mem *m, lsp_cell_chunk *k) {
+    k->spare = false;
+    if (k->free_first != NULL) {
+        k->free_last->car = (lsp_obj *) m->free_cells;
+        m->free_cells = k->free_first;
+    }
 }
 
-static void lsp_context_delete(lsp_context *c) {
-    lsp_free(c);
+/* Sweeps start from empty free lists and add the free objects of each
+   chunk they sweep. Empty chunks are set aside until every chunk is
+   swept. */
+void lsp_mem_sweep_chunk(lsp_mem *m, lsp_chunk *c) {
+    int n_dead = lsp_mem_sweep(m, c);
+    m->n_free += n_dead;
+    m->stats.last_swept += n_dead;
+    if (c->n_live == 0)
+        c->spare = true;
+    else
+        lsp_mem_link_chunk(m, c);
 }
 
-lsp_context * lsp_init() {
-    lsp_context *c = lsp_context_create();
-    lsp_context_push_env(c, lsp_env_create(
-                             lsp_read("(+ - * t nil)", c),
-                             lsp_read("(+ - * t ())", c),
-                             c));
-    return c;
+void lsp_mem_sweep_cell_chunk(lsp_mem *m, lsp_cell_chunk *k) {
+    int n_dead = lsp_mem_sweep_cells(k);
+    m->n_free_cells += n_dead;
+    m->stats.last_swept += n_dead;
+    if (k->n_live == 0)
+        k->spare = true;
+    else
+        lsp_mem_link_cell_chunk(m, k);
 }
 
-void lsp_mem_show_leaks(lsp_mem *m) {
-    int type_counts[OBJ_TYPE_MAX_] = {0};
-    int malformed = 0;
-    for (int i = 0; i < LSP_HEAP_SIZE; i++) {
-        lsp_obj *o = &m->heap[i];
-        if (o->type >= OBJ_TYPE_MAX_ || o->type < 0) {
-            malformed++;
-        } else if (! lsp_obj_is_unused(o)) {
-            type_counts[o->type]++;
+/* Empty chunks are released as long as the heap stays at most half
+   full, the others are linked to the free lists */
+void lsp_mem_release_spare(lsp_mem *m) {
+    int n_live = m->n_chunks * LSP_CHUNK_SIZE - m->n_free;
+    int n_kept = 0;
+    int n_chunks = m->n_chunks;
+    for (int i = 0; i < m->n_chunks; i++) {
+        lsp_chunk *c = m->chunks[i];
+
+        if (c->spare) {
+            if (n_chunks > m->min_chunks &&
+                (n_chunks - 1) * LSP_CHUNK_SIZE >= 2 * n_live) {
+                lsp_free(c);
+                n_chunks--;
+                m->n_free -= LSP_CHUNK_SIZE;
+                continue;
+            }
+            lsp_mem_link_chunk(m, c);
         }
+        m->chunks[n_kept++] = c;
     }
-
-    TRACE("GC stats");
-    TRACE("Leaks:");
-    for (int i = 1; i < OBJ_TYPE_MAX_; i++) {
-        TRACE("%s = %d", obj_type_to_str(i), type_counts[i]);
+    m->n_chunks = n_kept;
+
+    n_live = m->n_cell_chunks * LSP_CELL_CHUNK_SIZE - m->n_free_cells;
+    n_kept = 0;
+    n_chunks = m->n_cell_chunks;
+    for (int i = 0; i < m->n_cell_chunks; i++) {
+        lsp_cell_chunk *k = m->cell_chunks[i];
+
+        if (k->spare) {
+            if (n_chunks > m->min_cell_chunks &&
+                (n_chunks - 1) * LSP_CELL_CHUNK_SIZE >= 2 * n_live) {
+                lsp_free(k);
+                n_chunks--;
+                m->n_free_cells -= LSP_CELL_CHUNK_SIZE;
+                continue;
+            }
+            lsp_mem_link_cell_chunk(m, k);
+        }
+        m->cell_chunks[n_kept++] = k;
     }
-    TRACE_NL;
-    TRACE("Malformed = %d", malformed);
-    TRACE_NL;
+    m->n_cell_chunks = n_kept;
 }
 
-void lsp_mem_shutdown(lsp_context *c) {
-    lsp_mem *m = &c->mem;
-    lsp_obj_mark(c->env_top, UNUSED);
-    lsp_mem_show_leaks(m);
-}
+void lsp_mem_collect(lsp_mem *m) {
+    CHECK(m->free_list == NULL);
+    CHECK(m->free_cells == NULL);
 
-void lsp_shutdown(lsp_context *c) {
-    lsp_mem_shutdown(c);
-    lsp_context_delete(c);
+    TRACE("Collecting garbage...");
+    for (int i = 0; i < m->n_chunks; i++)
+        lsp_mem_sweep_chunk(m, m->chunks[i]);
+    for (int i = 0; i < m->n_cell_chunks; i++)
+        lsp_mem_sweep_cell_chunk(m, m->cell_chunks[i]);
+    lsp_mem_release_spare(m);
+
+    m->n_live = m->n_chunks * LSP_CHUNK_SIZE - m->n_free;
+    m->n_live_cells = m->n_cell_chunks * LSP_CELL_CHUNK_SIZE -
+        m->n_free_cells;
+    TRACE("%d objects live in %d chunks, %d conses in %d chunks",
+          m->n_live, m->n_chunks, m->n_live_cells, m->n_cell_chunks);
 }
 
-lsp_obj * lsp_obj_alloc(lsp_context *ctx) {
-    lsp_obj * o = lsp_mem_get(ctx);
-    lsp_obj_set_mark(o, INTERNAL);
-    return o;
+/* While a cycle sweeps, the objects of the chunks it has not reached
+   yet are only found by sweeping them. A chunk set aside is taken back
+   once every chunk is swept. */
+bool lsp_mem_no_free(lsp_mem *m) {
+    if (m->free_list != NULL || m->phase != GC_SWEEP)
+        return m->free_list == NULL;
+
+    while (m->free_list == NULL && m->sweep_chunk < m->n_chunks)
+        lsp_mem_sweep_chunk(m, m->chunks[m->sweep_chunk++]);
+    for (int i = 0; m->free_list == NULL && i < m->n_chunks; i++) {
+        if (m->chunks[i]->spare)
+            lsp_mem_link_chunk(m, m->chunks[i]);
+    }
+    return m->free_list == NULL;
 }
 
-void lsp_obj_set_mark(lsp_obj *o, lsp_mark_type value) {
-    o->mark = value;
+bool lsp_mem_no_free_cells(lsp_mem *m) {
+    if (m->free_cells != NULL || m->phase != GC_SWEEP)
+        return m->free_cells == NULL;
+
+    while (m->free_cells == NULL &&
+           m->sweep_cell_chunk < m->n_cell_chunks)
+        lsp_mem_sweep_cell_chunk(m,
+                                 m->cell_chunks[m->sweep_cell_chunk++]);
+    for (int i = 0; m->free_cells == NULL && i < m->n_cell_chunks; i++) {
+        if (m->cell_chunks[i]->spare)
+            lsp_mem_link_cell_chunk(m, m->cell_chunks[i]);
+    }
+    return m->free_cells == NULL;
 }
 
-bool lsp_obj_is_internal(lsp_obj *o) {
-    return o->mark == INTERNAL;
+/* Sets the mark of an old cons, returns false if it was already set */
+static inline bool lsp_cell_mark(lsp_cell *c) {
+    lsp_cell_chunk *k = lsp_cell_chunk_of(c);
+    int i = c - k->cells;
+    if (LSP_BIT_GET(k->marked, i))
+        return false;
+    LSP_BIT_SET(k->marked, i);
+    return true;
 }
 
-bool lsp_obj_is_unused(lsp_obj *o) {
-    return o->mark == UNUSED;
+void lsp_obj_stack_push(lsp_obj_stack *s, lsp_obj *o) {
+    if (s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 256;
+        s->objs = realloc(s->objs, s->size * sizeof(lsp_obj *));
+        CHECK(s->objs != NULL);
+    }
+    s->objs[s->n++] = o;
 }
 
-bool lsp_string_equal(const char *s1, const char *s2) {
-    return strcmp(s1, s2) == 0;
+static inline bool lsp_mem_is_young(lsp_mem *m, lsp_obj *o) {
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        return c >= m->cell_nursery &&
+            c < m->cell_nursery + m->cell_nursery_size;
+    }
+    return ! lsp_obj_is_fixnum(o) &&
+        o >= m->nursery && o < m->nursery + m->nursery_size;
 }
 
-bool lsp_num_equal(long int n1, long int n2) {
-    return n1 == n2;
+/* Wall clock time in seconds, for pause times */
+double lsp_mem_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
 }
 
-bool lsp_obj_equal(lsp_obj *o1, lsp_obj *o2) {
-    if (o1->type != o2->type)
-        return false;
-
-    switch (o1->type) {
-    case SYMBOL:
-    case STRING:
-        return lsp_string_equal(o1->value.str, o2->value.str);
-    case NUM:
-        return lsp_num_equal(o1->value.num, o2->value.num);
-    default:
-        break;
-    }
-
-    return false;
+/* Old objects left to mark are pushed on the marking stack, young
+   ones are left to minor collections */
+static inline void lsp_mem_mark_later(lsp_mem *m, lsp_obj *o) {
+    if (! lsp_obj_is_nil(o) && ! lsp_obj_is_fixnum(o) &&
+        ! lsp_mem_is_young(m, o))
+        lsp_obj_stack_push(&m->marking, o);
 }
 
-lsp_obj * lsp_obj_copy(lsp_obj *o, lsp_context *ctx) {
-    if (lsp_obj_is_nil(o)) {
-        return lsp_obj_nil();
-    }
+/* Blackens gray objects until none is left, or until the deadline
+   when there is one (not 0). Returns true once marking is done. */
+bool lsp_mem_mark_step(lsp_mem *m, double deadline) {
+    lsp_obj_stack *gray = &m->marking;
+    int n = 0;
+
+    while (gray->n > 0) {
+        if (gray->n > m->stats.mark_stack_max)
+            m->stats.mark_stack_max = gray->n;
+        lsp_obj *o = gray->objs[--gray->n];
+
+        while (lsp_obj_is_cons(o)) {
+            if (deadline > 0 && ++n % LSP_MARK_CHECK == 0 &&
+                lsp_mem_now() > deadline) {
+                lsp_obj_stack_push(gray, o);
+                return false;
+            }
 
-    lsp_obj *copy = lsp_obj_alloc(ctx);
+            lsp_cell *c = lsp_cell_of(o);
+            if (! lsp_cell_mark(c))
+                break;
+            m->n_marked++;
+            lsp_mem_mark_later(m, c->car);
+            o = c->cdr;
+            if (lsp_mem_is_young(m, o))
+                break;
+        }
 
-    copy->type = o->type;
-    copy->value = o->value;
-    
-    switch (o->type) {
-    case NUM:
-    case STRING:
-    case SYMBOL:
-        break;
-    case CONS:
-        copy->value.con.car = lsp_obj_copy(lsp_car(o), ctx);
-        copy->value.con.cdr = lsp_obj_copy(lsp_cdr(o), ctx);
-        break;
-    case QUOTE:
-        copy->value.expr = lsp_obj_copy(o->value.expr, ctx);
-        break;
-    case LAMBDA:
-        copy->value.lambda.args = lsp_obj_copy(o->value.lambda.args, ctx);
-        copy->value.lambda.body = lsp_obj_copy(o->value.lambda.body, ctx);
-        break;
-    case ENV:
-    default:
-        SHOULD_NEVER_BE_HERE;
+        if (lsp_obj_is_cons(o) || lsp_obj_is_nil(o) ||
+            lsp_obj_is_fixnum(o) || lsp_mem_is_young(m, o) ||
+            o->mark == m->black)
+            continue;
+
+        o->mark = m->black;
+        m->n_marked++;
+
+        switch (o->type) {
+        case FREELIST:
+        case STRING:
+        case NUM:
+        case SYMBOL:
+        case NIL:
+        case LOCAL:
+        case PRIMITIVE:
+            break;
+        case ENV:
+            lsp_mem_mark_later(m, o->value.env.names);
+            lsp_mem_mark_later(m, o->value.env.values);
+            break;
+        case QUOTE:
+            lsp_mem_mark_later(m, o->value.expr);
+            break;
+        case GLOBAL:
+            if (o->value.global.value)
+                lsp_mem_mark_later(m, o->value.global.value);
+            break;
+        case LAMBDA:
+            lsp_mem_mark_later(m, o->value.lambda.args);
+            lsp_mem_mark_later(m, o->value.lambda.body);
+            if (o->value.lambda.code)
+                lsp_mem_mark_later(m, o->value.lambda.code);
+            if (o->value.lambda.closed)
+                lsp_mem_mark_later(m, o->value.lambda.closed);
+            break;
+        case CODE:
+            lsp_mem_mark_later(m, o->value.code->args);
+            lsp_mem_mark_later(m, o->value.code->body);
+            for (int i = 0; i < o->value.code->n_consts; i++)
+                lsp_mem_mark_later(m, o->value.code->consts[i]);
+            break;
+        default:
+            SHOULD_NEVER_BE_HERE;
+        }
     }
-    return copy;
+    return true;
 }
 
-lsp_obj * lsp_obj_cons(lsp_obj *car, lsp_obj *cdr,
-                       lsp_context *ctx) {
-    lsp_obj *o = lsp_obj_alloc(ctx);
-
-    o->type = CONS;
-    o->value.con.car = car;
-    o->value.con.cdr = cdr;
-    
-    return o;
+/* Called before a field of an old object loses its value: what was
+   reachable when marking began must stay so */
+static inline void lsp_mem_shade(lsp_mem *m, lsp_obj *old) {
+    if (m->phase == GC_MARK && old != NULL)
+        lsp_mem_mark_later(m, old);
 }
 
-lsp_obj * lsp_env_create(lsp_obj *names, lsp_obj *values,
-                         lsp_context *ctx) {
-    lsp_obj *o = lsp_obj_alloc(ctx);
+/* The snapshot of the roots, taken with the nursery empty */
+void lsp_mem_gray_roots(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+    for (int i = 0; i < ctx->env.fp; i++)
+        lsp_mem_mark_later(m, ctx->env.frames[i].owner);
+
+    lsp_globals *g = &ctx->globals;
+    for (size_t i = 0; i < g->n_slots; i++) {
+        if (g->names[i] == NULL)
+            continue;
+        lsp_mem_mark_later(m, g->values[i]);
+        if (g->sources[i] != NULL)
+            lsp_mem_mark_later(m, g->sources[i]);
+        if (g->depends[i] != NULL)
+            lsp_mem_mark_later(m, g->depends[i]);
+    }
 
-    o->type = ENV;
+    for (int i = 0; i < ctx->vm.sp; i++)
+        lsp_mem_mark_later(m, ctx->vm.stack[i]);
 
-    o->value.env.names = names ? names : lsp_obj_nil();
-    o->value.env.values = values ? values : lsp_obj_nil();
+    for (int i = 0; i < ctx->roots.n; i++)
+        lsp_mem_mark_later(m, *ctx->roots.vars[i]);
 
-    return o;
-}
+    for (int i = 0; i < ctx->handles.n; i++)
+        lsp_mem_mark_later(m, ctx->handles.objs[i]);
 
-void lsp_env_add(lsp_env *env, lsp_obj *name, lsp_obj *value,
-                 lsp_context *ctx) {
-    env->names = lsp_obj_cons(name, env->names, ctx);
-    env->values = lsp_obj_cons(value, env->values, ctx);
+    lsp_copies *t = &ctx->copies;
+    for (size_t i = 0; i < t->n_slots; i++) {
+        if (t->keys[i] != NULL)
+            lsp_mem_mark_later(m, t->objs[i]);
+    }
 }
 
-lsp_obj * lsp_env_lookup(lsp_obj *env, lsp_obj *name,
-                         lsp_context *ctx) {
-    if (lsp_obj_is_nil(env)) {
-        TRACE("Lookup failed for: %s", lsp_obj_as_string(name));
-        return lsp_obj_nil();
+/* Only the reader makes constants, in the old space */
+void lsp_obj_set_const(lsp_obj *o) {
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        lsp_cell_chunk *k = lsp_cell_chunk_of(c);
+        LSP_BIT_SET(k->constant, c - k->cells);
+    } else if (! lsp_obj_is_nil(o) && ! lsp_obj_is_fixnum(o)) {
+        o->flags |= LSP_FLAG_CONST;
     }
-     
-    lsp_obj *names = lsp_car(env)->value.env.names;
-    lsp_obj *values = lsp_car(env)->value.env.values;
+}
 
-    while (! lsp_obj_is_nil(names)) {
-        if (lsp_obj_equal(name, lsp_car(names)))
-            return lsp_obj_copy(lsp_car(values), ctx);
-        
-        names = lsp_cdr(names);
-        values = lsp_cdr(values);
+bool lsp_obj_is_const(lsp_mem *m, lsp_obj *o) {
+    if (lsp_mem_is_young(m, o) || lsp_obj_is_fixnum(o))
+        return false;
+
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        lsp_cell_chunk *k = lsp_cell_chunk_of(c);
+        return LSP_BIT_GET(k->constant, c - k->cells);
     }
-    return lsp_env_lookup(lsp_cdr(env), name, ctx);
+    return (o->flags & LSP_FLAG_CONST) != 0;
 }
 
-lsp_obj * lsp_obj_num(long int num, lsp_context *ctx) {
-    lsp_obj *o = lsp_obj_alloc(ctx);
-    o->type = NUM;
-    o->value.num = num;
-    return o;
+/* Sets the remembered flag of an old object, returns false if it was
+   already set */
+bool lsp_mem_remember(lsp_obj *o) {
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        lsp_cell_chunk *k = lsp_cell_chunk_of(c);
+        int i = c - k->cells;
+        if (LSP_BIT_GET(k->remembered, i))
+            return false;
+        LSP_BIT_SET(k->remembered, i);
+    } else {
+        if (o->flags & LSP_FLAG_REMEMBERED)
+            return false;
+        o->flags |= LSP_FLAG_REMEMBERED;
+    }
+    return true;
 }
 
-lsp_obj * lsp_obj_string(const char *str, lsp_context *ctx) {
-    lsp_obj *o = lsp_obj_alloc(ctx);
-    o->type = STRING;
-    strncpy(o->value.str, str, LSP_STRING_SIZE);
-    return o;
+void lsp_mem_forget(lsp_obj *o) {
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        lsp_cell_chunk *k = lsp_cell_chunk_of(c);
+        LSP_BIT_CLEAR(k->remembered, c - k->cells);
+    } else {
+        o->flags &= ~LSP_FLAG_REMEMBERED;
+    }
 }
 
-lsp_obj * lsp_obj_symbol(const char *str, lsp_context *ctx) {
-    lsp_obj *o = lsp_obj_alloc(ctx);
-    o->type = SYMBOL;
-    strncpy(o->value.str, str, LSP_STRING_SIZE);
-    return o;
+/* Called after storing value in a field of holder */
+static inline void lsp_mem_barrier(lsp_mem *m, lsp_obj *holder,
+                                   lsp_obj *value) {
+    if (lsp_mem_is_young(m, value) && ! lsp_mem_is_young(m, holder) &&
+        lsp_mem_remember(holder))
+        lsp_obj_stack_push(&m->remembered, holder);
 }
 
-lsp_obj * lsp_obj_quote(lsp_obj *expr, lsp_context *ctx) {
-    lsp_obj *o = lsp_obj_alloc(ctx);
-    o->type = QUOTE;
-    o->value.expr = expr;
-    return o;
+/* Objects and conses taken in the old space */
+size_t lsp_mem_used(lsp_mem *m) {
+    return m->n_chunks * LSP_CHUNK_SIZE - m->n_free +
+        m->n_cell_chunks * LSP_CELL_CHUNK_SIZE - m->n_free_cells;
 }
 
-long int lsp_obj_as_num(lsp_obj *o) {
-    CHECK(o->type == NUM);
-    return o->value.num;
-}
+/* Called after each collection */
+void lsp_mem_pause(lsp_mem *m, double pause) {
+    lsp_gc_stats *s = &m->stats;
+    s->pause_time += pause;
+    if (pause > s->max_pause)
+        s->max_pause = pause;
 
-const char * lsp_obj_as_string(lsp_obj *o) {
-    CHECK(o->type == STRING || o->type == SYMBOL);
-    return o->value.str;
+    size_t used = lsp_mem_used(m);
+    if (used > s->peak_live)
+        s->peak_live = used;
 }
 
-void lsp_obj_delete(lsp_obj *o) {
-    lsp_free(o);
+/* A cycle begins at the end of a minor collection, so the snapshot
+   of the roots only holds old objects */
+void lsp_mem_major_start(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+    CHECK(m->nursery_top == 0 && m->cell_nursery_top == 0);
+
+    double t0 = lsp_mem_now();
+    lsp_mem_whiten(m);
+    m->phase = GC_MARK;
+    m->n_marked = 0;
+    m->n_used = lsp_mem_used(m);
+    m->sweep_chunk = 0;
+    m->sweep_cell_chunk = 0;
+    m->stats.last_swept = 0;
+    lsp_mem_gray_roots(ctx);
+    m->stats.unmark_time += lsp_mem_now() - t0;
 }
 
-char * lsp_eat_space(char *txt) {
-    char *pos = txt;
-    while (*pos == ' ')
-        pos++;
-    return pos;
+/* Sweeps whole chunks until none is left or the deadline passes,
+   returns true once all are swept */
+bool lsp_mem_sweep_chunks(lsp_mem *m, double deadline) {
+    bool done = false;
+
+    while (! done) {
+        if (m->sweep_chunk < m->n_chunks)
+            lsp_mem_sweep_chunk(m, m->chunks[m->sweep_chunk++]);
+        else if (m->sweep_cell_chunk < m->n_cell_chunks)
+            lsp_mem_sweep_cell_chunk(m,
+                                     m->cell_chunks[m->sweep_cell_chunk++]);
+        else
+            done = true;
+
+        if (deadline > 0 && lsp_mem_now() > deadline)
+            break;
+    }
+    return done;
 }
 
-lsp_obj *lsp_truth(bool value, lsp_context *ctx) {
-    if (value)
-        return lsp_obj_symbol("t", ctx);
-    else
-        return lsp_obj_nil();
-}
+/* Counts the cycle and releases the chunks its sweep left empty. The
+   heap is to grow when less than half of a space could be reclaimed,
+   with room to promote a full nursery, or two while collecting
+   incrementally so that the next cycle has time to run. The chunks
+   are added later, a few at a time. */
+void lsp_mem_major_end(lsp_mem *m) {
+    lsp_gc_stats *s = &m->stats;
+    m->phase = GC_IDLE;
+    lsp_mem_release_spare(m);
+    m->n_live = m->n_chunks * LSP_CHUNK_SIZE - m->n_free;
+    m->n_live_cells = m->n_cell_chunks * LSP_CELL_CHUNK_SIZE -
+        m->n_free_cells;
+
+    /* Objects allocated black while the cycle ran count as marked */
+    s->n_major++;
+    s->last_marked = m->n_marked + lsp_mem_used(m) + s->last_swept -
+        m->n_used;
+    s->n_freed += s->last_swept;
+    TRACE("%lu objects in use, %lu swept", (unsigned long) s->last_marked,
+          (unsigned long) s->last_swept);
+
+    int room = m->step_time > 0 ? 2 : 1;
+    size_t bytes = sizeof(lsp_chunk);
+    m->grow_chunks = 0;
+    while (lsp_mem_can_grow(m, bytes) &&
+           (m->n_free + m->grow_chunks * LSP_CHUNK_SIZE <
+            room * m->nursery_size ||
+            2 * m->n_live > (m->n_chunks + m->grow_chunks) * LSP_CHUNK_SIZE)) {
+        m->grow_chunks++;
+        bytes += sizeof(lsp_chunk);
+    }
 
-char lsp_peek(char *txt) {
-    return txt[0];
+    bytes += LSP_CELL_CHUNK_BYTES - sizeof(lsp_chunk);
+    m->grow_cell_chunks = 0;
+    while (lsp_mem_can_grow(m, bytes) &&
+           (m->n_free_cells + m->grow_cell_chunks * LSP_CELL_CHUNK_SIZE <
+            room * m->cell_nursery_size ||
+            2 * m->n_live_cells >
+            (m->n_cell_chunks + m->grow_cell_chunks) * LSP_CELL_CHUNK_SIZE)) {
+        m->grow_cell_chunks++;
+        bytes += LSP_CELL_CHUNK_BYTES;
+    }
 }
 
-bool lsp_is_digit(char c) {
-    return c >= 48 && c < 58;
+/* Adds the chunks the last major collection asked for until the
+   deadline passes, returns true once none is left */
+bool lsp_mem_grow(lsp_mem *m, double deadline) {
+    while (m->grow_chunks > 0 || m->grow_cell_chunks > 0) {
+        if (deadline > 0 && lsp_mem_now() > deadline)
+            return false;
+
+        if (m->grow_chunks > 0 && lsp_mem_can_grow(m, sizeof(lsp_chunk)))
+            lsp_mem_add_chunk(m);
+        else if (m->grow_cell_chunks > 0 &&
+                 lsp_mem_can_grow(m, LSP_CELL_CHUNK_BYTES))
+            lsp_mem_add_cell_chunk(m);
+        else
+            m->grow_chunks = m->grow_cell_chunks = 0;
+    }
+    return true;
 }
 
-lsp_obj * lsp_read_num(char *txt, char **next,
-                       lsp_context *ctx) {
-    const long int num = strtol(txt, next, 10);
-    return lsp_obj_num(num, ctx);
+/* Grows the heap by what the next minor collection may promote while a
+   cycle is under way, or while the last one asked for more. False when
+   there is no room for another nursery. */
+bool lsp_mem_make_room(lsp_mem *m) {
+    bool running = m->phase != GC_IDLE;
+
+    while (m->n_free < m->nursery_size &&
+           (running || m->grow_chunks > 0) &&
+           lsp_mem_can_grow(m, sizeof(lsp_chunk)))
+        lsp_mem_add_chunk(m);
+
+    while (m->n_free_cells < m->cell_nursery_size &&
+           (running || m->grow_cell_chunks > 0) &&
+           lsp_mem_can_grow(m, LSP_CELL_CHUNK_BYTES))
+        lsp_mem_add_cell_chunk(m);
+
+    return m->n_free >= m->nursery_size &&
+        m->n_free_cells >= m->cell_nursery_size;
 }
 
-char * lsp_make_string(const char *data, int len) {
-    char *s = lsp_alloc(sizeof(char) * len + 1);
-    memcpy(s, data, len);
-    s[len] = '\0';
-    return s;
+/* Runs a whole major collection, or finishes the cycle under way,
+   in one pause. Without incremental steps to spread it, the heap
+   grows in the same pause. */
+void lsp_mem_major(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+    lsp_gc_stats *s = &m->stats;
+
+    double t0 = lsp_mem_now();
+    if (m->phase == GC_IDLE)
+        lsp_mem_major_start(ctx);
+
+    double t1 = lsp_mem_now();
+    double t2 = t1;
+    if (m->phase == GC_MARK) {
+        lsp_mem_mark_step(m, 0);
+        t2 = lsp_mem_now();
+
+        /* Nothing is swept yet, so the free lists are rebuilt from
+           scratch in one go */
+        m->free_list = NULL;
+        m->free_cells = NULL;
+        lsp_mem_collect(m);
+    } else {
+        lsp_mem_sweep_chunks(m, 0);
+    }
+    double t3 = lsp_mem_now();
+
+    s->mark_time += t2 - t1;
+    s->sweep_time += t3 - t2;
+    lsp_mem_major_end(m);
+    if (m->step_time > 0)
+        lsp_mem_make_room(m);
+    else
+        lsp_mem_grow(m, 0);
+    double t4 = lsp_mem_now();
+    lsp_mem_pause(m, t4 - t0);
+    TRACE("Major collection: start %.3f ms, mark %.3f ms, sweep %.3f ms, "
+          "grow %.3f ms", (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+          (t3 - t2) * 1e3, (t4 - t3) * 1e3);
 }
 
-lsp_obj * lsp_read_symbol(char *txt, char **next,
-                          lsp_context *ctx) {
-    size_t span = strcspn(txt, " )");
+/* Advances the major collection for at most step_time after a minor
+   one. While the heap has chunks left to add, that is all a step
+   does. Otherwise a cycle begins once less than two nurseries could
+   be promoted into the free space. */
+void lsp_mem_major_step(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+    lsp_gc_stats *s = &m->stats;
 
-    /* FIXME: Memory leak */
-    char *s = lsp_make_string(txt, span);
+    if (m->phase == GC_IDLE) {
+        if (m->grow_chunks > 0 || m->grow_cell_chunks > 0) {
+            lsp_mem_grow(m, lsp_mem_now() + m->step_time);
+            return;
+        }
+        if (m->n_free >= 2 * m->nursery_size &&
+            m->n_free_cells >= 2 * m->cell_nursery_size)
+            return;
+        lsp_mem_major_start(ctx);
+    }
 
-    *next = txt + span;
-    
-    lsp_obj *o = lsp_obj_symbol(s, ctx);
-    lsp_free(s);
+    double t0 = lsp_mem_now();
+    double deadline = t0 + m->step_time;
+    if (m->phase == GC_MARK) {
+        bool done = lsp_mem_mark_step(m, deadline);
+        double t1 = lsp_mem_now();
+        s->mark_time += t1 - t0;
+        if (! done)
+            return;
+
+        /* The sweep rebuilds the free lists */
+        m->free_list = NULL;
+        m->free_cells = NULL;
+        m->phase = GC_SWEEP;
+        t0 = t1;
+    }
+
+    bool done = lsp_mem_sweep_chunks(m, deadline);
+    s->sweep_time += lsp_mem_now() - t0;
+    if (done)
+        lsp_mem_major_end(m);
+}
+
+lsp_obj * lsp_mem_promote(lsp_mem *m, lsp_obj *o) {
+    if (lsp_mem_no_free(m)) {
+        CHECK(lsp_mem_can_grow(m, sizeof(lsp_chunk)));
+        lsp_mem_add_chunk(m);
+    }
+
+    lsp_obj *copy = lsp_mem_alloc(m);
+    *copy = *o;
+    copy->mark = m->black;
+    lsp_obj_stack_push(&m->gray, copy);
+
+    o->mark = FORWARDED;
+    o->value.next = copy;
+    return copy;
+}
+
+lsp_obj * lsp_mem_promote_cell(lsp_mem *m, lsp_cell *c) {
+    if (lsp_mem_no_free_cells(m)) {
+        CHECK(lsp_mem_can_grow(m, LSP_CELL_CHUNK_BYTES));
+        lsp_mem_add_cell_chunk(m);
+    }
+
+    lsp_obj *copy = lsp_cell_obj(lsp_mem_alloc_cell(m));
+    *lsp_cell_of(copy) = *c;
+    lsp_obj_stack_push(&m->gray, copy);
+
+    c->car = (lsp_obj *) &static_obj_forwarded;
+    c->cdr = copy;
+    return copy;
+}
+
+static inline lsp_obj * lsp_mem_forward(lsp_mem *m, lsp_obj *o) {
+    if (! lsp_mem_is_young(m, o))
+        return o;
+
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        return c->car == &static_obj_forwarded ?
+            c->cdr : lsp_mem_promote_cell(m, c);
+    }
+    return o->mark == FORWARDED ? o->value.next : lsp_mem_promote(m, o);
+}
+
+void lsp_mem_forward_fields(lsp_mem *m, lsp_obj *o) {
+    if (lsp_obj_is_cons(o)) {
+        lsp_cell *c = lsp_cell_of(o);
+        c->car = lsp_mem_forward(m, c->car);
+        c->cdr = lsp_mem_forward(m, c->cdr);
+        return;
+    }
+
+    switch (o->type) {
+    case ENV:
+        o->value.env.names = lsp_mem_forward(m, o->value.env.names);
+        o->value.env.values = lsp_mem_forward(m, o->value.env.values);
+        break;
+    case QUOTE:
+        o->value.expr = lsp_mem_forward(m, o->value.expr);
+        break;
+    case GLOBAL:
+        if (o->value.global.value)
+            o->value.global.value = lsp_mem_forward(m, o->value.global.value);
+        break;
+    case LAMBDA:
+        o->value.lambda.args = lsp_mem_forward(m, o->value.lambda.args);
+        o->value.lambda.body = lsp_mem_forward(m, o->value.lambda.body);
+        o->value.lambda.closed = lsp_mem_forward(m, o->value.lambda.closed);
+        break;
+    default:
+        /* Code and strings are never young and the other types hold
+           no objects that can be */
+        break;
+    }
+}
+
+/* Copies the objects reachable from the roots out of the nurseries,
+   scanning the promoted ones until no young object is left */
+void lsp_mem_minor(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+    TRACE("Minor collection of %d objects and %d conses...",
+          m->nursery_top, m->cell_nursery_top);
+    double t0 = lsp_mem_now();
+    size_t n_young = m->nursery_top + m->cell_nursery_top;
+    size_t n_used = lsp_mem_used(m);
+
+    for (int i = 0; i < ctx->env.fp; i++) {
+        lsp_env_frame *f = &ctx->env.frames[i];
+        f->owner = lsp_mem_forward(m, f->owner);
+    }
+
+    lsp_globals *g = &ctx->globals;
+    for (size_t i = 0; i < g->n_slots; i++) {
+        if (g->names[i] == NULL)
+            continue;
+        g->values[i] = lsp_mem_forward(m, g->values[i]);
+        if (g->sources[i] != NULL)
+            g->sources[i] = lsp_mem_forward(m, g->sources[i]);
+        if (g->depends[i] != NULL)
+            g->depends[i] = lsp_mem_forward(m, g->depends[i]);
+    }
+
+    for (int i = 0; i < ctx->vm.sp; i++)
+        ctx->vm.stack[i] = lsp_mem_forward(m, ctx->vm.stack[i]);
+
+    for (int i = 0; i < ctx->roots.n; i++)
+        *ctx->roots.vars[i] = lsp_mem_forward(m, *ctx->roots.vars[i]);
+
+    for (int i = 0; i < ctx->handles.n; i++)
+        ctx->handles.objs[i] = lsp_mem_forward(m, ctx->handles.objs[i]);
+
+    lsp_copies *t = &ctx->copies;
+    for (size_t i = 0; i < t->n_slots; i++) {
+        if (t->keys[i] != NULL)
+            t->objs[i] = lsp_mem_forward(m, t->objs[i]);
+    }
+
+    for (size_t i = 0; i < m->remembered.n; i++) {
+        lsp_mem_forget(m->remembered.objs[i]);
+        lsp_mem_forward_fields(m, m->remembered.objs[i]);
+    }
+    m->remembered.n = 0;
+
+    while (m->gray.n > 0)
+        lsp_mem_forward_fields(m, m->gray.objs[--m->gray.n]);
+
+    m->nursery_top = 0;
+    m->cell_nursery_top = 0;
+
+    size_t n_promoted = lsp_mem_used(m) - n_used;
+    m->stats.n_minor++;
+    m->stats.n_promoted += n_promoted;
+    m->stats.n_freed += n_young - n_promoted;
+    m->stats.minor_time += lsp_mem_now() - t0;
+
+    /* The pause includes the step of the major collection and the
+       growth that makes room for the next nursery */
+    if (m->step_time > 0)
+        lsp_mem_major_step(ctx);
+    bool room = lsp_mem_make_room(m);
+    lsp_mem_pause(m, lsp_mem_now() - t0);
+
+    if (! room)
+        lsp_mem_major(ctx);
+}
+
+/* Used for objects that are known to live long, code and symbols */
+lsp_obj * lsp_mem_get_old(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+
+    if (lsp_mem_no_free(m)) {
+        TRACE_NL;
+        lsp_mem_minor(ctx);
+        if (lsp_mem_no_free(m))
+            lsp_mem_major(ctx);
+    }
+
+    CHECK(lsp_mem_no_free(m) == false);
+
+    lsp_obj *o = lsp_mem_alloc(m);
+    memset(o, 0, sizeof(lsp_obj));
     return o;
 }
 
-lsp_obj * lsp_read_string(char *txt, char **next,
-                          lsp_context *ctx) {
-    txt++;
-    size_t span = strcspn(txt, "\"");
-    char *s = lsp_make_string(txt, span);
+lsp_obj *lsp_mem_get(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
 
-    *next = txt + span + 1;
+    if (m->pretenure > 0)
+        return lsp_mem_get_old(ctx);
 
-    lsp_obj *o = lsp_obj_string(s, ctx);
-    free(s);
+    if (m->nursery_top == m->nursery_size) {
+        TRACE_NL;
+        lsp_mem_minor(ctx);
+    }
+
+    lsp_obj *o = &m->nursery[m->nursery_top++];
+    memset(o, 0, sizeof(lsp_obj));
     return o;
 }
 
-lsp_obj * lsp_read_list_inner(char *txt, char **next,
-                              lsp_context *ctx) {
-    lsp_obj *car = lsp_read_obj(txt, next, ctx);
-    txt = lsp_eat_space(*next);
-    
-    lsp_obj *cdr = NULL;
-    
-    if (lsp_peek(txt) == ')') {
-        cdr = lsp_obj_nil();
-        *next = txt + 1;
-    } else {
-        cdr = lsp_read_list_inner(txt, next, ctx);
+lsp_cell * lsp_mem_get_cell(lsp_context *ctx) {
+    lsp_mem *m = &ctx->mem;
+    m->stats.allocated[CONS]++;
+
+    if (m->pretenure > 0) {
+        if (lsp_mem_no_free_cells(m)) {
+            TRACE_NL;
+            lsp_mem_minor(ctx);
+            if (lsp_mem_no_free_cells(m))
+                lsp_mem_major(ctx);
+        }
+        CHECK(! lsp_mem_no_free_cells(m));
+        return lsp_mem_alloc_cell(m);
+    }
+
+    if (m->cell_nursery_top == m->cell_nursery_size) {
+        TRACE_NL;
+        lsp_mem_minor(ctx);
+    }
+
+    return &m->cell_nursery[m->cell_nursery_top++];
+}
+
+/* Promotes a young object together with what it references, so that
+   it no longer moves */
+void lsp_mem_settle(lsp_obj **var, lsp_context *ctx) {
+    if (lsp_mem_is_young(&ctx->mem, *var)) {
+        lsp_protect(var, ctx);
+        lsp_mem_minor(ctx);
+        lsp_unprotect(1, ctx);
+    }
+}
+
+/* Objects given to the host must not move */
+lsp_obj * lsp_obj_hold(lsp_obj *o, lsp_context *ctx) {
+    lsp_mem_settle(&o, ctx);
+
+    lsp_handles *h = &ctx->handles;
+    if (h->n == h->size) {
+        h->size = h->size ? h->size * 2 : 16;
+        h->objs = realloc(h->objs, h->size * sizeof(lsp_obj *));
+        CHECK(h->objs != NULL);
+    }
+    h->objs[h->n++] = o;
+    return o;
+}
+
+void lsp_obj_release(lsp_obj *o, lsp_context *ctx) {
+    lsp_handles *h = &ctx->handles;
+    for (int i = h->n - 1; i >= 0; i--) {
+        if (h->objs[i] == o) {
+            h->objs[i] = h->objs[--h->n];
+            return;
+        }
+    }
+}
+
+/* Half of the initial heap goes to objects and half to conses, each
+   split between the nursery and the old space */
+void lsp_mem_init(lsp_mem *m, const lsp_config *config) {
+    TRACE("Initializing heap...");
+
+    size_t initial = LSP_HEAP_INITIAL;
+    size_t max = 0;
+    long pause_us = LSP_PAUSE_US;
+    if (config != NULL) {
+        if (config->heap_initial > 0)
+            initial = config->heap_initial;
+        max = config->heap_max;
+        if (config->pause_us != 0)
+            pause_us = config->pause_us;
+    }
+
+    memset(m, 0, sizeof(lsp_mem));
+    m->black = MARK_EVEN;
+    m->step_time = pause_us > 0 ? pause_us * 1e-6 : 0;
+    CHECK(sizeof(lsp_cell_chunk) <= LSP_CELL_CHUNK_BYTES);
+    CHECK(OBJ_TYPE_MAX_ <= LSP_STATS_TYPES);
+
+    size_t nursery = initial / 2;
+    if (nursery > LSP_NURSERY_MAX)
+        nursery = LSP_NURSERY_MAX;
+    if (nursery < LSP_NURSERY_MIN)
+        nursery = LSP_NURSERY_MIN;
+
+    m->min_chunks = initial / 4 / sizeof(lsp_chunk);
+    if (m->min_chunks < 1)
+        m->min_chunks = 1;
+    m->min_cell_chunks = initial / 4 / LSP_CELL_CHUNK_BYTES;
+    if (m->min_cell_chunks < 1)
+        m->min_cell_chunks = 1;
+
+    for (int i = 0; i < m->min_chunks; i++)
+        lsp_mem_add_chunk(m);
+    for (int i = 0; i < m->min_cell_chunks; i++)
+        lsp_mem_add_cell_chunk(m);
+
+    m->max_bytes = max;
+    if (m->max_bytes > 0 && m->max_bytes < lsp_mem_bytes(m))
+        m->max_bytes = lsp_mem_bytes(m);
+
+    m->nursery_size = nursery / 2 / sizeof(lsp_obj);
+    m->nursery = lsp_alloc(m->nursery_size * sizeof(lsp_obj));
+    CHECK(m->nursery != NULL);
+
+    m->cell_nursery_size = nursery / 2 / sizeof(lsp_cell);
+    m->cell_nursery = lsp_alloc(m->cell_nursery_size * sizeof(lsp_cell));
+    CHECK(m->cell_nursery != NULL);
+}
+
+void lsp_context_push_env(lsp_context *ctx, lsp_obj *env);
+void lsp_install_primitives(lsp_context *ctx);
+void lsp_vm_init(lsp_vm *vm);
+void lsp_vm_shutdown(lsp_vm *vm);
+void lsp_symtab_init(lsp_context *ctx);
+void lsp_symtab_shutdown(lsp_symtab *t);
+void lsp_globals_grow(lsp_globals *g);
+void lsp_mem_release(lsp_mem *m);
+
+static lsp_context * lsp_context_create(const lsp_config *config) {
+    lsp_context *c = lsp_alloc(sizeof(lsp_context));
+    lsp_mem_init(&c->mem, config);
+
+    memset(&c->roots, 0, sizeof(lsp_roots));
+    memset(&c->handles, 0, sizeof(lsp_handles));
+    memset(&c->copies, 0, sizeof(lsp_copies));
+    memset(&c->natives, 0, sizeof(lsp_natives));
+    memset(&c->env, 0, sizeof(lsp_env_stack));
+    memset(&c->globals, 0, sizeof(lsp_globals));
+    lsp_globals_grow(&c->globals);
+    c->globals.version = 1;
+    lsp_buf_init(&c->print, NULL);
+    c->n_workers = config != NULL ? config->n_workers : 0;
+    if (c->n_workers == 0)
+        c->n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    c->pool = NULL;
+    c->parent = NULL;
+    lsp_vm_init(&c->vm);
+    lsp_symtab_init(c);
+    return c;
+}
+
+static void lsp_context_delete(lsp_context *c) {
+    lsp_free(c->roots.vars);
+    lsp_free(c->handles.objs);
+    lsp_symtab_shutdown(&c->symbols);
+    lsp_free(c->globals.names);
+    lsp_free(c->globals.values);
+    lsp_free(c->globals.sources);
+    lsp_free(c->globals.depends);
+    lsp_free(c->env.frames);
+    for (int i = 0; i < c->natives.n; i++) {
+        lsp_free((char *) c->natives.prims[i]->name);
+        lsp_free(c->natives.prims[i]);
+    }
+    lsp_free(c->natives.prims);
+    lsp_buf_free(&c->print);
+    lsp_vm_shutdown(&c->vm);
+    lsp_mem_release(&c->mem);
+    lsp_free(c);
+}
+
+lsp_obj * lsp_read_text(char *txt, lsp_context *ctx);
+
+lsp_context * lsp_init(const lsp_config *config) {
+    lsp_context *c = lsp_context_create(config);
+
+    lsp_obj *names = lsp_read_text("(t nil)", c);
+    lsp_protect(&names, c);
+    lsp_obj *values = lsp_read_text("(t ())", c);
+
+    lsp_context_push_env(c, lsp_env_create(names, values, c));
+    lsp_unprotect(1, c);
+    lsp_install_primitives(c);
+    return c;
+}
+
+void lsp_mem_show_leaks(lsp_mem *m) {
+    int type_counts[OBJ_TYPE_MAX_] = {0};
+    int malformed = 0;
+    for (int i = 0; i < m->n_chunks; i++) {
+        for (int j = 0; j < LSP_CHUNK_SIZE; j++) {
+            lsp_obj *o = &m->chunks[i]->objs[j];
+            if (o->type >= OBJ_TYPE_MAX_ || o->type < 0) {
+                malformed++;
+            } else if (o->mark == m->black && o->type != SYMBOL) {
+                type_counts[o->type]++;
+            }
+        }
+    }
+
+    for (int i = 0; i < m->n_cell_chunks; i++) {
+        lsp_cell_chunk *k = m->cell_chunks[i];
+        for (int j = 0; j < LSP_CELL_CHUNK_SIZE; j++)
+            type_counts[CONS] += LSP_BIT_GET(k->marked, j);
+    }
+
+    lsp_gc_stats *s = &m->stats;
+    TRACE("GC stats");
+    TRACE("Minor collections = %lu, %.3f ms, %lu objects promoted",
+          s->n_minor, s->minor_time * 1e3, s->n_promoted);
+    TRACE("Major collections = %lu, unmark %.3f ms, mark %.3f ms, "
+          "sweep %.3f ms", s->n_major, s->unmark_time * 1e3,
+          s->mark_time * 1e3, s->sweep_time * 1e3);
+    TRACE("Longest pause = %.3f ms, deepest mark stack = %lu",
+          s->max_pause * 1e3, (unsigned long) s->mark_stack_max);
+    TRACE_NL;
+    TRACE("Leaks:");
+    for (int i = 1; i < OBJ_TYPE_MAX_; i++) {
+        TRACE("%s = %d", obj_type_to_str(i), type_counts[i]);
+    }
+    TRACE_NL;
+    TRACE("Malformed = %d", malformed);
+    TRACE_NL;
+}
+
+void lsp_mem_shutdown(lsp_context *c) {
+    lsp_mem *m = &c->mem;
+
+    /* What the host still holds is leaked */
+    c->env.fp = 0;
+    memset(c->globals.names, 0, c->globals.n_slots * sizeof(lsp_obj *));
+    c->globals.n_globals = 0;
+    lsp_mem_minor(c);
+
+    /* A cycle under way is dropped for a full mark */
+    m->marking.n = 0;
+    m->phase = GC_IDLE;
+    lsp_mem_whiten(m);
+    lsp_mem_gray_roots(c);
+    lsp_mem_mark_step(m, 0);
+    lsp_mem_show_leaks(m);
+
+    for (int i = 0; i < m->n_chunks; i++) {
+        lsp_obj *objs = m->chunks[i]->objs;
+        for (int j = 0; j < LSP_CHUNK_SIZE; j++)
+            lsp_obj_finalize(&objs[j]);
+    }
+}
+
+/* After the symbol table, which still reads the symbols */
+void lsp_mem_release(lsp_mem *m) {
+    for (int i = 0; i < m->n_chunks; i++)
+        lsp_free(m->chunks[i]);
+    lsp_free(m->chunks);
+    for (int i = 0; i < m->n_cell_chunks; i++)
+        lsp_free(m->cell_chunks[i]);
+    lsp_free(m->cell_chunks);
+    lsp_free(m->nursery);
+    lsp_free(m->cell_nursery);
+    lsp_free(m->remembered.objs);
+    lsp_free(m->gray.objs);
+    lsp_free(m->marking.objs);
+}
+
+void lsp_stats(lsp_context *ctx, lsp_gc_stats *out) {
+    lsp_mem *m = &ctx->mem;
+    *out = m->stats;
+
+    out->n_allocated = 0;
+    for (int i = 0; i < OBJ_TYPE_MAX_; i++)
+        out->n_allocated += out->allocated[i];
+    out->in_use = lsp_mem_used(m) + m->nursery_top + m->cell_nursery_top;
+    out->heap_size = lsp_mem_bytes(m);
+}
+
+const char * lsp_type_name(int type) {
+    return type > FREELIST && type < OBJ_TYPE_MAX_ ?
+        obj_type_to_str(type) : NULL;
+}
+
+void lsp_pool_delete(lsp_pool *p);
+
+void lsp_shutdown(lsp_context *c) {
+    if (c->pool != NULL)
+        lsp_pool_delete(c->pool);
+    lsp_mem_shutdown(c);
+    lsp_context_delete(c);
+}
+
+lsp_obj * lsp_obj_alloc(enum lsp_obj_type type, lsp_context *ctx) {
+    lsp_obj * o = lsp_mem_get(ctx);
+    o->type = type;
+    o->mark = ctx->mem.black;
+    ctx->mem.stats.allocated[type]++;
+    return o;
+}
+
+bool lsp_string_equal(const char *s1, const char *s2) {
+    return strcmp(s1, s2) == 0;
+}
+
+bool lsp_num_equal(long int n1, long int n2) {
+    return n1 == n2;
+}
+
+bool lsp_obj_equal(lsp_obj *o1, lsp_obj *o2) {
+    if (lsp_obj_type(o1) != lsp_obj_type(o2))
+        return false;
+
+    switch (lsp_obj_type(o1)) {
+    case SYMBOL:
+    case PRIMITIVE:
+        return o1 == o2;
+    case STRING:
+        return lsp_string_equal(o1->value.str, o2->value.str);
+    case NUM:
+        return lsp_num_equal(lsp_obj_as_num(o1), lsp_obj_as_num(o2));
+    default:
+        break;
+    }
+
+    return false;
+}
+
+lsp_obj * lsp_obj_cons(lsp_obj *car, lsp_obj *cdr,
+                       lsp_context *ctx) {
+    lsp_protect(&car, ctx);
+    lsp_protect(&cdr, ctx);
+    lsp_cell *c = lsp_mem_get_cell(ctx);
+    lsp_unprotect(2, ctx);
+
+    c->car = car;
+    c->cdr = cdr;
+    return lsp_cell_obj(c);
+}
+
+lsp_obj * lsp_env_create(lsp_obj *names, lsp_obj *values,
+                         lsp_context *ctx) {
+    names = names ? names : lsp_obj_nil();
+    values = values ? values : lsp_obj_nil();
+
+    lsp_protect(&names, ctx);
+    lsp_protect(&values, ctx);
+    lsp_obj *o = lsp_obj_alloc(ENV, ctx);
+    lsp_unprotect(2, ctx);
+
+    o->value.env.names = names;
+    o->value.env.values = values;
+
+    return o;
+}
+
+lsp_obj * lsp_list_append(lsp_obj *l, lsp_obj *o, lsp_context *ctx) {
+    lsp_protect(&l, ctx);
+    lsp_obj *cell = lsp_obj_cons(o, lsp_obj_nil(), ctx);
+    lsp_unprotect(1, ctx);
+    if (lsp_obj_is_nil(l))
+        return cell;
+
+    lsp_obj *last = l;
+    while (! lsp_obj_is_nil(lsp_cdr(last)))
+        last = lsp_cdr(last);
+    CHECK(! lsp_obj_is_const(&ctx->mem, last));
+    lsp_cell_of(last)->cdr = cell;
+    lsp_mem_barrier(&ctx->mem, last, cell);
+    return l;
+}
+
+lsp_obj * lsp_global_lookup(lsp_obj *name, lsp_context *ctx);
+
+lsp_obj * lsp_binding_name(lsp_obj *b) {
+    return lsp_obj_type(b) == CONS ? lsp_car(b) : b;
+}
+
+/* Names are searched in the frames up to the one of the procedure
+   being applied, what is not bound there is global. The last binding
+   of a name in a frame wins, as it does for the resolver. */
+lsp_obj * lsp_env_lookup(lsp_obj *name, lsp_context *ctx) {
+    for (int i = ctx->env.fp - 1; i >= 0; i--) {
+        lsp_env_frame *f = &ctx->env.frames[i];
+        bool proc = lsp_obj_type(f->owner) == LAMBDA;
+        lsp_obj *names = proc ? f->owner->value.lambda.args : f->owner;
+
+        int slot = -1;
+        for (int j = 0; j < f->n; j++) {
+            if (lsp_binding_name(lsp_car(names)) == name)
+                slot = j;
+            names = lsp_cdr(names);
+        }
+
+        if (slot >= 0)
+            return ctx->vm.stack[f->base + slot];
+        if (proc)
+            break;
+    }
+    return lsp_global_lookup(name, ctx);
+}
+
+lsp_obj * lsp_env_lookup_local(lsp_obj *ref, lsp_context *ctx) {
+    lsp_env_stack *e = &ctx->env;
+    lsp_env_frame *f = &e->frames[e->fp - 1 - ref->value.local.depth];
+    if (! ref->value.local.captured)
+        return ctx->vm.stack[f->base + ref->value.local.slot];
+
+    lsp_obj *closed = f->owner->value.lambda.closed;
+    for (int i = ref->value.local.slot; i > 0; i--)
+        closed = lsp_cdr(closed);
+    return lsp_car(closed);
+}
+
+int lsp_env_push_frame(lsp_obj *owner, int base, lsp_context *ctx) {
+    lsp_env_stack *e = &ctx->env;
+    if (e->fp == e->size) {
+        e->size = e->size ? e->size * 2 : 64;
+        e->frames = realloc(e->frames, e->size * sizeof(lsp_env_frame));
+        CHECK(e->frames != NULL);
     }
 
-    return lsp_obj_cons(car, cdr, ctx);
+    lsp_env_frame *f = &e->frames[e->fp];
+    f->owner = owner;
+    f->base = base;
+    f->n = 0;
+    return e->fp++;
+}
+
+lsp_obj * lsp_obj_num(long int num, lsp_context *ctx) {
+    if (num >= LSP_FIXNUM_MIN && num <= LSP_FIXNUM_MAX)
+        return lsp_fixnum(num);
+
+    lsp_obj *o = lsp_obj_alloc(NUM, ctx);
+    o->value.num = num;
+    return o;
+}
+
+char * lsp_make_string(const char *data, int len);
+
+/* Strings live in the old space, where the sweep frees their text */
+lsp_obj * lsp_obj_string(const char *str, lsp_context *ctx) {
+    ctx->mem.pretenure++;
+    lsp_obj *o = lsp_obj_alloc(STRING, ctx);
+    ctx->mem.pretenure--;
+    o->value.str = lsp_make_string(str, strlen(str));
+    return o;
+}
+
+lsp_obj * lsp_obj_list(lsp_obj **items, int n, lsp_context *ctx) {
+    for (int i = 0; i < n; i++)
+        lsp_protect(&items[i], ctx);
+
+    lsp_obj *l = lsp_obj_nil();
+    lsp_protect(&l, ctx);
+    for (int i = n - 1; i >= 0; i--)
+        l = lsp_obj_cons(items[i], l, ctx);
+
+    lsp_unprotect(n + 1, ctx);
+    return l;
+}
+
+size_t lsp_hash(const char *str, size_t len) {
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) str[i]) * 16777619u;
+    return h;
+}
+
+void lsp_symtab_grow(lsp_symtab *t) {
+    size_t n_buckets = t->n_buckets ? t->n_buckets * 2 : 256;
+    lsp_obj **buckets = lsp_alloc(n_buckets * sizeof(lsp_obj *));
+    memset(buckets, 0, n_buckets * sizeof(lsp_obj *));
+
+    for (size_t i = 0; i < t->n_buckets; i++) {
+        lsp_obj *o = t->buckets[i];
+        while (o != NULL) {
+            lsp_obj *next = o->value.sym.next;
+            const char *name = o->value.sym.name;
+            size_t b = lsp_hash(name, strlen(name)) & (n_buckets - 1);
+            o->value.sym.next = buckets[b];
+            buckets[b] = o;
+            o = next;
+        }
+    }
+
+    lsp_free(t->buckets);
+    t->buckets = buckets;
+    t->n_buckets = n_buckets;
+}
+
+/* NULL when no symbol has that name, the table is only read */
+lsp_obj * lsp_symtab_find(const lsp_symtab *t, const char *str,
+                          size_t len) {
+    size_t b = lsp_hash(str, len) & (t->n_buckets - 1);
+
+    for (lsp_obj *o = t->buckets[b]; o != NULL; o = o->value.sym.next) {
+        const char *name = o->value.sym.name;
+        if (strncmp(name, str, len) == 0 && name[len] == '\0')
+            return o;
+    }
+    return NULL;
+}
+
+lsp_obj * lsp_intern(const char *str, size_t len, lsp_context *ctx) {
+    lsp_symtab *t = &ctx->symbols;
+    lsp_obj *o = lsp_symtab_find(t, str, len);
+    if (o != NULL)
+        return o;
+
+    size_t b = lsp_hash(str, len) & (t->n_buckets - 1);
+    ctx->mem.pretenure++;
+    o = lsp_obj_alloc(SYMBOL, ctx);
+    ctx->mem.pretenure--;
+    o->value.sym.name = lsp_make_string(str, len);
+    o->value.sym.form = NOT_A_FORM;
+
+    o->value.sym.next = t->buckets[b];
+    t->buckets[b] = o;
+
+    if (++t->n_symbols > t->n_buckets)
+        lsp_symtab_grow(t);
+
+    return o;
+}
+
+lsp_obj * lsp_obj_symbol(const char *str, lsp_context *ctx) {
+    return lsp_intern(str, strlen(str), ctx);
+}
+
+void lsp_symtab_init(lsp_context *ctx) {
+    static const char *forms[FORM_MAX_] = {
+        NULL, "if", "list", "let", "set", "lambda", "defun", "progn",
+        "cons", "car", "cdr", "equal", "load"
+    };
+
+    lsp_symtab *t = &ctx->symbols;
+    t->buckets = NULL;
+    t->n_buckets = 0;
+    t->n_symbols = 0;
+    lsp_symtab_grow(t);
+
+    for (int i = FORM_IF; i < FORM_MAX_; i++)
+        lsp_obj_symbol(forms[i], ctx)->value.sym.form = i;
+
+    ctx->sym_t = lsp_obj_symbol("t", ctx);
+}
+
+void lsp_symtab_shutdown(lsp_symtab *t) {
+    for (size_t i = 0; i < t->n_buckets; i++) {
+        for (lsp_obj *o = t->buckets[i]; o != NULL; o = o->value.sym.next)
+            lsp_free(o->value.sym.name);
+    }
+    lsp_free(t->buckets);
+}
+
+static inline size_t lsp_globals_slot(const lsp_globals *g,
+                                      lsp_obj *name) {
+    size_t h = (uintptr_t) name >> 3;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+
+    size_t i = h & (g->n_slots - 1);
+    while (g->names[i] != NULL && g->names[i] != name)
+        i = (i + 1) & (g->n_slots - 1);
+    return i;
+}
+
+void lsp_globals_grow(lsp_globals *g) {
+    lsp_globals old = *g;
+
+    g->n_slots = old.n_slots ? old.n_slots * 2 : 256;
+    g->names = lsp_alloc(g->n_slots * sizeof(lsp_obj *));
+    g->values = lsp_alloc(g->n_slots * sizeof(lsp_obj *));
+    g->sources = lsp_alloc(g->n_slots * sizeof(lsp_obj *));
+    g->depends = lsp_alloc(g->n_slots * sizeof(lsp_obj *));
+    memset(g->names, 0, g->n_slots * sizeof(lsp_obj *));
+
+    for (size_t i = 0; i < old.n_slots; i++) {
+        if (old.names[i] == NULL)
+            continue;
+        size_t slot = lsp_globals_slot(g, old.names[i]);
+        g->names[slot] = old.names[i];
+        g->values[slot] = old.values[i];
+        g->sources[slot] = old.sources[i];
+        g->depends[slot] = old.depends[i];
+    }
+
+    lsp_free(old.names);
+    lsp_free(old.values);
+    lsp_free(old.sources);
+    lsp_free(old.depends);
+}
+
+/* NULL when name is unbound */
+static inline lsp_obj * lsp_global_find(lsp_obj *name, lsp_context *ctx) {
+    lsp_globals *g = &ctx->globals;
+    size_t slot = lsp_globals_slot(g, name);
+    return g->names[slot] != NULL ? g->values[slot] : NULL;
+}
+
+lsp_obj * lsp_global_import(lsp_obj *name, lsp_context *ctx);
+
+lsp_obj * lsp_global_lookup(lsp_obj *name, lsp_context *ctx) {
+    lsp_obj *value = lsp_global_find(name, ctx);
+    if (value == NULL && ctx->parent != NULL)
+        value = lsp_global_import(name, ctx);
+    if (value == NULL) {
+        TRACE("Lookup failed for: %s", lsp_obj_as_string(name));
+        return lsp_obj_nil();
+    }
+    return value;
+}
+
+void lsp_rebuild_dependents(lsp_obj *names, lsp_context *ctx);
+
+/* A redefinition replaces the value and source in its slot, makes the
+   cached lookups stale and rebuilds the procedures that folded or
+   inlined the old value. The table is a root, so storing a young value
+   needs no barrier. */
+void lsp_global_define(lsp_obj *name, lsp_obj *value, lsp_obj *source,
+                       lsp_context *ctx) {
+    lsp_globals *g = &ctx->globals;
+    size_t slot = lsp_globals_slot(g, name);
+    if (g->names[slot] == NULL) {
+        if (2 * (g->n_globals + 1) > g->n_slots) {
+            lsp_globals_grow(g);
+            slot = lsp_globals_slot(g, name);
+        }
+        g->names[slot] = name;
+        g->depends[slot] = NULL;
+        g->n_globals++;
+    } else if (g->values[slot] != value) {
+        g->version++;
+    }
+    g->values[slot] = value;
+    g->sources[slot] = source;
+
+    lsp_obj *depends = g->depends[slot];
+    if (depends != NULL) {
+        g->depends[slot] = NULL;
+        lsp_rebuild_dependents(depends, ctx);
+    }
+}
+
+void lsp_global_set(lsp_obj *name, lsp_obj *value, lsp_context *ctx) {
+    lsp_global_define(name, value, NULL, ctx);
+}
+
+lsp_obj * lsp_obj_global_ref(lsp_obj *name, lsp_context *ctx) {
+    lsp_obj *o = lsp_obj_alloc(GLOBAL, ctx);
+    o->value.global.name = name;
+    return o;
+}
+
+/* A lookup is one compare while no global has been rebound since the
+   value was cached. New bindings leave the cached values right. */
+static inline lsp_obj * lsp_global_ref_value(lsp_obj *ref,
+                                             lsp_context *ctx) {
+    lsp_global_ref *r = &ref->value.global;
+    if (r->version == ctx->globals.version)
+        return r->value;
+
+    lsp_obj *value = lsp_global_find(r->name, ctx);
+    if (value == NULL && ctx->parent != NULL) {
+        lsp_protect(&ref, ctx);
+        value = lsp_global_import(r->name, ctx);
+        lsp_unprotect(1, ctx);
+        r = &ref->value.global;
+    }
+    if (value == NULL) {
+        TRACE("Lookup failed for: %s", lsp_obj_as_string(r->name));
+        return lsp_obj_nil();
+    }
+    lsp_mem_shade(&ctx->mem, r->value);
+    r->value = value;
+    r->version = ctx->globals.version;
+    lsp_mem_barrier(&ctx->mem, ref, value);
+    return value;
+}
+
+/* Records that the procedure defined as dependent relied on the
+   binding of name */
+void lsp_global_depend(lsp_obj *name, lsp_obj *dependent,
+                       lsp_context *ctx) {
+    lsp_globals *g = &ctx->globals;
+    size_t slot = lsp_globals_slot(g, name);
+    CHECK(g->names[slot] != NULL);
+
+    lsp_obj *depends = g->depends[slot];
+    if (depends == NULL)
+        depends = lsp_obj_nil();
+    for (lsp_obj *cur = depends; ! lsp_obj_is_nil(cur); cur = lsp_cdr(cur)) {
+        if (lsp_car(cur) == dependent)
+            return;
+    }
+    g->depends[slot] = lsp_obj_cons(dependent, depends, ctx);
+}
+
+lsp_form lsp_obj_form(lsp_obj *o) {
+    return lsp_obj_type(o) == SYMBOL ? o->value.sym.form : NOT_A_FORM;
+}
+
+lsp_obj * lsp_obj_local(int depth, int slot, bool captured,
+                         lsp_obj *name, lsp_context *ctx) {
+    lsp_obj *o = lsp_obj_alloc(LOCAL, ctx);
+    o->value.local.depth = depth;
+    o->value.local.slot = slot;
+    o->value.local.captured = captured;
+    o->value.local.name = name;
+    return o;
+}
+
+lsp_obj * lsp_obj_quote(lsp_obj *expr, lsp_context *ctx) {
+    lsp_protect(&expr, ctx);
+    lsp_obj *o = lsp_obj_alloc(QUOTE, ctx);
+    lsp_unprotect(1, ctx);
+    o->value.expr = expr;
+    return o;
+}
+
+long int lsp_obj_as_num(lsp_obj *o) {
+    if (lsp_obj_is_fixnum(o))
+        return lsp_fixnum_value(o);
+
+    CHECK(o->type == NUM);
+    return o->value.num;
+}
+
+const char * lsp_obj_as_string(lsp_obj *o) {
+    CHECK(lsp_obj_type(o) == STRING || lsp_obj_type(o) == SYMBOL);
+    return o->type == SYMBOL ? o->value.sym.name : o->value.str;
+}
+
+void lsp_obj_delete(lsp_obj *o) {
+    lsp_free(o);
+}
+
+static inline bool lsp_is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+char * lsp_eat_space(char *txt) {
+    char *pos = txt;
+    while (lsp_is_space(*pos))
+        pos++;
+    return pos;
+}
+
+lsp_obj *lsp_truth(bool value, lsp_context *ctx) {
+    if (value)
+        return ctx->sym_t;
+    else
+        return lsp_obj_nil();
+}
+
+char lsp_peek(char *txt) {
+    return txt[0];
+}
+
+bool lsp_is_digit(char c) {
+    return c >= 48 && c < 58;
+}
+
+lsp_obj * lsp_read_num(char *txt, char **next,
+                       lsp_context *ctx) {
+    const long int num = strtol(txt, next, 10);
+    return lsp_obj_num(num, ctx);
+}
+
+char * lsp_make_string(const char *data, int len) {
+    char *s = lsp_alloc(sizeof(char) * len + 1);
+    memcpy(s, data, len);
+    s[len] = '\0';
+    return s;
+}
+
+lsp_obj * lsp_read_symbol(char *txt, char **next,
+                          lsp_context *ctx) {
+    size_t span = strcspn(txt, " \n\t\r)");
+
+    *next = txt + span;
+    return lsp_intern(txt, span, ctx);
+}
+
+lsp_obj * lsp_read_string(char *txt, char **next,
+                          lsp_context *ctx) {
+    txt++;
+    size_t span = strcspn(txt, "\"");
+    char *s = lsp_make_string(txt, span);
+
+    /* Unterminated */
+    *next = txt[span] == '"' ? txt + span + 1 : NULL;
+
+    lsp_obj *o = lsp_obj_string(s, ctx);
+    free(s);
+    return o;
+}
+
+lsp_obj * lsp_read_list_inner(char *txt, char **next,
+                              lsp_context *ctx) {
+    lsp_obj *car = lsp_read_obj(txt, next, ctx);
+    txt = *next != NULL ? lsp_eat_space(*next) : "";
+    
+    lsp_obj *cdr = NULL;
+    
+    if (lsp_peek(txt) == ')') {
+        cdr = lsp_obj_nil();
+        *next = txt + 1;
+    } else if (lsp_peek(txt) == '\0') {
+        /* Unterminated */
+        cdr = lsp_obj_nil();
+        *next = NULL;
+    } else {
+        lsp_protect(&car, ctx);
+        cdr = lsp_read_list_inner(txt, next, ctx);
+        lsp_unprotect(1, ctx);
+    }
+
+    lsp_obj *cell = lsp_obj_cons(car, cdr, ctx);
+    lsp_obj_set_const(cell);
+    return cell;
+}
+
+lsp_obj * lsp_read_list(char *txt, char **next,
+                        lsp_context *ctx) {
+    txt++;
+    txt = lsp_eat_space(txt);
+
+    lsp_obj *res = NULL;
+        
+    if (lsp_peek(txt) == ')') {
+        res = lsp_obj_nil();
+        *next = txt + 1;
+    } else {
+        res = lsp_read_list_inner(txt, next, ctx);
+    }
+    
+    return res;
+}
+
+
+lsp_obj * lsp_read_quote(char *txt, char **next, lsp_context *ctx) {
+    txt++;
+    lsp_obj *expr = lsp_read_obj(txt, next, ctx);
+    return lsp_obj_quote(expr, ctx);
+}
+
+lsp_obj * lsp_read_obj(char *txt, char **next,
+                       lsp_context *ctx) {
+    CHECK(*next != NULL);
+    
+    txt = lsp_eat_space(txt);
+    lsp_obj *obj = NULL;
+
+    char next_char = lsp_peek(txt);
+    if (next_char == '(') {
+        obj = lsp_read_list(txt, next, ctx);
+    } else if (next_char == '\"') {
+        obj = lsp_read_string(txt, next, ctx);
+    } else if (lsp_is_digit(next_char)) {
+        obj = lsp_read_num(txt, next, ctx);
+    } else if (next_char == '\'') {
+        obj = lsp_read_quote(txt, next, ctx);
+    } else {
+        obj = lsp_read_symbol(txt, next, ctx);
+        /* A close without an open */
+        if (next_char == ')')
+            *next = NULL;
+    }
+
+    lsp_obj_set_const(obj);
+    return obj;
+}
+
+/* What the reader builds is code or a quoted constant and lives in
+   the old space */
+lsp_obj * lsp_read_text(char *txt, lsp_context *ctx) {
+    char *next = "";
+    ctx->mem.pretenure++;
+    lsp_obj *o = lsp_read_obj(txt, &next, ctx);
+    ctx->mem.pretenure--;
+    return o;
+}
+
+/* Reads the form at *pos and moves past it, returns NULL at the end of
+   the text or at a malformed form, which also ends the text */
+lsp_obj * lsp_read_next(char **pos, lsp_context *ctx) {
+    char *txt = lsp_eat_space(*pos);
+    if (*txt == '\0') {
+        *pos = txt;
+        return NULL;
+    }
+
+    ctx->mem.pretenure++;
+    lsp_obj *o = lsp_read_obj(txt, pos, ctx);
+    ctx->mem.pretenure--;
+
+    if (*pos == NULL) {
+        int len = strcspn(txt, "\n");
+        TRACE("Malformed form: %.*s", len < 32 ? len : 32, txt);
+        *pos = txt + strlen(txt);
+        return NULL;
+    }
+    return o;
+}
+
+lsp_obj * lsp_read(char *txt, lsp_context *ctx) {
+    return lsp_obj_hold(lsp_read_text(txt, ctx), ctx);
+}
+
+void lsp_buf_init(lsp_buf *b, FILE *fp) {
+    b->data = NULL;
+    b->len = 0;
+    b->size = 0;
+    b->fp = fp;
+}
+
+void lsp_buf_free(lsp_buf *b) {
+    lsp_free(b->data);
+    lsp_buf_init(b, NULL);
+}
+
+void lsp_buf_flush(lsp_buf *b) {
+    if (b->fp != NULL && b->len > 0) {
+        fwrite(b->data, 1, b->len, b->fp);
+        b->len = 0;
+    }
+}
+
+/* Makes room for n more bytes and the terminating zero. A buffer
+   writing to a file is flushed when full, other buffers double. */
+void lsp_buf_reserve(lsp_buf *b, size_t n) {
+    if (b->len + n < b->size)
+        return;
+
+    lsp_buf_flush(b);
+    if (b->len + n < b->size)
+        return;
+
+    size_t size = b->size ? b->size : 256;
+    while (b->len + n >= size)
+        size *= 2;
+    b->data = realloc(b->data, size);
+    CHECK(b->data != NULL);
+    b->size = size;
+}
+
+static inline void lsp_buf_put(lsp_buf *b, char c) {
+    if (b->len + 1 >= b->size)
+        lsp_buf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void lsp_buf_append(lsp_buf *b, const char *str, size_t len) {
+    lsp_buf_reserve(b, len);
+    memcpy(b->data + b->len, str, len);
+    b->len += len;
+}
+
+void lsp_print_num(lsp_obj *o, lsp_buf *b) {
+    long int num = lsp_obj_as_num(o);
+    unsigned long int n = num < 0 ? 0ul - num : (unsigned long int) num;
+
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    if (num < 0)
+        digits[--i] = '-';
+
+    lsp_buf_append(b, digits + i, sizeof(digits) - i);
+}
+
+void lsp_print_symbol(lsp_obj *o, lsp_buf *b) {
+    CHECK(lsp_obj_type(o) == SYMBOL);
+
+    const char *str = o->value.sym.name;
+    lsp_buf_append(b, str, strlen(str));
+}
+
+void lsp_print_string(lsp_obj *o, lsp_buf *b) {
+    CHECK(lsp_obj_type(o) == STRING);
+
+    lsp_buf_put(b, '"');
+    lsp_buf_append(b, o->value.str, strlen(o->value.str));
+    lsp_buf_put(b, '"');
+}
+
+void lsp_print_quote(lsp_obj *o, lsp_buf *b) {
+    lsp_buf_put(b, '\'');
+    lsp_print_obj(o->value.expr, b);
+}
+
+void lsp_print_list(lsp_obj *o, lsp_buf *b) {
+    lsp_buf_put(b, '(');
+
+    lsp_obj *cur = o;
+    while (1) {
+        if (lsp_obj_is_nil(cur)) {
+            lsp_buf_put(b, ')');
+            break;
+        } else if (cur != o) {
+            lsp_buf_put(b, ' ');
+        }
+
+        if (lsp_obj_type(cur) != CONS) {
+            lsp_buf_append(b, ". ", 2);
+            lsp_print_obj(cur, b);
+            cur = lsp_obj_nil();
+        } else {
+            lsp_print_obj(lsp_car(cur), b);
+            cur = lsp_cdr(cur);
+        }
+    }
+}
+
+void lsp_print_obj(lsp_obj *obj, lsp_buf *b) {
+    switch (lsp_obj_type(obj)) {
+    case STRING:
+        lsp_print_string(obj, b);
+        break;
+    case NUM:
+        lsp_print_num(obj, b);
+        break;
+    case CONS:
+        lsp_print_list(obj, b);
+        break;
+    case NIL:
+        lsp_buf_append(b, "nil", 3);
+        break;
+    case SYMBOL:
+        lsp_print_symbol(obj, b);
+        break;
+    case QUOTE:
+        lsp_print_quote(obj, b);
+        break;
+    case LAMBDA:
+    case CODE:
+        lsp_buf_append(b, "lambda", 6);
+        break;
+    case LOCAL:
+        lsp_print_symbol(obj->value.local.name, b);
+        break;
+    case GLOBAL:
+        lsp_print_symbol(obj->value.global.name, b);
+        break;
+    case PRIMITIVE:
+        lsp_buf_append(b, obj->value.prim->name,
+                       strlen(obj->value.prim->name));
+        break;
+    default:
+        SHOULD_NEVER_BE_HERE;
+    }
+}
+
+/* Appends to b and keeps its text terminated */
+void lsp_print_to(lsp_obj *obj, lsp_buf *b) {
+    lsp_print_obj(obj, b);
+    lsp_buf_reserve(b, 0);
+    b->data[b->len] = '\0';
+}
+
+void lsp_print_file(lsp_obj *obj, FILE *fp) {
+    lsp_buf b;
+    lsp_buf_init(&b, fp);
+    lsp_print_obj(obj, &b);
+    lsp_buf_flush(&b);
+    lsp_buf_free(&b);
+}
+
+char * lsp_print(lsp_obj *obj, lsp_context *ctx) {
+    ctx->print.len = 0;
+    lsp_print_to(obj, &ctx->print);
+    return ctx->print.data;
+}
+
+
+lsp_obj * lsp_eval_quote(lsp_obj *o, lsp_context *ctx) {
+    return o->value.expr;
+}
+
+lsp_obj * lsp_primitive_mul(lsp_obj **argv, int argc, lsp_context *ctx) {
+    long int prod = 1;
+    for (int i = 0; i < argc; i++)
+        prod = prod * lsp_obj_as_num(argv[i]);
+
+    return lsp_obj_num(prod, ctx);
+}
+
+lsp_obj * lsp_primitive_add(lsp_obj **argv, int argc, lsp_context *ctx) {
+    long int sum = 0;
+    for (int i = 0; i < argc; i++)
+        sum += lsp_obj_as_num(argv[i]);
+
+    return lsp_obj_num(sum, ctx);
+}
+
+lsp_obj * lsp_primitive_sub(lsp_obj **argv, int argc, lsp_context *ctx) {
+    long int sum = lsp_obj_as_num(argv[0]);
+    for (int i = 1; i < argc; i++)
+        sum -= lsp_obj_as_num(argv[i]);
+
+    return lsp_obj_num(sum, ctx);
+}
+
+lsp_obj * lsp_primitive_lt(lsp_obj **argv, int argc, lsp_context *ctx) {
+    long int a = lsp_obj_as_num(argv[0]);
+    long int b = lsp_obj_as_num(argv[1]);
+    return lsp_truth(a < b, ctx);
+}
+
+lsp_obj * lsp_alist_add(lsp_obj *alist, const char *key, lsp_obj *value,
+                        lsp_context *ctx) {
+    lsp_protect(&alist, ctx);
+    lsp_protect(&value, ctx);
+    /* Interning may collect and move the young value */
+    lsp_obj *name = lsp_obj_symbol(key, ctx);
+    lsp_obj *pair = lsp_obj_cons(name, value, ctx);
+    lsp_obj *res = lsp_obj_cons(pair, alist, ctx);
+    lsp_unprotect(2, ctx);
+    return res;
+}
+
+/* An alist of the counters of lsp_stats, the allocations by type are
+   under types and pauses are in microseconds */
+lsp_obj * lsp_primitive_gc_stats(lsp_obj **argv, int argc,
+                                 lsp_context *ctx) {
+    lsp_gc_stats s;
+    lsp_stats(ctx, &s);
+
+    lsp_obj *types = lsp_obj_nil();
+    lsp_protect(&types, ctx);
+    for (int i = OBJ_TYPE_MAX_ - 1; i > FREELIST; i--) {
+        if (s.allocated[i] == 0)
+            continue;
+
+        char name[16];
+        const char *type = obj_type_to_str(i);
+        int len = 0;
+        for (; type[len] != '\0' && len < 15; len++)
+            name[len] = type[len] - 'A' + 'a';
+        name[len] = '\0';
+
+        lsp_obj *n = lsp_obj_num(s.allocated[i], ctx);
+        types = lsp_alist_add(types, name, n, ctx);
+    }
+
+    struct {
+        const char *key;
+        long int value;
+    } counters[] = {
+        {"allocated", s.n_allocated},
+        {"minor", s.n_minor},
+        {"major", s.n_major},
+        {"promoted", s.n_promoted},
+        {"freed", s.n_freed},
+        {"in-use", s.in_use},
+        {"peak-live", s.peak_live},
+        {"pause-us", s.pause_time * 1e6},
+        {"max-pause-us", s.max_pause * 1e6}
+    };
+    int n_counters = sizeof(counters) / sizeof(counters[0]);
+
+    lsp_obj *res = lsp_alist_add(lsp_obj_nil(), "types", types, ctx);
+    lsp_protect(&res, ctx);
+    for (int i = n_counters - 1; i >= 0; i--) {
+        lsp_obj *n = lsp_obj_num(counters[i].value, ctx);
+        res = lsp_alist_add(res, counters[i].key, n, ctx);
+    }
+    lsp_unprotect(2, ctx);
+    return res;
+}
+
+lsp_obj * lsp_primitive_pmapcar(lsp_obj **argv, int argc,
+                                lsp_context *ctx);
+lsp_obj * lsp_primitive_preduce(lsp_obj **argv, int argc,
+                                lsp_context *ctx);
+lsp_obj * lsp_primitive_save_image(lsp_obj **argv, int argc,
+                                   lsp_context *ctx);
+
+static const lsp_primitive lsp_primitives[] = {
+    {"+", lsp_primitive_add, 0, -1, true},
+    {"-", lsp_primitive_sub, 1, -1, true},
+    {"*", lsp_primitive_mul, 0, -1, true},
+    {"<", lsp_primitive_lt, 2, 2, true},
+    {"gc-stats", lsp_primitive_gc_stats, 0, 0, false},
+    {"pmapcar", lsp_primitive_pmapcar, 2, 2, false},
+    {"preduce", lsp_primitive_preduce, 3, 3, false},
+    {"save-image", lsp_primitive_save_image, 1, 1, false}
+};
+
+/* Procedures live as long as the context, so they go straight to the
+   old space */
+void lsp_define_primitive(const lsp_primitive *p, lsp_context *ctx) {
+    lsp_obj *name = lsp_obj_symbol(p->name, ctx);
+    ctx->mem.pretenure++;
+    lsp_obj *o = lsp_obj_alloc(PRIMITIVE, ctx);
+    ctx->mem.pretenure--;
+    o->value.prim = p;
+    lsp_global_set(name, o, ctx);
+}
+
+void lsp_install_primitives(lsp_context *ctx) {
+    int n = sizeof(lsp_primitives) / sizeof(lsp_primitives[0]);
+    for (int i = 0; i < n; i++)
+        lsp_define_primitive(&lsp_primitives[i], ctx);
+}
+
+void lsp_register_native(lsp_context *ctx, const char *name,
+                         lsp_native fn, int min_arity, int max_arity) {
+    CHECK(min_arity >= 0 && (max_arity < 0 || max_arity >= min_arity));
+
+    lsp_natives *n = &ctx->natives;
+    if (n->n == n->size) {
+        n->size = n->size ? n->size * 2 : 16;
+        n->prims = realloc(n->prims, n->size * sizeof(lsp_primitive *));
+        CHECK(n->prims != NULL);
+    }
+
+    lsp_primitive *p = lsp_alloc(sizeof(lsp_primitive));
+    p->name = lsp_make_string(name, strlen(name));
+    p->fn = fn;
+    p->min_arity = min_arity;
+    p->max_arity = max_arity;
+    p->pure = false;
+    n->prims[n->n++] = p;
+
+    lsp_define_primitive(p, ctx);
+}
+
+/* The arguments are in argv, which is on the VM stack so the collector
+   updates them. Applying anything but a procedure gives nil. */
+lsp_obj * lsp_primitive_call(lsp_obj *proc, lsp_obj **argv, int argc,
+                             lsp_context *ctx) {
+    if (lsp_obj_type(proc) != PRIMITIVE) {
+        TRACE("Not a procedure");
+        return lsp_obj_nil();
+    }
+
+    const lsp_primitive *p = proc->value.prim;
+    if (argc < p->min_arity || (p->max_arity >= 0 && argc > p->max_arity)) {
+        TRACE("Wrong number of arguments to %s: %d", p->name, argc);
+        return lsp_obj_nil();
+    }
+    return p->fn(argv, argc, ctx);
+}
+
+lsp_obj * lsp_eval_obj(lsp_obj *expr, lsp_context *ctx);
+
+lsp_obj * lsp_eval_seq(lsp_obj *seq, lsp_context *ctx) {
+    lsp_obj *res = lsp_obj_nil();
+    lsp_obj *last = lsp_obj_nil();
+    lsp_protect(&res, ctx);
+    lsp_protect(&last, ctx);
+
+    while (! lsp_obj_is_nil(seq)) {
+        lsp_obj *cell = lsp_obj_cons(lsp_eval_obj(lsp_car(seq), ctx),
+                                     lsp_obj_nil(),
+                                     ctx);
+        if (lsp_obj_is_nil(last)) {
+            res = cell;
+        } else {
+            lsp_cell_of(last)->cdr = cell;
+            lsp_mem_barrier(&ctx->mem, last, cell);
+        }
+
+        last = cell;
+        seq = lsp_cdr(seq);
+    }
+
+    lsp_unprotect(2, ctx);
+    return res;
+}
+
+bool lsp_is_true(lsp_obj *value) {
+    return ! lsp_obj_is_nil(value);
+}
+
+/* Returns the clause to evaluate in tail position */
+lsp_obj * lsp_if(lsp_obj *args,
+                 lsp_context *ctx) {
+    lsp_obj *pred = lsp_eval_obj(lsp_car(args), ctx);
+    
+    lsp_obj *then_clause = lsp_car(lsp_cdr(args));
+    lsp_obj *else_clause = lsp_car(lsp_cdr(lsp_cdr(args)));
+
+    return lsp_is_true(pred) ? then_clause : else_clause;
+}
+
+lsp_obj * lsp_list(lsp_obj *objs, lsp_context *ctx) {
+    return lsp_eval_seq(objs, ctx);
+}
+
+/* Pushes the values of the arguments on the VM stack */
+int lsp_eval_args(lsp_obj *args, lsp_context *ctx) {
+    int argc = 0;
+    for (; ! lsp_obj_is_nil(args); args = lsp_cdr(args), argc++)
+        lsp_vm_push(&ctx->vm, lsp_eval_obj(lsp_car(args), ctx));
+    return argc;
+}
+
+/* Frames pushed from outside of evaluation are global, their bindings
+   go to the global table */
+void lsp_context_push_env(lsp_context *ctx, lsp_obj *env) {
+    lsp_obj *names = env->value.env.names;
+    lsp_obj *values = env->value.env.values;
+
+    while (! lsp_obj_is_nil(names)) {
+        lsp_global_set(lsp_car(names), lsp_car(values), ctx);
+        names = lsp_cdr(names);
+        values = lsp_cdr(values);
+    }
+}
+
+/* Evaluates every form but the last one, which is returned to be
+   evaluated in tail position */
+lsp_obj * lsp_eval_body(lsp_obj *b, lsp_context *ctx) {
+    if (lsp_obj_is_nil(b))
+        return lsp_obj_nil();
+
+    while (! lsp_obj_is_nil(lsp_cdr(b))) {
+        lsp_eval_obj(lsp_car(b), ctx);
+        b = lsp_cdr(b);
+    }
+    return lsp_car(b);
+}
+
+/* The arguments are the last argc values of the VM stack. A procedure
+   replaces the frames and values of the expression being evaluated
+   with its own frame, so tail calls run in constant space, and returns
+   its body to be evaluated in tail position. Primitives return their
+   value and leave tail unset. */
+lsp_obj * lsp_apply(lsp_obj *proc, int argc, bool *tail,
+                    lsp_context *ctx) {
+    lsp_vm *vm = &ctx->vm;
+    int args = vm->sp - argc;
+
+    if (lsp_obj_type(proc) != LAMBDA) {
+        lsp_obj *res = lsp_primitive_call(proc, &vm->stack[args], argc,
+                                          ctx);
+        vm->sp = args;
+        return res;
+    }
+
+    /* Missing arguments are nil and extra ones are dropped */
+    int n_params = lsp_list_length(proc->value.lambda.args);
+    for (; argc < n_params; argc++)
+        lsp_vm_push(vm, lsp_obj_nil());
+
+    lsp_env_stack *e = &ctx->env;
+    memmove(&vm->stack[e->tail_sp], &vm->stack[args],
+            n_params * sizeof(lsp_obj *));
+    vm->sp = e->tail_sp + n_params;
+    e->fp = e->tail_fp;
+    int f = lsp_env_push_frame(proc, e->tail_sp, ctx);
+    e->frames[f].n = n_params;
+
+    *tail = true;
+    return lsp_eval_body(proc->value.lambda.body, ctx);
+}
+
+/* Each value is pushed once it is known, so a binding sees the ones
+   before it */
+lsp_obj * lsp_let(lsp_obj *args, lsp_context *ctx) {
+    lsp_obj *bindings = lsp_car(args);
+    int f = lsp_env_push_frame(bindings, ctx->vm.sp, ctx);
+
+    for (lsp_obj *cur = bindings; ! lsp_obj_is_nil(cur); cur = lsp_cdr(cur)) {
+        lsp_obj *init = lsp_car(lsp_cdr(lsp_car(cur)));
+        lsp_vm_push(&ctx->vm, lsp_eval_obj(init, ctx));
+        ctx->env.frames[f].n++;
+    }
+
+    return lsp_eval_body(lsp_cdr(args), ctx);
+}
+
+lsp_obj * lsp_set(lsp_obj *name, lsp_obj *value,
+                  lsp_context *ctx) {
+    lsp_protect(&value, ctx);
+    lsp_global_set(name, value, ctx);
+    lsp_unprotect(1, ctx);
+    return value;
+}
+
+/* Lexical addressing
+
+   When a procedure is built its body is copied with every reference
+   to a parameter or a let binding replaced by a LOCAL holding the
+   frame depth and slot. Nested lambdas are resolved at the same time
+   into templates, a binding of an enclosing procedure becomes a
+   captured reference and is added to the template's captures. The
+   remaining symbols are free and are looked up in the global
+   environment. */
+
+typedef struct lsp_lexical_frame {
+    lsp_obj *names;     /* parameters or let bindings, in slot order */
+    int n_bound;
+    bool proc;          /* parameters, the frames beyond are captured */
+    lsp_obj *captures;  /* references in the enclosing frames */
+    int n_captures;
+    struct lsp_lexical_frame *outer;
+    lsp_obj *defining;  /* name of an optimized defun, outermost frame */
+} lsp_lexical_frame;
+
+lsp_obj * lsp_resolve(lsp_obj *e, lsp_lexical_frame *f,
+                      lsp_context *ctx);
+
+/* Returns the index of ref in the captures of the procedure f */
+int lsp_resolve_capture(lsp_lexical_frame *f, lsp_obj *ref,
+                        lsp_context *ctx) {
+    lsp_obj *cur = f->captures;
+    for (int i = 0; i < f->n_captures; i++) {
+        if (lsp_car(cur)->value.local.name == ref->value.local.name)
+            return i;
+        cur = lsp_cdr(cur);
+    }
+
+    f->captures = lsp_list_append(f->captures, ref, ctx);
+    return f->n_captures++;
+}
+
+lsp_obj * lsp_resolve_symbol(lsp_obj *name, lsp_lexical_frame *f,
+                             lsp_context *ctx) {
+    for (int depth = 0; f != NULL; depth++, f = f->outer) {
+        int slot = -1;
+        lsp_obj *cur = f->names;
+        for (int i = 0; i < f->n_bound; i++) {
+            if (lsp_binding_name(lsp_car(cur)) == name)
+                slot = i;
+            cur = lsp_cdr(cur);
+        }
+
+        if (slot >= 0)
+            return lsp_obj_local(depth, slot, false, name, ctx);
+
+        if (f->proc) {
+            lsp_obj *ref = lsp_resolve_symbol(name, f->outer, ctx);
+            if (lsp_obj_type(ref) != LOCAL)
+                return name;
+
+            int index = lsp_resolve_capture(f, ref, ctx);
+            return lsp_obj_local(depth, index, true, name, ctx);
+        }
+    }
+    return name;
+}
+
+lsp_obj * lsp_resolve_seq(lsp_obj *seq, lsp_lexical_frame *f,
+                          lsp_context *ctx) {
+    lsp_obj *res = lsp_obj_nil();
+    lsp_protect(&res, ctx);
+    while (! lsp_obj_is_nil(seq)) {
+        res = lsp_list_append(res, lsp_resolve(lsp_car(seq), f, ctx), ctx);
+        seq = lsp_cdr(seq);
+    }
+    lsp_unprotect(1, ctx);
+    return res;
+}
+
+lsp_obj * lsp_resolve_let(lsp_obj *o, lsp_lexical_frame *outer,
+                          lsp_context *ctx) {
+    lsp_obj *bindings = lsp_car(lsp_cdr(o));
+    lsp_lexical_frame f = {bindings, 0, false, NULL, 0, outer, NULL};
+
+    lsp_obj *resolved = lsp_obj_nil();
+    lsp_protect(&resolved, ctx);
+    lsp_obj *cur = bindings;
+    while (! lsp_obj_is_nil(cur)) {
+        lsp_obj *binding = lsp_car(cur);
+        lsp_obj *init = lsp_resolve(lsp_car(lsp_cdr(binding)), &f, ctx);
+        resolved = lsp_list_append(
+            resolved,
+            lsp_obj_cons(lsp_car(binding),
+                         lsp_obj_cons(init, lsp_obj_nil(), ctx),
+                         ctx),
+            ctx);
+
+        f.n_bound++;
+        cur = lsp_cdr(cur);
+    }
+
+    lsp_obj *res = lsp_obj_cons(
+        lsp_car(o),
+        lsp_obj_cons(resolved,
+                     lsp_resolve_seq(lsp_cdr(lsp_cdr(o)), &f, ctx),
+                     ctx),
+        ctx);
+    lsp_unprotect(1, ctx);
+    return res;
+}
+
+/* Optimization
+
+   A procedure defined at top level is optimized while it is resolved.
+   Calls of pure builtins on constants are folded, and so is equal, an
+   if with a constant predicate becomes its chosen branch, and a call
+   of a small optimized procedure that only calls builtins becomes a
+   let of its body. Every global relied on records the name of the
+   procedure, which is rebuilt from its source when the global is
+   rebound. */
+
+#define LSP_FOLD_MAX_ARGS 8
+#define LSP_INLINE_MAX_SIZE 32
+#define LSP_RELY_MAX_DEPTH 32
+
+lsp_obj * lsp_resolve_defining(lsp_lexical_frame *f) {
+    if (f == NULL)
+        return NULL;
+    while (f->outer != NULL)
+        f = f->outer;
+    return f->defining;
+}
+
+/* Whether name is bound by any frame, even later in its let */
+bool lsp_resolve_is_bound(lsp_obj *name, lsp_lexical_frame *f) {
+    for (; f != NULL; f = f->outer) {
+        lsp_obj *cur = f->names;
+        for (; ! lsp_obj_is_nil(cur); cur = lsp_cdr(cur)) {
+            if (lsp_binding_name(lsp_car(cur)) == name)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Whether a symbol in e outside of templates and quotes would be
+   shadowed by the frames f */
+bool lsp_resolve_mentions(lsp_obj *e, lsp_lexical_frame *f) {
+    switch (lsp_obj_type(e)) {
+    case SYMBOL:
+        return lsp_resolve_is_bound(e, f);
+    case CONS:
+        for (; lsp_obj_type(e) == CONS; e = lsp_cdr(e)) {
+            if (lsp_resolve_mentions(lsp_car(e), f))
+                return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/* Whether the procedure name relied on the binding of on, directly or
+   through other procedures. Deep chains are assumed to. */
+bool lsp_global_relies(lsp_obj *name, lsp_obj *on, int depth,
+                       lsp_context *ctx) {
+    if (depth > LSP_RELY_MAX_DEPTH)
+        return true;
+
+    lsp_globals *g = &ctx->globals;
+    size_t slot = lsp_globals_slot(g, on);
+    if (g->names[slot] == NULL || g->depends[slot] == NULL)
+        return false;
+
+    lsp_obj *cur = g->depends[slot];
+    for (; ! lsp_obj_is_nil(cur); cur = lsp_cdr(cur)) {
+        if (lsp_car(cur) == name ||
+            lsp_global_relies(name, lsp_car(cur), depth + 1, ctx))
+            return true;
+    }
+    return false;
+}
+
+bool lsp_is_constant(lsp_obj *o) {
+    switch (lsp_obj_type(o)) {
+    case NIL:
+    case NUM:
+    case STRING:
+    case QUOTE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+lsp_obj * lsp_constant_value(lsp_obj *o) {
+    return lsp_obj_type(o) == QUOTE ? o->value.expr : o;
+}
+
+/* An expression evaluating to value */
+lsp_obj * lsp_constant(lsp_obj *value, lsp_context *ctx) {
+    if (lsp_is_constant(value) && lsp_obj_type(value) != QUOTE)
+        return value;
+    return lsp_obj_quote(value, ctx);
+}
+
+/* A call of a pure builtin on constant numbers becomes its result */
+lsp_obj * lsp_fold_call(lsp_obj *e, lsp_lexical_frame *f,
+                        lsp_context *ctx) {
+    lsp_obj *defining = lsp_resolve_defining(f);
+    lsp_obj *op = lsp_car(e);
+    if (defining == NULL || lsp_obj_type(op) != SYMBOL)
+        return e;
+
+    lsp_obj *proc = lsp_global_find(op, ctx);
+    if (proc == NULL || lsp_obj_type(proc) != PRIMITIVE ||
+        ! proc->value.prim->pure ||
+        lsp_global_relies(op, defining, 0, ctx))
+        return e;
+
+    lsp_obj *argv[LSP_FOLD_MAX_ARGS];
+    int argc = 0;
+    for (lsp_obj *cur = lsp_cdr(e); ! lsp_obj_is_nil(cur);
+         cur = lsp_cdr(cur)) {
+        lsp_obj *arg = lsp_car(cur);
+        if (argc == LSP_FOLD_MAX_ARGS || ! lsp_is_constant(arg) ||
+            lsp_obj_type(lsp_constant_value(arg)) != NUM)
+            return e;
+        argv[argc++] = lsp_constant_value(arg);
+    }
+
+    const lsp_primitive *p = proc->value.prim;
+    if (argc < p->min_arity || (p->max_arity >= 0 && argc > p->max_arity))
+        return e;
+
+    lsp_obj *res = p->fn(argv, argc, ctx);
+    lsp_protect(&res, ctx);
+    lsp_global_depend(op, defining, ctx);
+    res = lsp_constant(res, ctx);
+    lsp_unprotect(1, ctx);
+    return res;
+}
+
+lsp_obj * lsp_fold_if(lsp_obj *e) {
+    lsp_obj *args = lsp_cdr(e);
+    lsp_obj *pred = lsp_car(args);
+    if (! lsp_is_constant(pred))
+        return e;
+
+    lsp_obj *then_clause = lsp_car(lsp_cdr(args));
+    lsp_obj *else_clause = lsp_car(lsp_cdr(lsp_cdr(args)));
+    return lsp_is_true(lsp_constant_value(pred)) ? then_clause : else_clause;
+}
+
+lsp_obj * lsp_fold_equal(lsp_obj *e, lsp_context *ctx) {
+    lsp_obj *a = lsp_car(lsp_cdr(e));
+    lsp_obj *b = lsp_car(lsp_cdr(lsp_cdr(e)));
+    if (! lsp_is_constant(a) || ! lsp_is_constant(b))
+        return e;
+
+    bool equal = lsp_obj_equal(lsp_constant_value(a), lsp_constant_value(b));
+    return lsp_constant(lsp_truth(equal, ctx), ctx);
+}
+
+/* Size of a body that may be inlined, or -1 when it calls a global
+   procedure other than a builtin or defines one */
+int lsp_inline_size(lsp_obj *e, lsp_context *ctx) {
+    if (lsp_obj_type(e) != CONS)
+        return 0;
+
+    lsp_obj *op = lsp_car(e);
+    int size = 0;
+    switch (lsp_obj_form(op)) {
+    case FORM_DEFUN:
+    case FORM_LOAD:
+        return -1;
+    case FORM_LET: {
+        lsp_obj *cur = lsp_car(lsp_cdr(e));
+        for (; ! lsp_obj_is_nil(cur); cur = lsp_cdr(cur)) {
+            int n = lsp_inline_size(lsp_car(lsp_cdr(lsp_car(cur))), ctx);
+            if (n < 0)
+                return -1;
+            size += n + 3;
+        }
+        e = lsp_cdr(e);
+        break;
+    }
+    case NOT_A_FORM:
+        if (lsp_obj_type(op) == GLOBAL)
+            op = op->value.global.name;
+        if (lsp_obj_type(op) == SYMBOL) {
+            lsp_obj *proc = lsp_global_find(op, ctx);
+            if (proc == NULL || lsp_obj_type(proc) != PRIMITIVE)
+                return -1;
+        }
+        break;
+    default:
+        break;
+    }
+
+    for (lsp_obj *cur = lsp_cdr(e); ! lsp_obj_is_nil(cur);
+         cur = lsp_cdr(cur)) {
+        int n = lsp_inline_size(lsp_car(cur), ctx);
+        if (n < 0)
+            return -1;
+        size += n + 1;
+    }
+    return size + 1;
+}
+
+/* A call of an optimized procedure with a single small body becomes a
+   let binding its parameters to the arguments around its body. The
+   body is already resolved, its LOCAL references see the let frame
+   where they saw the parameters. Its free symbols and the arguments
+   must not be shadowed by the frames around the call or the let. */
+lsp_obj * lsp_inline(lsp_obj *e, lsp_lexical_frame *f, lsp_context *ctx) {
+    lsp_obj *defining = lsp_resolve_defining(f);
+    lsp_obj *op = lsp_car(e);
+    if (defining == NULL || lsp_obj_type(op) != SYMBOL || op == defining ||
+        lsp_resolve_is_bound(op, f))
+        return NULL;
+
+    lsp_globals *g = &ctx->globals;
+    size_t slot = lsp_globals_slot(g, op);
+    if (g->names[slot] == NULL || g->sources[slot] == NULL)
+        return NULL;
+
+    lsp_obj *proc = g->values[slot];
+    lsp_obj *params = proc->value.lambda.args;
+    lsp_obj *body = proc->value.lambda.body;
+    lsp_obj *args = lsp_cdr(e);
+    if (lsp_list_length(body) != 1 ||
+        lsp_list_length(params) != lsp_list_length(args))
+        return NULL;
+
+    int size = lsp_inline_size(lsp_car(body), ctx);
+    lsp_lexical_frame pf = {params, 0, false, NULL, 0, NULL, NULL};
+    if (size < 0 || size > LSP_INLINE_MAX_SIZE ||
+        lsp_resolve_mentions(lsp_car(body), f) ||
+        lsp_resolve_mentions(args, &pf) ||
+        lsp_global_relies(op, defining, 0, ctx))
+        return NULL;
+
+    /* The let frame is counted but binds nothing the arguments see */
+    lsp_lexical_frame lf = {params, 0, false, NULL, 0, f, NULL};
+    lsp_obj *bindings = lsp_obj_nil();
+    lsp_protect(&bindings, ctx);
+    for (; ! lsp_obj_is_nil(args); args = lsp_cdr(args)) {
+        lsp_obj *init = lsp_resolve(lsp_car(args), &lf, ctx);
+        bindings = lsp_list_append(
+            bindings,
+            lsp_obj_cons(lsp_car(params),
+                         lsp_obj_cons(init, lsp_obj_nil(), ctx),
+                         ctx),
+            ctx);
+        params = lsp_cdr(params);
+    }
+
+    lsp_obj *res = lsp_obj_cons(lsp_obj_symbol("let", ctx),
+                                lsp_obj_cons(bindings, body, ctx),
+                                ctx);
+    lsp_protect(&res, ctx);
+    lsp_global_depend(op, defining, ctx);
+    lsp_unprotect(2, ctx);
+    return res;
+}
+
+/* A call of a global caches the procedure in a GLOBAL that replaces
+   the name in the freshly resolved call */
+lsp_obj * lsp_resolve_operator(lsp_obj *e, lsp_context *ctx) {
+    if (lsp_obj_type(e) != CONS || lsp_obj_type(lsp_car(e)) != SYMBOL)
+        return e;
+
+    lsp_protect(&e, ctx);
+    lsp_obj *ref = lsp_obj_global_ref(lsp_car(e), ctx);
+    lsp_unprotect(1, ctx);
+    lsp_cell_of(e)->car = ref;
+    lsp_mem_barrier(&ctx->mem, e, ref);
+    return e;
+}
+
+lsp_obj * lsp_resolve_lambda(lsp_obj *o, lsp_lexical_frame *outer,
+                             lsp_obj *defining, lsp_context *ctx);
+
+lsp_obj * lsp_resolve(lsp_obj *e, lsp_lexical_frame *f,
+                      lsp_context *ctx) {
+    switch (lsp_obj_type(e)) {
+    case SYMBOL:
+        return lsp_resolve_symbol(e, f, ctx);
+    case CONS:
+        break;
+    default:
+        return e;
+    }
+
+    lsp_obj *op = lsp_car(e);
+    lsp_obj *args = lsp_cdr(e);
+    switch (lsp_obj_form(op)) {
+    case FORM_LAMBDA: {
+        lsp_obj *t = lsp_resolve_lambda(args, f, NULL, ctx);
+        return lsp_obj_cons(op, lsp_obj_cons(t, lsp_obj_nil(), ctx), ctx);
+    }
+    case FORM_DEFUN: {
+        lsp_obj *t = lsp_resolve_lambda(lsp_cdr(args), f, NULL, ctx);
+        t = lsp_obj_cons(t, lsp_obj_nil(), ctx);
+        return lsp_obj_cons(op, lsp_obj_cons(lsp_car(args), t, ctx), ctx);
+    }
+    case FORM_LET:
+        return lsp_resolve_let(e, f, ctx);
+    case NOT_A_FORM: {
+        lsp_obj *inlined = lsp_inline(e, f, ctx);
+        if (inlined != NULL)
+            return inlined;
+        return lsp_resolve_operator(
+            lsp_fold_call(lsp_resolve_seq(e, f, ctx), f, ctx), ctx);
+    }
+    case FORM_IF:
+        return lsp_fold_if(
+            lsp_obj_cons(op, lsp_resolve_seq(args, f, ctx), ctx));
+    case FORM_EQUAL:
+        return lsp_fold_equal(
+            lsp_obj_cons(op, lsp_resolve_seq(args, f, ctx), ctx), ctx);
+    default:
+        return lsp_obj_cons(op, lsp_resolve_seq(args, f, ctx), ctx);
+    }
+}
+
+/* Templates and resolved bodies are code, the caller allocates them
+   in the old space */
+lsp_obj * lsp_resolve_lambda(lsp_obj *o, lsp_lexical_frame *outer,
+                             lsp_obj *defining, lsp_context *ctx) {
+    CHECK(ctx->mem.pretenure > 0);
+    lsp_obj *args = lsp_car(o);
+    lsp_lexical_frame f = {args, lsp_list_length(args), true,
+                           lsp_obj_nil(), 0, outer, defining};
+    lsp_protect(&f.captures, ctx);
+
+    lsp_obj *body = lsp_resolve_seq(lsp_cdr(o), &f, ctx);
+    lsp_protect(&body, ctx);
+    lsp_obj *t = lsp_obj_alloc(LAMBDA, ctx);
+    lsp_unprotect(2, ctx);
+
+    t->value.lambda.args = args;
+    t->value.lambda.body = body;
+    t->value.lambda.closed = f.captures;
+    return t;
+}
+
+/* A closure shares the template and holds the captured values, a
+   template that captures nothing is the procedure itself */
+lsp_obj * lsp_closure(lsp_obj *t, lsp_context *ctx) {
+    lsp_obj *captures = t->value.lambda.closed;
+    if (lsp_obj_is_nil(captures))
+        return t;
+
+    lsp_vm *vm = &ctx->vm;
+    int n = 0;
+    for (; ! lsp_obj_is_nil(captures); captures = lsp_cdr(captures), n++)
+        lsp_vm_push(vm, lsp_env_lookup_local(lsp_car(captures), ctx));
+
+    lsp_protect(&t, ctx);
+    lsp_obj *closed = lsp_obj_list(&vm->stack[vm->sp - n], n, ctx);
+    vm->sp -= n;
+    lsp_protect(&closed, ctx);
+    lsp_obj *l = lsp_obj_alloc(LAMBDA, ctx);
+    lsp_unprotect(2, ctx);
+
+    l->value.lambda.args = t->value.lambda.args;
+    l->value.lambda.body = t->value.lambda.body;
+    l->value.lambda.code = t->value.lambda.code;
+    l->value.lambda.closed = closed;
+    return l;
+}
+
+/* The number of frames a lambda form being evaluated sees, up to the
+   innermost procedure */
+int lsp_env_visible_frames(lsp_context *ctx) {
+    lsp_env_stack *e = &ctx->env;
+    int n = 0;
+    while (n < e->fp) {
+        lsp_env_frame *f = &e->frames[e->fp - 1 - n++];
+        if (lsp_obj_type(f->owner) == LAMBDA)
+            break;
+    }
+    return n;
+}
+
+/* A lambda form that was not resolved with its enclosing procedure
+   sees the frames of the let forms being evaluated, or of the
+   procedure applied when it comes from compiled code */
+lsp_obj * lsp_obj_lambda(lsp_obj *o, lsp_context *ctx) {
+    if (lsp_obj_type(lsp_car(o)) == LAMBDA)
+        return lsp_closure(lsp_car(o), ctx);
+
+    lsp_env_stack *e = &ctx->env;
+    int n = lsp_env_visible_frames(ctx);
+
+    lsp_lexical_frame *frames = lsp_alloc((n + 1) * sizeof(*frames));
+    for (int i = 0; i < n; i++) {
+        lsp_env_frame *f = &e->frames[e->fp - 1 - i];
+        bool proc = lsp_obj_type(f->owner) == LAMBDA;
+        frames[i].names = proc ? f->owner->value.lambda.args : f->owner;
+        frames[i].n_bound = f->n;
+        frames[i].proc = false;
+        frames[i].captures = NULL;
+        frames[i].n_captures = 0;
+        frames[i].outer = i + 1 < n ? &frames[i + 1] : NULL;
+        frames[i].defining = NULL;
+    }
+
+    ctx->mem.pretenure++;
+    lsp_obj *t = lsp_resolve_lambda(o, n > 0 ? frames : NULL, NULL, ctx);
+    ctx->mem.pretenure--;
+    lsp_free(frames);
+
+    return lsp_closure(t, ctx);
+}
+
+/* Builds the procedure of a top-level defun with its body optimized
+   and keeps the source to build it again. Rebinding name rebuilds the
+   procedures that relied on the old binding. */
+void lsp_define_optimized(lsp_obj *name, lsp_obj *source,
+                          lsp_context *ctx) {
+    lsp_protect(&source, ctx);
+    ctx->mem.pretenure++;
+    lsp_obj *proc = lsp_resolve_lambda(source, NULL, name, ctx);
+    ctx->mem.pretenure--;
+
+    lsp_global_define(name, proc, source, ctx);
+    lsp_unprotect(1, ctx);
+}
+
+void lsp_rebuild_dependents(lsp_obj *names, lsp_context *ctx) {
+    lsp_protect(&names, ctx);
+    for (; ! lsp_obj_is_nil(names); names = lsp_cdr(names)) {
+        lsp_obj *name = lsp_car(names);
+        lsp_globals *g = &ctx->globals;
+        size_t slot = lsp_globals_slot(g, name);
+        if (g->names[slot] != NULL && g->sources[slot] != NULL)
+            lsp_define_optimized(name, g->sources[slot], ctx);
+    }
+    lsp_unprotect(1, ctx);
+}
+
+/* A defun inside a procedure or a let may capture bindings and is
+   built as a closure, without optimization */
+lsp_obj * lsp_defun(lsp_obj *o, lsp_context *ctx) {
+    lsp_obj *name = lsp_car(o);
+    lsp_obj *source = lsp_cdr(o);
+    if (lsp_obj_type(lsp_car(source)) != LAMBDA &&
+        lsp_env_visible_frames(ctx) == 0) {
+        lsp_define_optimized(name, source, ctx);
+        return name;
+    }
+
+    lsp_set(name, lsp_obj_lambda(source, ctx), ctx);
+    return name;
+}
+
+/* Source files are mapped and their top-level forms are read one at a
+   time, the reader copies names and strings so nothing points into the
+   text once a form is read. The tail of the last page of a mapping is
+   zero, which ends the text. A file that fills its last page, or
+   cannot be mapped, is read into memory instead. */
+typedef struct lsp_source {
+    char *text;
+    size_t size;
+    bool mapped;
+} lsp_source;
+
+bool lsp_source_read(lsp_source *src, int fd) {
+    size_t size = 0;
+    size_t capacity = 4096;
+    char *text = lsp_alloc(capacity);
+    CHECK(text != NULL);
+
+    while (1) {
+        if (size + 1 == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+            CHECK(text != NULL);
+        }
+
+        ssize_t len = read(fd, text + size, capacity - size - 1);
+        if (len < 0) {
+            lsp_free(text);
+            return false;
+        }
+        if (len == 0)
+            break;
+        size += len;
+    }
+
+    text[size] = '\0';
+    src->text = text;
+    src->size = size;
+    src->mapped = false;
+    return true;
+}
+
+bool lsp_source_open(lsp_source *src, const char *file_name) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (ok && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        st.st_size % page != 0) {
+        void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED) {
+            posix_madvise(text, st.st_size, POSIX_MADV_SEQUENTIAL);
+            src->text = text;
+            src->size = st.st_size;
+            src->mapped = true;
+            close(fd);
+            return true;
+        }
+    }
+
+    ok = ok && lsp_source_read(src, fd);
+    close(fd);
+    return ok;
+}
+
+void lsp_source_close(lsp_source *src) {
+    if (src->mapped)
+        munmap(src->text, src->size);
+    else
+        lsp_free(src->text);
+}
+
+/* Evaluates the forms of a file in order and returns the value of the
+   last one */
+lsp_obj * lsp_load(lsp_obj *file_name, lsp_context *ctx) {
+    lsp_source src;
+    if (! lsp_source_open(&src, lsp_obj_as_string(file_name))) {
+        TRACE("Unable to load: %s", lsp_obj_as_string(file_name));
+        return lsp_obj_nil();
+    }
+
+    lsp_obj *res = lsp_obj_nil();
+    lsp_protect(&res, ctx);
+
+    char *pos = src.text;
+    lsp_obj *form = NULL;
+    while ((form = lsp_read_next(&pos, ctx)) != NULL)
+        res = lsp_eval_obj(form, ctx);
+
+    lsp_unprotect(1, ctx);
+    lsp_source_close(&src);
+    return res;
+}
+
+/* Forms ending in tail position set tail and return the expression
+   left to evaluate */
+lsp_obj * lsp_eval_cons(lsp_obj *o, bool *tail, lsp_context *ctx) {
+    lsp_obj *res = NULL;
+    lsp_obj *args = lsp_cdr(o);
+
+    switch (lsp_obj_form(lsp_car(o))) {
+    case FORM_IF:
+        res = lsp_if(args, ctx);
+        *tail = true;
+        break;
+    case FORM_LIST:
+        res = lsp_list(args, ctx);
+        break;
+    case FORM_LET:
+        res = lsp_let(args, ctx);
+        *tail = true;
+        break;
+    case FORM_SET: {
+        lsp_obj *name = lsp_eval_obj(lsp_car(args), ctx);
+        lsp_protect(&name, ctx);
+        lsp_obj *value = lsp_eval_obj(lsp_car(lsp_cdr(args)), ctx);
+        res = lsp_set(name, value, ctx);
+        lsp_unprotect(1, ctx);
+        break;
+    }
+    case FORM_LAMBDA:
+        res = lsp_obj_lambda(args, ctx);
+        break;
+    case FORM_DEFUN:
+        res = lsp_defun(args, ctx);
+        break;
+    case FORM_PROGN:
+        res = lsp_eval_body(args, ctx);
+        *tail = true;
+        break;
+    case FORM_CONS: {
+        lsp_obj *car = lsp_eval_obj(lsp_car(args), ctx);
+        lsp_protect(&car, ctx);
+        lsp_obj *cdr = lsp_eval_obj(lsp_car(lsp_cdr(args)), ctx);
+        res = lsp_obj_cons(car, cdr, ctx);
+        lsp_unprotect(1, ctx);
+        break;
+    }
+    case FORM_CAR:
+        res = lsp_car(lsp_eval_obj(lsp_car(args), ctx));
+        break;
+    case FORM_CDR:
+        res = lsp_cdr(lsp_eval_obj(lsp_car(args), ctx));
+        break;
+    case FORM_EQUAL: {
+        lsp_obj *a = lsp_eval_obj(lsp_car(args), ctx);
+        lsp_protect(&a, ctx);
+        lsp_obj *b = lsp_eval_obj(lsp_car(lsp_cdr(args)), ctx);
+        res = lsp_truth(lsp_obj_equal(a, b), ctx);
+        lsp_unprotect(1, ctx);
+        break;
+    }
+    case FORM_LOAD:
+        res = lsp_load(lsp_car(args), ctx);
+        break;
+    default: {
+        lsp_obj *proc = lsp_eval_obj(lsp_car(o), ctx);
+        lsp_protect(&proc, ctx);
+        int argc = lsp_eval_args(lsp_cdr(o), ctx);
+        res = lsp_apply(proc, argc, tail, ctx);
+        lsp_unprotect(1, ctx);
+    }
+    }
+    return res;
+}
+
+lsp_obj * lsp_eval_symbol(lsp_obj *name, lsp_context *ctx) {
+    lsp_obj *value = lsp_env_lookup(name, ctx);
+    return value;
+}
+
+lsp_obj * lsp_eval_atom(lsp_obj *expr, lsp_context *ctx) {
+    lsp_obj *res = lsp_obj_nil();
+    
+    switch (lsp_obj_type(expr)) {
+    case SYMBOL:
+        res = lsp_eval_symbol(expr, ctx);
+        break;
+    case STRING:
+    case NUM:
+        res = expr;
+        break;
+    case NIL:
+        res = lsp_obj_nil();
+        break;
+    case QUOTE:
+        res = lsp_eval_quote(expr, ctx);
+        break;
+    case LOCAL:
+        res = lsp_env_lookup_local(expr, ctx);
+        break;
+    case GLOBAL:
+        res = lsp_global_ref_value(expr, ctx);
+        break;
+    default:
+        SHOULD_NEVER_BE_HERE;
+    }
+    return res;
+}
+
+/* Expressions in tail position replace the current one and may
+   replace the frames it pushed, so a tail call runs in the same C
+   frame. The caller gets its frames and stack back once the value is
+   known. */
+lsp_obj * lsp_eval_obj(lsp_obj *expr, lsp_context *ctx) {
+    if (lsp_obj_type(expr) != CONS)
+        return lsp_eval_atom(expr, ctx);
+
+    lsp_env_stack *e = &ctx->env;
+    int sp = ctx->vm.sp;
+    int fp = e->fp;
+    int tail_sp = e->tail_sp;
+    int tail_fp = e->tail_fp;
+    e->tail_sp = sp;
+    e->tail_fp = fp;
+    lsp_protect(&expr, ctx);
+
+    lsp_obj *res = NULL;
+    bool tail = true;
+    while (tail) {
+        tail = false;
+        if (lsp_obj_type(expr) != CONS)
+            res = lsp_eval_atom(expr, ctx);
+        else
+            res = lsp_eval_cons(expr, &tail, ctx);
+        expr = res;
+    }
+
+    ctx->vm.sp = sp;
+    e->fp = fp;
+    e->tail_sp = tail_sp;
+    e->tail_fp = tail_fp;
+    lsp_unprotect(1, ctx);
+    return res;
+}
+
+/* The result is held until the host releases it */
+lsp_obj * lsp_eval(lsp_obj *expr, lsp_context *ctx) {
+    lsp_mem_settle(&expr, ctx);
+    lsp_protect(&expr, ctx);
+    lsp_obj *res = lsp_eval_obj(expr, ctx);
+    lsp_unprotect(1, ctx);
+    return lsp_obj_hold(res, ctx);
+}
+
+
+/* Bytecode compiler and VM */
+
+typedef enum lsp_op {
+    OP_CONST,           /* index:16 */
+    OP_NIL,
+    OP_LOCAL,           /* slot:16 */
+    OP_SET_LOCAL,       /* slot:16 */
+    OP_FREE,            /* index:16 */
+    OP_GLOBAL,          /* index:16 of the name */
+    OP_GLOBAL_REF,      /* index:16 of the GLOBAL */
+    OP_SET,
+    OP_DEFUN,           /* index:16 of the name */
+    OP_POP,
+    OP_JUMP,            /* offset:32 */
+    OP_JUMP_IF_NIL,     /* offset:32 */
+    OP_CALL,            /* argc:16 */
+    OP_RETURN,
+    OP_CLOSURE,         /* index:16 n:16 then n * (is_free:8 index:16) */
+    OP_CONS,
+    OP_CAR,
+    OP_CDR,
+    OP_EQUAL,
+    OP_LIST,            /* n:16 */
+    OP_LOAD
+} lsp_op;
+
+/* Slots, argument counts and captures are 16 bit operands */
+#define LSP_VM_MAX_LOCALS 0xffff
+#define LSP_VM_STACK_SIZE 1024
+#define LSP_VM_FRAMES_SIZE 64
+
+typedef struct lsp_scope {
+    struct lsp_scope *parent;
+    lsp_code *code;
+    lsp_obj **locals;
+    int n_visible;
+    int locals_size;
+    lsp_obj **free;
+    int n_free;
+    int free_size;
+    int *frames;        /* first slot of each LOCAL frame */
+    int n_frames;
+    int frames_size;
+} lsp_scope;
+
+lsp_scope * lsp_scope_create(void) {
+    lsp_scope *s = lsp_alloc(sizeof(lsp_scope));
+    memset(s, 0, sizeof(lsp_scope));
+    return s;
+}
+
+void lsp_scope_delete(lsp_scope *s) {
+    lsp_free(s->locals);
+    lsp_free(s->free);
+    lsp_free(s->frames);
+    lsp_free(s);
+}
+
+/* Makes room for one more item in an array of the scope */
+static void * lsp_scope_reserve(void *items, int n, int *size,
+                                size_t item_size) {
+    CHECK(n < LSP_VM_MAX_LOCALS);
+    if (n == *size) {
+        *size = *size ? *size * 2 : 16;
+        items = realloc(items, *size * item_size);
+        CHECK(items != NULL);
+    }
+    return items;
+}
+
+lsp_code * lsp_code_create(lsp_obj *args, lsp_obj *body) {
+    lsp_code *code = lsp_alloc(sizeof(lsp_code));
+    memset(code, 0, sizeof(lsp_code));
+    code->args = args;
+    code->body = body;
+    return code;
+}
+
+void lsp_code_delete(lsp_code *code) {
+    lsp_free(code->ops);
+    lsp_free(code->consts);
+    lsp_free(code);
+}
+
+void lsp_code_emit(lsp_code *code, int byte) {
+    if (code->n_ops == code->ops_size) {
+        code->ops_size = code->ops_size ? code->ops_size * 2 : 32;
+        code->ops = realloc(code->ops, code->ops_size);
+        CHECK(code->ops != NULL);
+    }
+    code->ops[code->n_ops++] = (unsigned char) byte;
+}
+
+void lsp_code_emit16(lsp_code *code, int value) {
+    lsp_code_emit(code, value & 0xff);
+    lsp_code_emit(code, (value >> 8) & 0xff);
+}
+
+void lsp_code_emit32(lsp_code *code, long value) {
+    lsp_code_emit16(code, value & 0xffff);
+    lsp_code_emit16(code, (value >> 16) & 0xffff);
+}
+
+void lsp_code_patch32(lsp_code *code, int pos, long value) {
+    for (int i = 0; i < 4; i++)
+        code->ops[pos + i] = (value >> (8 * i)) & 0xff;
+}
+
+int lsp_code_add_const(lsp_code *code, lsp_obj *o) {
+    for (int i = 0; i < code->n_consts; i++) {
+        if (code->consts[i] == o)
+            return i;
+    }
+
+    if (code->n_consts == code->consts_size) {
+        code->consts_size = code->consts_size ? code->consts_size * 2 : 8;
+        code->consts = realloc(code->consts,
+                               code->consts_size * sizeof(lsp_obj *));
+        CHECK(code->consts != NULL);
+    }
+    CHECK(code->n_consts < 0xffff);
+    code->consts[code->n_consts] = o;
+    return code->n_consts++;
+}
+
+int lsp_scope_local(lsp_scope *s, lsp_obj *name) {
+    for (int i = s->n_visible - 1; i >= 0; i--) {
+        if (s->locals[i] == name)
+            return i;
+    }
+    return -1;
+}
+
+int lsp_scope_free(lsp_scope *s, lsp_obj *name) {
+    for (int i = 0; i < s->n_free; i++) {
+        if (s->free[i] == name)
+            return i;
+    }
+
+    if (s->parent == NULL)
+        return -1;
+
+    if (lsp_scope_local(s->parent, name) < 0 &&
+        lsp_scope_free(s->parent, name) < 0)
+        return -1;
+
+    s->free = lsp_scope_reserve(s->free, s->n_free, &s->free_size,
+                                sizeof(lsp_obj *));
+    s->free[s->n_free] = name;
+    return s->n_free++;
+}
+
+int lsp_scope_bind(lsp_scope *s, lsp_obj *name) {
+    s->locals = lsp_scope_reserve(s->locals, s->n_visible, &s->locals_size,
+                                  sizeof(lsp_obj *));
+    int slot = s->n_visible++;
+    s->locals[slot] = name;
+    if (s->n_visible > s->code->n_locals)
+        s->code->n_locals = s->n_visible;
+    return slot;
+}
+
+void lsp_compile_expr(lsp_obj *e, lsp_scope *s, lsp_context *ctx);
+
+void lsp_compile_const(lsp_obj *o, lsp_scope *s) {
+    lsp_code_emit(s->code, OP_CONST);
+    lsp_code_emit16(s->code, lsp_code_add_const(s->code, o));
+}
+
+void lsp_compile_body(lsp_obj *body, lsp_scope *s, lsp_context *ctx) {
+    if (lsp_obj_is_nil(body)) {
+        lsp_code_emit(s->code, OP_NIL);
+        return;
+    }
+
+    while (! lsp_obj_is_nil(body)) {
+        lsp_compile_expr(lsp_car(body), s, ctx);
+        body = lsp_cdr(body);
+        if (! lsp_obj_is_nil(body))
+            lsp_code_emit(s->code, OP_POP);
+    }
+}
+
+void lsp_compile_symbol(lsp_obj *name, lsp_scope *s) {
+    int index = lsp_scope_local(s, name);
+    if (index >= 0) {
+        lsp_code_emit(s->code, OP_LOCAL);
+        lsp_code_emit16(s->code, index);
+        return;
+    }
+
+    index = lsp_scope_free(s, name);
+    if (index >= 0) {
+        lsp_code_emit(s->code, OP_FREE);
+        lsp_code_emit16(s->code, index);
+        return;
+    }
+
+    lsp_code_emit(s->code, OP_GLOBAL);
+    lsp_code_emit16(s->code, lsp_code_add_const(s->code, name));
+}
+
+void lsp_compile_global_ref(lsp_obj *ref, lsp_scope *s) {
+    lsp_code_emit(s->code, OP_GLOBAL_REF);
+    lsp_code_emit16(s->code, lsp_code_add_const(s->code, ref));
+}
+
+/* A global called by name gets its own cache */
+void lsp_compile_operator(lsp_obj *op, lsp_scope *s, lsp_context *ctx) {
+    if (lsp_obj_type(op) == SYMBOL && lsp_scope_local(s, op) < 0 &&
+        lsp_scope_free(s, op) < 0)
+        lsp_compile_global_ref(lsp_obj_global_ref(op, ctx), s);
+    else
+        lsp_compile_expr(op, s, ctx);
+}
+
+void lsp_compile_if(lsp_obj *args, lsp_scope *s, lsp_context *ctx) {
+    lsp_code *code = s->code;
+
+    lsp_compile_expr(lsp_car(args), s, ctx);
+    lsp_code_emit(code, OP_JUMP_IF_NIL);
+    int else_pos = code->n_ops;
+    lsp_code_emit32(code, 0);
+
+    lsp_compile_expr(lsp_car(lsp_cdr(args)), s, ctx);
+    lsp_code_emit(code, OP_JUMP);
+    int end_pos = code->n_ops;
+    lsp_code_emit32(code, 0);
+
+    lsp_code_patch32(code, else_pos, code->n_ops - (else_pos + 4));
+    lsp_compile_expr(lsp_car(lsp_cdr(lsp_cdr(args))), s, ctx);
+    lsp_code_patch32(code, end_pos, code->n_ops - (end_pos + 4));
+}
+
+/* Bodies resolved by lsp_obj_lambda address parameters and let
+   bindings by frame, each frame maps to consecutive slots */
+void lsp_compile_local(lsp_obj *ref, lsp_scope *s) {
+    if (ref->value.local.captured) {
+        lsp_code_emit(s->code, OP_FREE);
+        lsp_code_emit16(s->code, ref->value.local.slot);
+        return;
+    }
+
+    int frame = s->n_frames - 1 - ref->value.local.depth;
+    CHECK(frame >= 0);
+
+    lsp_code_emit(s->code, OP_LOCAL);
+    lsp_code_emit16(s->code, s->frames[frame] + ref->value.local.slot);
+}
+
+void lsp_compile_let(lsp_obj *args, lsp_scope *s, lsp_context *ctx) {
+    int visible = s->n_visible;
+    s->frames = lsp_scope_reserve(s->frames, s->n_frames, &s->frames_size,
+                                  sizeof(int));
+    s->frames[s->n_frames++] = visible;
+
+    lsp_obj *cur = lsp_car(args);
+    while (! lsp_obj_is_nil(cur)) {
+        lsp_obj *binding = lsp_car(cur);
+        lsp_compile_expr(lsp_car(lsp_cdr(binding)), s, ctx);
+        lsp_code_emit(s->code, OP_SET_LOCAL);
+        lsp_code_emit16(s->code, lsp_scope_bind(s, lsp_car(binding)));
+        cur = lsp_cdr(cur);
+    }
+
+    lsp_compile_body(lsp_cdr(args), s, ctx);
+    s->n_visible = visible;
+    s->n_frames--;
+}
+
+/* Code objects never move, the compiler allocates in the old space */
+lsp_obj * lsp_code_obj(lsp_code *code, lsp_context *ctx) {
+    CHECK(ctx->mem.pretenure > 0);
+    lsp_obj *o = lsp_obj_alloc(CODE, ctx);
+    o->value.code = code;
+    return o;
+}
+
+lsp_obj * lsp_compile_lambda_code(lsp_obj *params, lsp_obj *body,
+                                  lsp_scope *parent, lsp_scope *s,
+                                  lsp_context *ctx) {
+    s->parent = parent;
+    s->code = lsp_code_create(params, body);
+
+    /* Allocated first so that the constants are reachable while the
+       body is compiled */
+    lsp_obj *o = lsp_code_obj(s->code, ctx);
+    lsp_protect(&o, ctx);
+
+    s->n_visible = 0;
+    s->n_free = 0;
+    s->frames = lsp_scope_reserve(s->frames, 0, &s->frames_size,
+                                  sizeof(int));
+    s->frames[0] = 0;
+    s->n_frames = 1;
+
+    while (! lsp_obj_is_nil(params)) {
+        lsp_scope_bind(s, lsp_car(params));
+        s->code->n_params++;
+        params = lsp_cdr(params);
+    }
+
+    lsp_compile_body(body, s, ctx);
+    lsp_code_emit(s->code, OP_RETURN);
+
+    lsp_unprotect(1, ctx);
+    return o;
+}
+
+lsp_obj * lsp_vm_lambda_code(lsp_obj *lambda, lsp_context *ctx);
+
+/* The captures of a template are references resolved in the body
+   being compiled */
+void lsp_compile_template(lsp_obj *t, lsp_scope *s, lsp_context *ctx) {
+    lsp_obj *code = lsp_vm_lambda_code(t, ctx);
+    lsp_obj *captures = t->value.lambda.closed;
+
+    lsp_code_emit(s->code, OP_CLOSURE);
+    lsp_code_emit16(s->code, lsp_code_add_const(s->code, code));
+    lsp_code_emit16(s->code, lsp_list_length(captures));
+
+    for (; ! lsp_obj_is_nil(captures); captures = lsp_cdr(captures)) {
+        lsp_local *ref = &lsp_car(captures)->value.local;
+        if (ref->captured) {
+            lsp_code_emit(s->code, 1);
+            lsp_code_emit16(s->code, ref->slot);
+        } else {
+            int frame = s->n_frames - 1 - ref->depth;
+            CHECK(frame >= 0);
+            lsp_code_emit(s->code, 0);
+            lsp_code_emit16(s->code, s->frames[frame] + ref->slot);
+        }
+    }
+}
+
+void lsp_compile_lambda(lsp_obj *args, lsp_scope *s, lsp_context *ctx) {
+    if (lsp_obj_type(lsp_car(args)) == LAMBDA) {
+        lsp_compile_template(lsp_car(args), s, ctx);
+        return;
+    }
+
+    lsp_scope *inner = lsp_scope_create();
+    lsp_obj *code = lsp_compile_lambda_code(lsp_car(args), lsp_cdr(args),
+                                            s, inner, ctx);
+
+    lsp_code_emit(s->code, OP_CLOSURE);
+    lsp_code_emit16(s->code, lsp_code_add_const(s->code, code));
+    lsp_code_emit16(s->code, inner->n_free);
+
+    for (int i = 0; i < inner->n_free; i++) {
+        int slot = lsp_scope_local(s, inner->free[i]);
+        if (slot >= 0) {
+            lsp_code_emit(s->code, 0);
+            lsp_code_emit16(s->code, slot);
+        } else {
+            lsp_code_emit(s->code, 1);
+            lsp_code_emit16(s->code, lsp_scope_free(s, inner->free[i]));
+        }
+    }
+    lsp_scope_delete(inner);
+}
+
+void lsp_compile_args(lsp_obj *args, lsp_scope *s, lsp_context *ctx) {
+    while (! lsp_obj_is_nil(args)) {
+        lsp_compile_expr(lsp_car(args), s, ctx);
+        args = lsp_cdr(args);
+    }
+}
+
+void lsp_compile_cons(lsp_obj *o, lsp_scope *s, lsp_context *ctx) {
+    lsp_code *code = s->code;
+    lsp_obj *op = lsp_car(o);
+    lsp_obj *args = lsp_cdr(o);
+
+    switch (lsp_obj_form(op)) {
+    case FORM_IF:
+        lsp_compile_if(args, s, ctx);
+        return;
+    case FORM_LIST: {
+        int n = lsp_list_length(args);
+        CHECK(n <= LSP_VM_MAX_LOCALS);
+        lsp_compile_args(args, s, ctx);
+        lsp_code_emit(code, OP_LIST);
+        lsp_code_emit16(code, n);
+        return;
+    }
+    case FORM_LET:
+        lsp_compile_let(args, s, ctx);
+        return;
+    case FORM_SET:
+        lsp_compile_args(args, s, ctx);
+        lsp_code_emit(code, OP_SET);
+        return;
+    case FORM_LAMBDA:
+        lsp_compile_lambda(args, s, ctx);
+        return;
+    case FORM_DEFUN:
+        lsp_compile_lambda(lsp_cdr(args), s, ctx);
+        lsp_code_emit(code, OP_DEFUN);
+        lsp_code_emit16(code, lsp_code_add_const(code, lsp_car(args)));
+        return;
+    case FORM_PROGN:
+        lsp_compile_body(args, s, ctx);
+        return;
+    case FORM_CONS:
+        lsp_compile_args(args, s, ctx);
+        lsp_code_emit(code, OP_CONS);
+        return;
+    case FORM_CAR:
+        lsp_compile_args(args, s, ctx);
+        lsp_code_emit(code, OP_CAR);
+        return;
+    case FORM_CDR:
+        lsp_compile_args(args, s, ctx);
+        lsp_code_emit(code, OP_CDR);
+        return;
+    case FORM_EQUAL:
+        lsp_compile_args(args, s, ctx);
+        lsp_code_emit(code, OP_EQUAL);
+        return;
+    case FORM_LOAD:
+        lsp_compile_const(lsp_car(args), s);
+        lsp_code_emit(code, OP_LOAD);
+        return;
+    default:
+        break;
+    }
+
+    int argc = lsp_list_length(args);
+    CHECK(argc <= LSP_VM_MAX_LOCALS);
+    lsp_compile_operator(op, s, ctx);
+    lsp_compile_args(args, s, ctx);
+    lsp_code_emit(code, OP_CALL);
+    lsp_code_emit16(code, argc);
+}
+
+void lsp_compile_expr(lsp_obj *e, lsp_scope *s, lsp_context *ctx) {
+    switch (lsp_obj_type(e)) {
+    case NIL:
+        lsp_code_emit(s->code, OP_NIL);
+        break;
+    case NUM:
+    case STRING:
+        lsp_compile_const(e, s);
+        break;
+    case QUOTE:
+        lsp_compile_const(e->value.expr, s);
+        break;
+    case SYMBOL:
+        lsp_compile_symbol(e, s);
+        break;
+    case LOCAL:
+        lsp_compile_local(e, s);
+        break;
+    case GLOBAL:
+        lsp_compile_global_ref(e, s);
+        break;
+    case CONS:
+        lsp_compile_cons(e, s, ctx);
+        break;
+    default:
+        SHOULD_NEVER_BE_HERE;
+    }
+}
+
+lsp_obj * lsp_compile(lsp_obj *expr, lsp_context *ctx) {
+    lsp_scope *s = lsp_scope_create();
+    s->code = lsp_code_create(lsp_obj_nil(), lsp_obj_nil());
+
+    ctx->mem.pretenure++;
+    lsp_obj *code = lsp_code_obj(s->code, ctx);
+    lsp_protect(&code, ctx);
+
+    lsp_compile_expr(expr, s, ctx);
+    lsp_code_emit(s->code, OP_RETURN);
+
+    lsp_unprotect(1, ctx);
+    ctx->mem.pretenure--;
+    lsp_scope_delete(s);
+    return code;
+}
+
+lsp_obj * lsp_vm_lambda_code(lsp_obj *lambda, lsp_context *ctx) {
+    if (lambda->value.lambda.code == NULL) {
+        lsp_protect(&lambda, ctx);
+        ctx->mem.pretenure++;
+
+        lsp_scope *s = lsp_scope_create();
+        lsp_obj *code = lsp_compile_lambda_code(lambda->value.lambda.args,
+                                                lambda->value.lambda.body,
+                                                NULL, s, ctx);
+        lsp_scope_delete(s);
+        lambda->value.lambda.code = code;
+
+        ctx->mem.pretenure--;
+        lsp_unprotect(1, ctx);
+    }
+    return lambda->value.lambda.code;
+}
+
+void lsp_vm_init(lsp_vm *vm) {
+    vm->stack_size = LSP_VM_STACK_SIZE;
+    vm->stack = lsp_alloc(vm->stack_size * sizeof(lsp_obj *));
+    vm->sp = 0;
+    vm->frames_size = LSP_VM_FRAMES_SIZE;
+    vm->frames = lsp_alloc(vm->frames_size * sizeof(lsp_frame));
+    vm->fp = 0;
+}
+
+void lsp_vm_shutdown(lsp_vm *vm) {
+    lsp_free(vm->stack);
+    lsp_free(vm->frames);
+}
+
+lsp_frame * lsp_vm_push_frame(lsp_vm *vm, lsp_code *code, int base) {
+    if (vm->fp == vm->frames_size) {
+        vm->frames_size *= 2;
+        vm->frames = realloc(vm->frames,
+                             vm->frames_size * sizeof(lsp_frame));
+        CHECK(vm->frames != NULL);
+    }
+
+    lsp_frame *f = &vm->frames[vm->fp++];
+    f->code = code;
+    f->pc = code->ops;
+    f->base = base;
+
+    for (int i = code->n_params; i < code->n_locals; i++)
+        lsp_vm_push(vm, lsp_obj_nil());
+
+    return f;
+}
+
+/* Builds a list from the n topmost stack values, leaving them on the
+   stack */
+lsp_obj * lsp_vm_list(lsp_vm *vm, int n, lsp_context *ctx) {
+    lsp_obj *l = lsp_obj_nil();
+    for (int i = 1; i <= n; i++)
+        l = lsp_obj_cons(vm->stack[vm->sp - i], l, ctx);
+    return l;
+}
+
+lsp_obj * lsp_vm_execute(lsp_obj *code, lsp_context *ctx);
+
+/* Leaves the value of the last form on the stack */
+lsp_obj * lsp_vm_load(lsp_obj *file_name, lsp_context *ctx) {
+    lsp_vm *vm = &ctx->vm;
+    lsp_source src;
+    lsp_obj *res = lsp_obj_nil();
+    lsp_vm_push(vm, res);
+
+    if (! lsp_source_open(&src, lsp_obj_as_string(file_name))) {
+        TRACE("Unable to load: %s", lsp_obj_as_string(file_name));
+        return res;
+    }
+
+    char *pos = src.text;
+    lsp_obj *form = NULL;
+    while ((form = lsp_read_next(&pos, ctx)) != NULL) {
+        vm->sp--;
+        lsp_protect(&form, ctx);
+        res = lsp_vm_execute(lsp_compile(form, ctx), ctx);
+        lsp_unprotect(1, ctx);
+    }
+
+    lsp_source_close(&src);
+    return res;
+}
+
+#define LSP_VM_READ16(pc_) ((pc_)[0] | ((pc_)[1] << 8))
+#define LSP_VM_READ32(pc_) \
+    (LSP_VM_READ16(pc_) | ((long) LSP_VM_READ16((pc_) + 2) << 16))
+
+lsp_obj * lsp_vm_run(lsp_context *ctx, int entry_fp) {
+    lsp_vm *vm = &ctx->vm;
+    lsp_frame *f = &vm->frames[vm->fp - 1];
+    lsp_code *code = f->code;
+    unsigned char *pc = f->pc;
+
+    while (1) {
+        switch (*pc++) {
+        case OP_CONST:
+            lsp_vm_push(vm, code->consts[LSP_VM_READ16(pc)]);
+            pc += 2;
+            break;
+        case OP_NIL:
+            lsp_vm_push(vm, lsp_obj_nil());
+            break;
+        case OP_LOCAL:
+            lsp_vm_push(vm, vm->stack[f->base + LSP_VM_READ16(pc)]);
+            pc += 2;
+            break;
+        case OP_SET_LOCAL:
+            vm->stack[f->base + LSP_VM_READ16(pc)] = lsp_vm_pop(vm);
+            pc += 2;
+            break;
+        case OP_FREE: {
+            lsp_obj *closed = vm->stack[f->base - 1]->value.lambda.closed;
+            for (int i = LSP_VM_READ16(pc); i > 0; i--)
+                closed = lsp_cdr(closed);
+            pc += 2;
+            lsp_vm_push(vm, lsp_car(closed));
+            break;
+        }
+        case OP_GLOBAL:
+            lsp_vm_push(vm, lsp_global_lookup(
+                                code->consts[LSP_VM_READ16(pc)], ctx));
+            pc += 2;
+            break;
+        case OP_GLOBAL_REF:
+            lsp_vm_push(vm, lsp_global_ref_value(
+                                code->consts[LSP_VM_READ16(pc)], ctx));
+            pc += 2;
+            break;
+        case OP_SET: {
+            lsp_obj *value = vm->stack[vm->sp - 1];
+            lsp_obj *name = vm->stack[vm->sp - 2];
+            value = lsp_set(name, value, ctx);
+            vm->sp -= 2;
+            lsp_vm_push(vm, value);
+            break;
+        }
+        case OP_DEFUN: {
+            lsp_obj *name = code->consts[LSP_VM_READ16(pc)];
+            pc += 2;
+            lsp_set(name, lsp_vm_top(vm), ctx);
+            vm->stack[vm->sp - 1] = name;
+            break;
+        }
+        case OP_POP:
+            vm->sp--;
+            break;
+        case OP_JUMP:
+            pc += LSP_VM_READ32(pc) + 4;
+            break;
+        case OP_JUMP_IF_NIL:
+            if (lsp_obj_is_nil(lsp_vm_pop(vm)))
+                pc += LSP_VM_READ32(pc) + 4;
+            else
+                pc += 4;
+            break;
+        case OP_CALL: {
+            int argc = LSP_VM_READ16(pc);
+            pc += 2;
+            lsp_obj *proc = vm->stack[vm->sp - argc - 1];
+
+            if (lsp_obj_type(proc) == LAMBDA) {
+                lsp_code *callee = lsp_vm_lambda_code(proc, ctx)->value.code;
+
+                for (; argc < callee->n_params; argc++)
+                    lsp_vm_push(vm, lsp_obj_nil());
+                vm->sp -= argc - callee->n_params;
+
+                f->pc = pc;
+                f = lsp_vm_push_frame(vm, callee,
+                                      vm->sp - callee->n_params);
+                code = callee;
+                pc = code->ops;
+            } else {
+                lsp_obj *res = lsp_primitive_call(
+                    proc, &vm->stack[vm->sp - argc], argc, ctx);
+                vm->sp -= argc + 1;
+                lsp_vm_push(vm, res);
+            }
+            break;
+        }
+        case OP_RETURN: {
+            lsp_obj *res = lsp_vm_top(vm);
+            vm->sp = f->base - 1;
+            vm->fp--;
+            lsp_vm_push(vm, res);
+
+            if (vm->fp == entry_fp)
+                return res;
+
+            f = &vm->frames[vm->fp - 1];
+            code = f->code;
+            pc = f->pc;
+            break;
+        }
+        case OP_CLOSURE: {
+            lsp_obj *callee = code->consts[LSP_VM_READ16(pc)];
+            int n_free = LSP_VM_READ16(pc + 2);
+            pc += 4;
+
+            lsp_obj *closed = lsp_obj_nil();
+            for (int i = n_free - 1; i >= 0; i--) {
+                lsp_obj *value = NULL;
+                int index = LSP_VM_READ16(pc + 3 * i + 1);
+                if (pc[3 * i] == 0) {
+                    value = vm->stack[f->base + index];
+                } else {
+                    value = vm->stack[f->base - 1]->value.lambda.closed;
+                    for (int j = index; j > 0; j--)
+                        value = lsp_cdr(value);
+                    value = lsp_car(value);
+                }
+                closed = lsp_obj_cons(value, closed, ctx);
+            }
+            pc += 3 * n_free;
+
+            lsp_protect(&closed, ctx);
+            lsp_obj *l = lsp_obj_alloc(LAMBDA, ctx);
+            lsp_unprotect(1, ctx);
+            l->value.lambda.args = callee->value.code->args;
+            l->value.lambda.body = callee->value.code->body;
+            l->value.lambda.code = callee;
+            l->value.lambda.closed = closed;
+
+            lsp_vm_push(vm, l);
+            break;
+        }
+        case OP_CONS: {
+            lsp_obj *o = lsp_obj_cons(vm->stack[vm->sp - 2],
+                                      vm->stack[vm->sp - 1], ctx);
+            vm->sp -= 2;
+            lsp_vm_push(vm, o);
+            break;
+        }
+        case OP_CAR:
+            vm->stack[vm->sp - 1] = lsp_car(vm->stack[vm->sp - 1]);
+            break;
+        case OP_CDR:
+            vm->stack[vm->sp - 1] = lsp_cdr(vm->stack[vm->sp - 1]);
+            break;
+        case OP_EQUAL: {
+            bool equal = lsp_obj_equal(vm->stack[vm->sp - 2],
+                                       vm->stack[vm->sp - 1]);
+            vm->sp -= 2;
+            lsp_vm_push(vm, lsp_truth(equal, ctx));
+            break;
+        }
+        case OP_LIST: {
+            int n = LSP_VM_READ16(pc);
+            pc += 2;
+            lsp_obj *l = lsp_vm_list(vm, n, ctx);
+            vm->sp -= n;
+            lsp_vm_push(vm, l);
+            break;
+        }
+        case OP_LOAD: {
+            f->pc = pc;
+            lsp_vm_load(lsp_vm_top(vm), ctx);
+            lsp_obj *res = lsp_vm_pop(vm);
+            vm->stack[vm->sp - 1] = res;
+            f = &vm->frames[vm->fp - 1];
+            break;
+        }
+        default:
+            SHOULD_NEVER_BE_HERE;
+        }
+    }
+}
+
+/* Runs a compiled top-level form and leaves its value on the stack */
+lsp_obj * lsp_vm_execute(lsp_obj *code, lsp_context *ctx) {
+    lsp_vm *vm = &ctx->vm;
+    int entry_fp = vm->fp;
+
+    lsp_vm_push(vm, code);
+    lsp_vm_push_frame(vm, code->value.code, vm->sp);
+    return lsp_vm_run(ctx, entry_fp);
+}
+
+/* Applies a procedure from C. Every procedure runs on the VM, the tree
+   walker cannot see what a closure built by compiled code captured. */
+lsp_obj * lsp_vm_call(lsp_obj *proc, lsp_obj **argv, int argc,
+                      lsp_context *ctx) {
+    lsp_vm *vm = &ctx->vm;
+    int sp = vm->sp;
+    int entry_fp = vm->fp;
+
+    lsp_vm_push(vm, proc);
+    for (int i = 0; i < argc; i++)
+        lsp_vm_push(vm, argv[i]);
+
+    lsp_obj *res = NULL;
+    if (lsp_obj_type(proc) == LAMBDA) {
+        lsp_code *code = lsp_vm_lambda_code(proc, ctx)->value.code;
+        for (; argc < code->n_params; argc++)
+            lsp_vm_push(vm, lsp_obj_nil());
+        vm->sp -= argc - code->n_params;
+
+        lsp_vm_push_frame(vm, code, vm->sp - code->n_params);
+        res = lsp_vm_run(ctx, entry_fp);
+    } else {
+        res = lsp_primitive_call(vm->stack[sp], &vm->stack[sp + 1], argc,
+                                 ctx);
+    }
+
+    vm->sp = sp;
+    return res;
+}
+
+lsp_obj * lsp_vm_eval(lsp_obj *expr, lsp_context *ctx) {
+    lsp_vm *vm = &ctx->vm;
+    int sp = vm->sp;
+
+    lsp_mem_settle(&expr, ctx);
+    lsp_protect(&expr, ctx);
+    lsp_obj *res = lsp_vm_execute(lsp_compile(expr, ctx), ctx);
+    lsp_unprotect(1, ctx);
+
+    /* Like lsp_eval, the result is held until the host releases it */
+    vm->sp = sp;
+    return lsp_obj_hold(res, ctx);
+}
+
+
+/* Parallel map and reduce
+
+   pmapcar and preduce split their list into tasks of consecutive
+   items and hand them to a pool of threads. Each worker has a context
+   of its own, so it allocates and collects without locks. The caller
+   only waits while the workers run, which keeps its heap still: they
+   copy the procedure, their items and the globals they use out of it
+   into their own heaps. Once they are idle again the caller copies the
+   results back. Every worker starts with a block of tasks and steals
+   from the others when it runs out. A worker sees the globals as they
+   were when the call began and what it sets stays in its context. */
+
+#define LSP_TASKS_PER_WORKER 4
+
+/* Tasks not yet taken, the owner takes them from the bottom and
+   thieves from the top */
+typedef struct lsp_deque {
+    int top;
+    int bottom;
+    pthread_mutex_t lock;
+} lsp_deque;
+
+/* Task i covers the items from i * task_size. The results are held by
+   the contexts of the workers that ran them. */
+typedef struct lsp_job {
+    lsp_context *caller;
+    lsp_obj *proc;
+    lsp_obj **items;
+    int n_items;
+    bool reduce;
+    int n_tasks;
+    int task_size;
+    lsp_obj **results;
+    int *ran_by;
+} lsp_job;
+
+typedef struct lsp_worker {
+    pthread_t thread;
+    int index;
+    lsp_context *ctx;
+    lsp_deque deque;
+    lsp_pool *pool;
+    unsigned long version;  /* of the caller's globals it imported */
+} lsp_worker;
+
+struct lsp_pool {
+    lsp_worker *workers;
+    int n_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    lsp_job *job;
+    unsigned long n_jobs;
+    int n_running;
+    bool stop;
+};
+
+/* Spreads the addresses of objects over the slots of a table */
+static inline size_t lsp_addr_hash(const lsp_obj *o) {
+    size_t h = (uintptr_t) o >> 3;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+static inline size_t lsp_copies_slot(const lsp_copies *t, lsp_obj *o) {
+    size_t i = lsp_addr_hash(o) & (t->n_slots - 1);
+    while (t->keys[i] != NULL && t->keys[i] != o)
+        i = (i + 1) & (t->n_slots - 1);
+    return i;
+}
+
+/* Copies into ctx are remembered until lsp_copies_end, the table is
+   only allocated once something is kept */
+void lsp_copies_begin(lsp_context *ctx) {
+    CHECK(! ctx->copies.active);
+    ctx->copies.active = true;
+}
+
+void lsp_copies_end(lsp_context *ctx) {
+    lsp_free(ctx->copies.keys);
+    lsp_free(ctx->copies.objs);
+    memset(&ctx->copies, 0, sizeof(lsp_copies));
+}
+
+void lsp_copies_grow(lsp_copies *t) {
+    lsp_obj **keys = t->keys;
+    lsp_obj **objs = t->objs;
+    size_t n_slots = t->n_slots;
+
+    t->n_slots = n_slots ? n_slots * 2 : 256;
+    t->keys = lsp_alloc(t->n_slots * sizeof(lsp_obj *));
+    t->objs = lsp_alloc(t->n_slots * sizeof(lsp_obj *));
+    CHECK(t->keys != NULL && t->objs != NULL);
+    memset(t->keys, 0, t->n_slots * sizeof(lsp_obj *));
+
+    for (size_t i = 0; i < n_slots; i++) {
+        if (keys[i] == NULL)
+            continue;
+        size_t slot = lsp_copies_slot(t, keys[i]);
+        t->keys[slot] = keys[i];
+        t->objs[slot] = objs[i];
+    }
+    lsp_free(keys);
+    lsp_free(objs);
+}
+
+/* Symbols are interned anyway. What is copied into the old space,
+   procedures and imported globals, is left out so that an old copy
+   never points to a young one found in the table. */
+static inline bool lsp_copies_keep(lsp_context *ctx, lsp_obj *o) {
+    return ctx->copies.active && ctx->mem.pretenure == 0 &&
+        ! lsp_obj_is_nil(o) && ! lsp_obj_is_fixnum(o) &&
+        lsp_obj_type(o) != SYMBOL;
+}
+
+/* NULL when o has not been copied yet */
+lsp_obj * lsp_copies_find(lsp_context *ctx, lsp_obj *o) {
+    lsp_copies *t = &ctx->copies;
+    if (t->n_keys == 0 || ! lsp_copies_keep(ctx, o))
+        return NULL;
+    size_t slot = lsp_copies_slot(t, o);
+    return t->keys[slot] != NULL ? t->objs[slot] : NULL;
+}
+
+void lsp_copies_add(lsp_context *ctx, lsp_obj *o, lsp_obj *copy) {
+    if (! lsp_copies_keep(ctx, o))
+        return;
+    lsp_copies *t = &ctx->copies;
+    if (2 * (t->n_keys + 1) > t->n_slots)
+        lsp_copies_grow(t);
+    size_t slot = lsp_copies_slot(t, o);
+    if (t->keys[slot] == NULL)
+        t->n_keys++;
+    t->keys[slot] = o;
+    t->objs[slot] = copy;
+}
+
+lsp_obj * lsp_obj_copy(lsp_obj *o, lsp_context *ctx);
+
+/* Stops at a tail that was copied before */
+lsp_obj * lsp_list_copy(lsp_obj *l, lsp_context *ctx) {
+    lsp_obj *res = lsp_obj_nil();
+    lsp_obj *last = lsp_obj_nil();
+    lsp_protect(&res, ctx);
+    lsp_protect(&last, ctx);
+
+    lsp_obj *shared = NULL;
+    while (lsp_obj_type(l) == CONS &&
+           (shared = lsp_copies_find(ctx, l)) == NULL) {
+        lsp_obj *cell = lsp_obj_cons(lsp_obj_copy(lsp_car(l), ctx),
+                                     lsp_obj_nil(), ctx);
+        lsp_copies_add(ctx, l, cell);
+        if (lsp_obj_is_nil(last)) {
+            res = cell;
+        } else {
+            lsp_cell_of(last)->cdr = cell;
+            lsp_mem_barrier(&ctx->mem, last, cell);
+        }
+        last = cell;
+        l = lsp_cdr(l);
+    }
+
+    lsp_obj *tail = shared != NULL ? shared : lsp_obj_copy(l, ctx);
+    if (lsp_obj_is_nil(last)) {
+        res = tail;
+    } else if (! lsp_obj_is_nil(tail)) {
+        lsp_cell_of(last)->cdr = tail;
+        lsp_mem_barrier(&ctx->mem, last, tail);
+    }
+
+    lsp_unprotect(2, ctx);
+    return res;
+}
+
+/* Compiled code is old, like what the compiler allocates */
+lsp_obj * lsp_code_copy(lsp_obj *o, lsp_context *ctx) {
+    lsp_code *from = o->value.code;
+    ctx->mem.pretenure++;
+
+    lsp_obj *args = lsp_obj_copy(from->args, ctx);
+    lsp_protect(&args, ctx);
+    lsp_obj *body = lsp_obj_copy(from->body, ctx);
+    lsp_protect(&body, ctx);
+    lsp_code *code = lsp_code_create(args, body);
+    lsp_obj *res = lsp_code_obj(code, ctx);
+    lsp_unprotect(2, ctx);
+    lsp_protect(&res, ctx);
+
+    code->ops = lsp_alloc(from->n_ops);
+    memcpy(code->ops, from->ops, from->n_ops);
+    code->n_ops = code->ops_size = from->n_ops;
+    code->n_params = from->n_params;
+    code->n_locals = from->n_locals;
+
+    code->consts = lsp_alloc(from->n_consts * sizeof(lsp_obj *));
+    code->consts_size = from->n_consts;
+    for (int i = 0; i < from->n_consts; i++) {
+        lsp_obj *c = lsp_obj_copy(from->consts[i], ctx);
+        code->consts[code->n_consts++] = c;
+    }
+
+    lsp_unprotect(1, ctx);
+    ctx->mem.pretenure--;
+    return res;
+}
+
+lsp_obj * lsp_lambda_copy(lsp_obj *o, lsp_context *ctx) {
+    lsp_lambda *from = &o->value.lambda;
+    lsp_obj *args = lsp_obj_copy(from->args, ctx);
+    lsp_protect(&args, ctx);
+    lsp_obj *body = lsp_obj_copy(from->body, ctx);
+    lsp_protect(&body, ctx);
+    lsp_obj *closed = from->closed ? lsp_obj_copy(from->closed, ctx) :
+        lsp_obj_nil();
+    lsp_protect(&closed, ctx);
+    lsp_obj *code = from->code ? lsp_code_copy(from->code, ctx) :
+        lsp_obj_nil();
+    lsp_protect(&code, ctx);
+
+    lsp_obj *l = lsp_obj_alloc(LAMBDA, ctx);
+    lsp_unprotect(4, ctx);
+    l->value.lambda.args = args;
+    l->value.lambda.body = body;
+    l->value.lambda.code = from->code ? code : NULL;
+    l->value.lambda.closed = closed;
+    return l;
+}
+
+/* Copies an object of a context that is not running into ctx, names
+   are interned again and the cached lookups start empty. While a job
+   copies, objects shared in the source are copied once. */
+lsp_obj * lsp_obj_copy(lsp_obj *o, lsp_context *ctx) {
+    lsp_obj *res = lsp_copies_find(ctx, o);
+    if (res != NULL)
+        return res;
+    res = lsp_obj_nil();
+
+    switch (lsp_obj_type(o)) {
+    case NIL:
+        break;
+    case NUM:
+        res = lsp_obj_num(lsp_obj_as_num(o), ctx);
+        break;
+    case SYMBOL:
+        res = lsp_obj_symbol(o->value.sym.name, ctx);
+        break;
+    case STRING:
+        res = lsp_obj_string(o->value.str, ctx);
+        break;
+    case CONS:
+        res = lsp_list_copy(o, ctx);
+        break;
+    case QUOTE:
+        res = lsp_obj_quote(lsp_obj_copy(o->value.expr, ctx), ctx);
+        break;
+    case LOCAL:
+        res = lsp_obj_local(o->value.local.depth, o->value.local.slot,
+                            o->value.local.captured,
+                            lsp_obj_copy(o->value.local.name, ctx), ctx);
+        break;
+    case GLOBAL:
+        res = lsp_obj_global_ref(lsp_obj_copy(o->value.global.name, ctx),
+                                 ctx);
+        break;
+    case LAMBDA:
+        res = lsp_lambda_copy(o, ctx);
+        break;
+    case CODE:
+        res = lsp_code_copy(o, ctx);
+        break;
+    case PRIMITIVE:
+        ctx->mem.pretenure++;
+        res = lsp_obj_alloc(PRIMITIVE, ctx);
+        ctx->mem.pretenure--;
+        res->value.prim = o->value.prim;
+        break;
+    default:
+        TRACE("Unable to copy: %s", obj_type_to_str(lsp_obj_type(o)));
+    }
+    lsp_copies_add(ctx, o, res);
+    return res;
+}
+
+/* A worker binds a global of its caller the first time it is looked
+   up, to a copy of the value. Procedures live on, so they are old. */
+lsp_obj * lsp_global_import(lsp_obj *name, lsp_context *ctx) {
+    lsp_context *from = ctx->parent;
+    const char *str = name->value.sym.name;
+    lsp_obj *key = lsp_symtab_find(&from->symbols, str, strlen(str));
+    lsp_obj *value = key != NULL ? lsp_global_find(key, from) : NULL;
+    if (value == NULL)
+        return NULL;
+
+    ctx->mem.pretenure++;
+    value = lsp_obj_copy(value, ctx);
+    ctx->mem.pretenure--;
+    lsp_global_set(name, value, ctx);
+    return value;
+}
+
+/* Forgets what a worker imported, the caller rebound a global */
+void lsp_globals_clear(lsp_context *ctx) {
+    lsp_globals *g = &ctx->globals;
+    memset(g->names, 0, g->n_slots * sizeof(lsp_obj *));
+    g->n_globals = 0;
+    g->version++;
+}
+
+/* The sequential mapcar and reduce of bs.lsp */
+lsp_obj * lsp_map_list(lsp_obj *proc, lsp_obj *l, lsp_context *ctx) {
+    lsp_obj *res = lsp_obj_nil();
+    lsp_obj *last = lsp_obj_nil();
+    lsp_protect(&proc, ctx);
+    lsp_protect(&l, ctx);
+    lsp_protect(&res, ctx);
+    lsp_protect(&last, ctx);
+
+    for (; ! lsp_obj_is_nil(l); l = lsp_cdr(l)) {
+        lsp_obj *item = lsp_car(l);
+        lsp_obj *cell = lsp_obj_cons(lsp_vm_call(proc, &item, 1, ctx),
+                                     lsp_obj_nil(), ctx);
+        if (lsp_obj_is_nil(last)) {
+            res = cell;
+        } else {
+            lsp_cell_of(last)->cdr = cell;
+            lsp_mem_barrier(&ctx->mem, last, cell);
+        }
+        last = cell;
+    }
+
+    lsp_unprotect(4, ctx);
+    return res;
+}
+
+lsp_obj * lsp_reduce_list(lsp_obj *proc, lsp_obj *l, lsp_obj *acc,
+                          lsp_context *ctx) {
+    lsp_protect(&proc, ctx);
+    lsp_protect(&l, ctx);
+    lsp_protect(&acc, ctx);
+
+    for (; ! lsp_obj_is_nil(l); l = lsp_cdr(l)) {
+        lsp_obj *args[2] = {lsp_car(l), acc};
+        acc = lsp_vm_call(proc, args, 2, ctx);
+    }
+
+    lsp_unprotect(3, ctx);
+    return acc;
+}
+
+int lsp_deque_take(lsp_deque *d, bool steal) {
+    int task = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->top < d->bottom)
+        task = steal ? d->top++ : --d->bottom;
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+int lsp_worker_next_task(lsp_worker *w) {
+    lsp_pool *p = w->pool;
+    int task = lsp_deque_take(&w->deque, false);
+    for (int i = 1; task < 0 && i < p->n_workers; i++)
+        task = lsp_deque_take(&p->workers[(w->index + i) % p->n_workers].deque,
+                              true);
+    return task;
+}
+
+/* A reduce task starts from its first item, the caller folds the
+   results of the tasks into its initial value */
+void lsp_worker_run(lsp_worker *w, lsp_job *job) {
+    lsp_context *ctx = w->ctx;
+    if (w->version != job->caller->globals.version) {
+        lsp_globals_clear(ctx);
+        w->version = job->caller->globals.version;
+    }
+
+    lsp_obj *proc = NULL;
+    int task;
+    lsp_copies_begin(ctx);
+    while ((task = lsp_worker_next_task(w)) >= 0) {
+        if (proc == NULL) {
+            ctx->mem.pretenure++;
+            proc = lsp_obj_hold(lsp_obj_copy(job->proc, ctx), ctx);
+            ctx->mem.pretenure--;
+        }
+
+        int first = task * job->task_size;
+        int n = job->n_items - first;
+        if (n > job->task_size)
+            n = job->task_size;
+
+        lsp_obj *items = lsp_obj_nil();
+        lsp_protect(&items, ctx);
+        for (int i = first + n - 1; i >= first; i--) {
+            lsp_obj *item = lsp_obj_copy(job->items[i], ctx);
+            items = lsp_obj_cons(item, items, ctx);
+        }
+
+        lsp_obj *res = job->reduce ?
+            lsp_reduce_list(proc, lsp_cdr(items), lsp_car(items), ctx) :
+            lsp_map_list(proc, items, ctx);
+        lsp_unprotect(1, ctx);
+
+        job->results[task] = lsp_obj_hold(res, ctx);
+        job->ran_by[task] = w->index;
+    }
+    lsp_copies_end(ctx);
+
+    if (proc != NULL)
+        lsp_obj_release(proc, ctx);
+}
+
+void * lsp_worker_main(void *arg) {
+    lsp_worker *w = arg;
+    lsp_pool *p = w->pool;
+    unsigned long n_jobs = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (! p->stop && p->n_jobs == n_jobs)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->stop)
+            break;
+        n_jobs = p->n_jobs;
+        lsp_job *job = p->job;
+        pthread_mutex_unlock(&p->lock);
+
+        lsp_worker_run(w, job);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->n_running == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
 }
 
-lsp_obj * lsp_read_list(char *txt, char **next,
-                        lsp_context *ctx) {
-    txt++;
-    txt = lsp_eat_space(txt);
-
-    lsp_obj *res = NULL;
-        
-    if (lsp_peek(txt) == ')') {
-        res = lsp_obj_nil();
-        *next = txt + 1;
-    } else {
-        res = lsp_read_list_inner(txt, next, ctx);
+lsp_pool * lsp_pool_create(lsp_context *ctx) {
+    lsp_pool *p = lsp_alloc(sizeof(lsp_pool));
+    p->n_workers = ctx->n_workers;
+    p->workers = lsp_alloc(p->n_workers * sizeof(lsp_worker));
+    p->job = NULL;
+    p->n_jobs = 0;
+    p->n_running = 0;
+    p->stop = false;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (int i = 0; i < p->n_workers; i++) {
+        lsp_worker *w = &p->workers[i];
+        w->index = i;
+        w->pool = p;
+        w->version = 0;
+        w->ctx = lsp_init(NULL);
+        w->ctx->parent = ctx;
+        w->deque.top = w->deque.bottom = 0;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        CHECK(pthread_create(&w->thread, NULL, lsp_worker_main, w) == 0);
     }
-    
-    return res;
+    return p;
 }
 
+void lsp_pool_delete(lsp_pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->n_workers; i++) {
+        lsp_worker *w = &p->workers[i];
+        pthread_join(w->thread, NULL);
+        lsp_shutdown(w->ctx);
+        pthread_mutex_destroy(&w->deque.lock);
+    }
 
-lsp_obj * lsp_read_quote(char *txt, char **next, lsp_context *ctx) {
-    txt++;
-    lsp_obj *expr = lsp_read_obj(txt, next, ctx);
-    return lsp_obj_quote(expr, ctx);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    lsp_free(p->workers);
+    lsp_free(p);
 }
 
-lsp_obj * lsp_read_obj(char *txt, char **next,
-                       lsp_context *ctx) {
-    CHECK(*next != NULL);
-    
-    txt = lsp_eat_space(txt);
-    lsp_obj *obj = NULL;
+/* Runs the tasks over the items of l on the workers and waits for
+   them. Returns false when l should be handled in the calling thread:
+   the context has no workers or is a worker itself, or there is only
+   one item. */
+bool lsp_job_run(lsp_job *job, lsp_obj *proc, lsp_obj *l, bool reduce,
+                 lsp_context *ctx) {
+    int n_items = lsp_list_length(l);
+    if (ctx->n_workers < 1 || ctx->parent != NULL || n_items < 2)
+        return false;
+    if (ctx->pool == NULL)
+        ctx->pool = lsp_pool_create(ctx);
+    lsp_pool *p = ctx->pool;
+
+    job->caller = ctx;
+    job->proc = proc;
+    job->reduce = reduce;
+    job->n_items = n_items;
+    job->items = lsp_alloc(n_items * sizeof(lsp_obj *));
+    for (int i = 0; i < n_items; i++, l = lsp_cdr(l))
+        job->items[i] = lsp_car(l);
+
+    int n_tasks = p->n_workers * LSP_TASKS_PER_WORKER;
+    if (n_tasks > n_items)
+        n_tasks = n_items;
+    job->task_size = (n_items + n_tasks - 1) / n_tasks;
+    job->n_tasks = (n_items + job->task_size - 1) / job->task_size;
+    job->results = lsp_alloc(job->n_tasks * sizeof(lsp_obj *));
+    job->ran_by = lsp_alloc(job->n_tasks * sizeof(int));
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->n_workers; i++) {
+        p->workers[i].deque.top = i * job->n_tasks / p->n_workers;
+        p->workers[i].deque.bottom = (i + 1) * job->n_tasks / p->n_workers;
+    }
+    p->job = job;
+    p->n_jobs++;
+    p->n_running = p->n_workers;
+    pthread_cond_broadcast(&p->start);
+    while (p->n_running > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+    p->job = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    /* The heap of the caller may move again */
+    lsp_free(job->items);
+    return true;
+}
 
-    char next_char = lsp_peek(txt);
-    if (next_char == '(') {
-        obj = lsp_read_list(txt, next, ctx);
-    } else if (next_char == '\"') {
-        obj = lsp_read_string(txt, next, ctx);
-    } else if (lsp_is_digit(next_char)) {
-        obj = lsp_read_num(txt, next, ctx);
-    } else if (next_char == '\'') {
-        obj = lsp_read_quote(txt, next, ctx);
-    } else {
-        obj = lsp_read_symbol(txt, next, ctx);
+/* Copies the results of the tasks into a list, in task order, and
+   lets the workers drop them. Nothing runs in between, so objects the
+   results share are copied once. */
+lsp_obj * lsp_job_results(lsp_job *job, lsp_context *ctx) {
+    lsp_obj *res = lsp_obj_nil();
+    lsp_protect(&res, ctx);
+
+    lsp_copies_begin(ctx);
+    for (int i = job->n_tasks - 1; i >= 0; i--) {
+        lsp_context *from = ctx->pool->workers[job->ran_by[i]].ctx;
+        lsp_obj *part = lsp_obj_copy(job->results[i], ctx);
+        res = lsp_obj_cons(part, res, ctx);
+        lsp_obj_release(job->results[i], from);
     }
+    lsp_copies_end(ctx);
 
-    return obj;
+    lsp_unprotect(1, ctx);
+    return res;
 }
 
-lsp_obj * lsp_read(char *txt, lsp_context *ctx) {
-    char *next = "";
-    return lsp_read_obj(txt, &next, ctx);
+void lsp_job_free(lsp_job *job) {
+    lsp_free(job->results);
+    lsp_free(job->ran_by);
 }
 
-char * lsp_print_num(lsp_obj *o, char *buf) {
-    int written = sprintf(buf, "%ld", o->value.num);
-    return buf + written;
-}
+lsp_obj * lsp_primitive_pmapcar(lsp_obj **argv, int argc,
+                                lsp_context *ctx) {
+    lsp_job job;
+    if (! lsp_job_run(&job, argv[0], argv[1], false, ctx))
+        return lsp_map_list(argv[0], argv[1], ctx);
 
-char * lsp_print_symbol(lsp_obj *o, char *buf) {
-    CHECK(o->type == SYMBOL);
-    
-    const char *str = o->value.str;
-    const size_t len = strlen(str);
-    memcpy(buf, str, len);
+    lsp_obj *parts = lsp_job_results(&job, ctx);
+    lsp_obj *res = lsp_obj_nil();
+    lsp_obj *last = lsp_obj_nil();
+    lsp_protect(&parts, ctx);
+    lsp_protect(&res, ctx);
+    lsp_protect(&last, ctx);
+
+    for (; ! lsp_obj_is_nil(parts); parts = lsp_cdr(parts)) {
+        lsp_obj *part = lsp_car(parts);
+        if (lsp_obj_is_nil(part))
+            continue;
+
+        if (lsp_obj_is_nil(last)) {
+            res = part;
+        } else {
+            lsp_cell_of(last)->cdr = part;
+            lsp_mem_barrier(&ctx->mem, last, part);
+        }
+        for (last = part; ! lsp_obj_is_nil(lsp_cdr(last));
+             last = lsp_cdr(last))
+            ;
+    }
 
-    return buf + len;
+    lsp_unprotect(3, ctx);
+    lsp_job_free(&job);
+    return res;
 }
 
-char * lsp_print_string(lsp_obj *o, char *buf) {
-    CHECK(o->type == STRING);
+/* Gives the result of reduce when proc is associative and commutative,
+   like + */
+lsp_obj * lsp_primitive_preduce(lsp_obj **argv, int argc,
+                                lsp_context *ctx) {
+    lsp_job job;
+    if (! lsp_job_run(&job, argv[0], argv[1], true, ctx))
+        return lsp_reduce_list(argv[0], argv[1], argv[2], ctx);
+
+    lsp_obj *parts = lsp_job_results(&job, ctx);
+    lsp_obj *proc = argv[0];
+    lsp_obj *acc = argv[2];
+    lsp_protect(&parts, ctx);
+    lsp_protect(&proc, ctx);
+    lsp_protect(&acc, ctx);
+
+    for (; ! lsp_obj_is_nil(parts); parts = lsp_cdr(parts)) {
+        lsp_obj *args[2] = {lsp_car(parts), acc};
+        acc = lsp_vm_call(proc, args, 2, ctx);
+    }
 
-    int len = sprintf(buf, "\"%s\"", o->value.str);
-    return buf + len;
+    lsp_unprotect(3, ctx);
+    lsp_job_free(&job);
+    return acc;
 }
 
-char * lsp_print_quote(lsp_obj *o, char *buf) {
-    sprintf(buf++, "\'");
-    return lsp_print_obj(o->value.expr, buf);
+/* Heap images
+
+   An image holds the global bindings and everything they reach, so a
+   program can start from a loaded library without reading and
+   evaluating it again. Objects and conses are stored as records that
+   refer to each other by index, tagged like pointers, so the file is
+   mapped wherever the system puts it. Loading allocates one object
+   per record in the old space and relocates the references through
+   the index. Symbols are interned again, primitives are found by name
+   and the lookups cached by globals start empty. */
+
+#define LSP_IMAGE_MAGIC "lspimg\n"
+#define LSP_IMAGE_VERSION 2
+/* References that are not fixnums or records */
+#define LSP_IMAGE_NULL 0
+#define LSP_IMAGE_NIL 4
+/* Index of the first object record in a reference */
+#define LSP_IMAGE_FIRST_OBJ 2
+
+typedef uint64_t lsp_image_ref;
+
+/* Followed by the objects, codes, cells, constant bits of the cells,
+   globals, words and bytes, in that order */
+typedef struct lsp_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t word_size;
+    uint64_t n_objs;
+    uint64_t n_codes;
+    uint64_t n_cells;
+    uint64_t n_globals;
+    uint64_t n_words;
+    uint64_t n_bytes;
+} lsp_image_header;
+
+/* The fields are those of the object in the order of its value, with
+   the offset of the text of a symbol, string or primitive name and the
+   index of the record of a code */
+typedef struct lsp_image_obj {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t f[4];
+} lsp_image_obj;
+
+typedef struct lsp_image_code {
+    uint64_t ops;       /* offset in the bytes */
+    uint64_t consts;    /* index of the first word */
+    uint32_t n_ops;
+    uint32_t n_consts;
+    uint32_t n_params;
+    uint32_t n_locals;
+    lsp_image_ref args;
+    lsp_image_ref body;
+} lsp_image_code;
+
+typedef struct lsp_image_cell {
+    lsp_image_ref car;
+    lsp_image_ref cdr;
+} lsp_image_cell;
+
+typedef struct lsp_image_global {
+    lsp_image_ref name;
+    lsp_image_ref value;
+    lsp_image_ref source;
+    lsp_image_ref depends;
+} lsp_image_global;
+
+static inline size_t lsp_image_n_bits(uint64_t n_cells) {
+    return (n_cells + 63) / 64;
 }
 
-char * lsp_print_list(lsp_obj *o, char *buf) {
-    sprintf(buf, "(");
-    buf++;
+/* Saved objects and conses by address, with the queues of those whose
+   records are left to write */
+typedef struct lsp_image_writer {
+    lsp_context *ctx;
+    lsp_obj **keys;
+    lsp_image_ref *refs;
+    size_t n_slots;
+    size_t n_keys;
+    lsp_obj **objs;
+    size_t n_objs;
+    size_t objs_size;
+    lsp_obj **cells;
+    size_t n_cells;
+    size_t cells_size;
+    lsp_buf sections[6];    /* objs, codes, cells, globals, words, bytes */
+} lsp_image_writer;
+
+enum {IMAGE_OBJS, IMAGE_CODES, IMAGE_CELLS, IMAGE_GLOBALS, IMAGE_WORDS,
+      IMAGE_BYTES};
+
+static inline size_t lsp_image_slot(const lsp_image_writer *w,
+                                    lsp_obj *o) {
+    size_t i = lsp_addr_hash(o) & (w->n_slots - 1);
+    while (w->keys[i] != NULL && w->keys[i] != o)
+        i = (i + 1) & (w->n_slots - 1);
+    return i;
+}
 
-    lsp_obj *cur = o;
-    while (1) {
-        if (lsp_obj_is_nil(cur)) {
-            sprintf(buf++, ")");
-            break;
-        } else if (cur != o) {
-            sprintf(buf++, " ");
-        }
+void lsp_image_grow(lsp_image_writer *w) {
+    lsp_obj **keys = w->keys;
+    lsp_image_ref *refs = w->refs;
+    size_t n_slots = w->n_slots;
+
+    w->n_slots = n_slots ? n_slots * 2 : 1024;
+    w->keys = lsp_alloc(w->n_slots * sizeof(lsp_obj *));
+    w->refs = lsp_alloc(w->n_slots * sizeof(lsp_image_ref));
+    CHECK(w->keys != NULL && w->refs != NULL);
+    memset(w->keys, 0, w->n_slots * sizeof(lsp_obj *));
+
+    for (size_t i = 0; i < n_slots; i++) {
+        if (keys[i] == NULL)
+            continue;
+        size_t slot = lsp_image_slot(w, keys[i]);
+        w->keys[slot] = keys[i];
+        w->refs[slot] = refs[i];
+    }
+    lsp_free(keys);
+    lsp_free(refs);
+}
 
-        if (cur->type != CONS) {
-            buf += sprintf(buf, ". ");
-            buf = lsp_print_obj(cur, buf);
-            cur = lsp_obj_nil();
-        } else {
-            buf = lsp_print_obj(cur->value.con.car, buf);
-            cur = cur->value.con.cdr;
-        }
+static void lsp_image_queue(lsp_obj ***queue, size_t *n, size_t *size,
+                            lsp_obj *o) {
+    if (*n == *size) {
+        *size = *size ? *size * 2 : 256;
+        *queue = realloc(*queue, *size * sizeof(lsp_obj *));
+        CHECK(*queue != NULL);
+    }
+    (*queue)[(*n)++] = o;
+}
+
+/* The first reference to an object queues it for a record */
+lsp_image_ref lsp_image_ref_of(lsp_image_writer *w, lsp_obj *o) {
+    if (o == NULL)
+        return LSP_IMAGE_NULL;
+    if (lsp_obj_is_nil(o))
+        return LSP_IMAGE_NIL;
+    if (lsp_obj_is_fixnum(o))
+        return (uintptr_t) o;
+
+    if (2 * (w->n_keys + 1) > w->n_slots)
+        lsp_image_grow(w);
+    size_t slot = lsp_image_slot(w, o);
+    if (w->keys[slot] != NULL)
+        return w->refs[slot];
+
+    lsp_image_ref ref;
+    if (lsp_obj_is_cons(o)) {
+        ref = (lsp_image_ref) w->n_cells << 2 | LSP_TAG_CONS;
+        lsp_image_queue(&w->cells, &w->n_cells, &w->cells_size, o);
+    } else {
+        ref = (lsp_image_ref) (w->n_objs + LSP_IMAGE_FIRST_OBJ) << 2;
+        lsp_image_queue(&w->objs, &w->n_objs, &w->objs_size, o);
     }
-    return buf;
+    w->keys[slot] = o;
+    w->refs[slot] = ref;
+    w->n_keys++;
+    return ref;
 }
 
-char * lsp_print_nil(char *buf) {
-    sprintf(buf, "nil");
-    return buf + 3;
+static uint64_t lsp_image_text(lsp_image_writer *w, const char *text) {
+    lsp_buf *b = &w->sections[IMAGE_BYTES];
+    uint64_t offset = b->len;
+    lsp_buf_append(b, text, strlen(text) + 1);
+    return offset;
 }
 
-char * lsp_print_lambda(lsp_obj *o, char *buf) {
-    return buf + sprintf(buf, "lambda");
+static void lsp_image_put(lsp_image_writer *w, int section,
+                          const void *data, size_t size) {
+    lsp_buf_append(&w->sections[section], data, size);
 }
 
-char * lsp_print_obj(lsp_obj *obj, char *buf) {
-    char *next = buf;
-    
-    switch (obj->type) {
+void lsp_image_write_code(lsp_image_writer *w, const lsp_code *code) {
+    lsp_image_code r;
+    memset(&r, 0, sizeof(r));
+    r.ops = w->sections[IMAGE_BYTES].len;
+    r.consts = w->sections[IMAGE_WORDS].len / sizeof(lsp_image_ref);
+    r.n_ops = code->n_ops;
+    r.n_consts = code->n_consts;
+    r.n_params = code->n_params;
+    r.n_locals = code->n_locals;
+    r.args = lsp_image_ref_of(w, code->args);
+    r.body = lsp_image_ref_of(w, code->body);
+
+    lsp_image_put(w, IMAGE_BYTES, code->ops, code->n_ops);
+    for (int i = 0; i < code->n_consts; i++) {
+        lsp_image_ref c = lsp_image_ref_of(w, code->consts[i]);
+        lsp_image_put(w, IMAGE_WORDS, &c, sizeof(c));
+    }
+    lsp_image_put(w, IMAGE_CODES, &r, sizeof(r));
+}
+
+void lsp_image_write_obj(lsp_image_writer *w, lsp_obj *o) {
+    lsp_image_obj r;
+    memset(&r, 0, sizeof(r));
+    r.type = o->type;
+    r.flags = o->flags & LSP_FLAG_CONST;
+
+    switch (o->type) {
+    case SYMBOL:
+        r.f[0] = lsp_image_text(w, o->value.sym.name);
+        break;
     case STRING:
-        next = lsp_print_string(obj, buf);
+        r.f[0] = lsp_image_text(w, o->value.str);
         break;
     case NUM:
-        next = lsp_print_num(obj, buf);
+        r.f[0] = (uint64_t) o->value.num;
         break;
-    case CONS:
-        next = lsp_print_list(obj, buf);
+    case QUOTE:
+        r.f[0] = lsp_image_ref_of(w, o->value.expr);
         break;
-    case NIL:
-        next = lsp_print_nil(buf);
+    case ENV:
+        r.f[0] = lsp_image_ref_of(w, o->value.env.names);
+        r.f[1] = lsp_image_ref_of(w, o->value.env.values);
         break;
-    case SYMBOL:
-        next = lsp_print_symbol(obj, buf);
+    case LAMBDA:
+        r.f[0] = lsp_image_ref_of(w, o->value.lambda.args);
+        r.f[1] = lsp_image_ref_of(w, o->value.lambda.body);
+        r.f[2] = lsp_image_ref_of(w, o->value.lambda.code);
+        r.f[3] = lsp_image_ref_of(w, o->value.lambda.closed);
         break;
-    case QUOTE:
-        next = lsp_print_quote(obj, buf);
+    case LOCAL:
+        r.f[0] = o->value.local.depth;
+        r.f[1] = o->value.local.slot;
+        r.f[2] = o->value.local.captured;
+        r.f[3] = lsp_image_ref_of(w, o->value.local.name);
         break;
-    case LAMBDA:
-        next = lsp_print_lambda(obj, buf);
+    case GLOBAL:
+        r.f[0] = lsp_image_ref_of(w, o->value.global.name);
+        break;
+    case PRIMITIVE:
+        r.f[0] = lsp_image_text(w, o->value.prim->name);
+        break;
+    case CODE:
+        r.f[0] = w->sections[IMAGE_CODES].len / sizeof(lsp_image_code);
+        lsp_image_write_code(w, o->value.code);
         break;
     default:
-        SHOULD_NEVER_BE_HERE;
+        TRACE("Unable to save: %s", obj_type_to_str(o->type));
+        r.type = NIL;
     }
-    return next;
+    lsp_image_put(w, IMAGE_OBJS, &r, sizeof(r));
 }
 
-char * lsp_print(lsp_obj *obj) {
-    static char buf[256];
-    char * next = lsp_print_obj(obj, buf);
-    *next = '\0';
-    return buf;
+void lsp_image_write_cell(lsp_image_writer *w, lsp_obj *o) {
+    lsp_image_cell r;
+    r.car = lsp_image_ref_of(w, lsp_car(o));
+    r.cdr = lsp_image_ref_of(w, lsp_cdr(o));
+    lsp_image_put(w, IMAGE_CELLS, &r, sizeof(r));
 }
 
-
-lsp_obj * lsp_eval_quote(lsp_obj *o, lsp_context *ctx) {
-    return lsp_obj_copy(o->value.expr, ctx);
+/* Records are written in the order of the queues, which grow while
+   the fields of the queued objects are referenced */
+void lsp_image_write_records(lsp_image_writer *w) {
+    size_t n_objs = 0;
+    size_t n_cells = 0;
+    while (n_objs < w->n_objs || n_cells < w->n_cells) {
+        if (n_cells < w->n_cells)
+            lsp_image_write_cell(w, w->cells[n_cells++]);
+        else
+            lsp_image_write_obj(w, w->objs[n_objs++]);
+    }
 }
 
-lsp_obj * lsp_primitive_mul(lsp_obj *args, lsp_context *ctx) {
-    lsp_obj *cur = args;
-    unsigned int prod = 1;
+bool lsp_image_write_file(lsp_image_writer *w, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+        return false;
 
-    while (! lsp_obj_is_nil(cur)) {
-        prod = prod * lsp_obj_as_num(lsp_car(cur));
-        cur = lsp_cdr(cur);
+    lsp_image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LSP_IMAGE_MAGIC, sizeof(h.magic));
+    h.version = LSP_IMAGE_VERSION;
+    h.word_size = sizeof(lsp_obj *);
+    h.n_objs = w->n_objs;
+    h.n_codes = w->sections[IMAGE_CODES].len / sizeof(lsp_image_code);
+    h.n_cells = w->n_cells;
+    h.n_globals = w->sections[IMAGE_GLOBALS].len / sizeof(lsp_image_global);
+    h.n_words = w->sections[IMAGE_WORDS].len / sizeof(lsp_image_ref);
+    h.n_bytes = w->sections[IMAGE_BYTES].len;
+
+    size_t n_bits = lsp_image_n_bits(w->n_cells);
+    uint64_t *constant = lsp_alloc(n_bits * sizeof(uint64_t) + 1);
+    memset(constant, 0, n_bits * sizeof(uint64_t));
+    for (size_t i = 0; i < w->n_cells; i++) {
+        if (lsp_obj_is_const(&w->ctx->mem, w->cells[i]))
+            constant[i / 64] |= (uint64_t) 1 << (i % 64);
     }
 
-    return lsp_obj_num(prod, ctx);
-}
-
-lsp_obj * lsp_primitive_add(lsp_obj *args, lsp_context *ctx) {
-    lsp_obj *cur = args;
-    long int sum = 0;
-    
-    while(! lsp_obj_is_nil(cur)) {
-        sum += lsp_obj_as_num(lsp_car(cur));
-        cur = lsp_cdr(cur);
+    fwrite(&h, sizeof(h), 1, fp);
+    for (int i = IMAGE_OBJS; i <= IMAGE_BYTES; i++) {
+        if (i == IMAGE_GLOBALS)
+            fwrite(constant, sizeof(uint64_t), n_bits, fp);
+        lsp_buf *b = &w->sections[i];
+        if (b->len > 0)
+            fwrite(b->data, 1, b->len, fp);
     }
+    lsp_free(constant);
 
-    return lsp_obj_num(sum, ctx);
+    bool ok = ferror(fp) == 0;
+    return fclose(fp) == 0 && ok;
 }
 
-lsp_obj * lsp_primitive_sub(lsp_obj *args, lsp_context *ctx) {
-    long int sum = lsp_obj_as_num(lsp_car(args));
-    lsp_obj *cur = lsp_cdr(args);
-    
-    while(! lsp_obj_is_nil(cur)) {
-        sum -= lsp_obj_as_num(lsp_car(cur));
-        cur = lsp_cdr(cur);
+/* Writes the global bindings and what they reach. Nothing is
+   allocated, so the heap stays as it is while it is read. */
+bool lsp_save_image(const char *path, lsp_context *ctx) {
+    lsp_image_writer w;
+    memset(&w, 0, sizeof(w));
+    w.ctx = ctx;
+    for (int i = IMAGE_OBJS; i <= IMAGE_BYTES; i++)
+        lsp_buf_init(&w.sections[i], NULL);
+
+    lsp_globals *g = &ctx->globals;
+    for (size_t i = 0; i < g->n_slots; i++) {
+        if (g->names[i] == NULL)
+            continue;
+        lsp_image_global r;
+        r.name = lsp_image_ref_of(&w, g->names[i]);
+        r.value = lsp_image_ref_of(&w, g->values[i]);
+        r.source = lsp_image_ref_of(&w, g->sources[i]);
+        r.depends = lsp_image_ref_of(&w, g->depends[i]);
+        lsp_image_put(&w, IMAGE_GLOBALS, &r, sizeof(r));
     }
+    lsp_image_write_records(&w);
+    /* Bytecode may come last, the loader wants the bytes to end a text */
+    lsp_image_put(&w, IMAGE_BYTES, "", 1);
 
-    return lsp_obj_num(sum, ctx);
-}
-
-lsp_obj * lsp_fallback_proc(lsp_obj *args, lsp_context *ctx) {
-    SHOULD_NEVER_BE_HERE;
-    return lsp_obj_nil();
-}
-
-typedef lsp_obj * (*proc_ptr)(lsp_obj *, lsp_context *);
+    bool ok = lsp_image_write_file(&w, path);
+    if (! ok) {
+        TRACE("Unable to save image: %s", path);
+    }
 
-proc_ptr lsp_get_proc(const char *name) {
-    if (strcmp(name, "+") == 0)
-        return lsp_primitive_add;
-    if (strcmp(name, "-") == 0)
-        return lsp_primitive_sub;
-    if (strcmp(name, "*") == 0)
-        return lsp_primitive_mul;
-    
-    return lsp_fallback_proc;
+    lsp_free(w.keys);
+    lsp_free(w.refs);
+    lsp_free(w.objs);
+    lsp_free(w.cells);
+    for (int i = IMAGE_OBJS; i <= IMAGE_BYTES; i++)
+        lsp_buf_free(&w.sections[i]);
+    return ok;
 }
 
-
-lsp_obj * lsp_eval_seq(lsp_obj *seq, lsp_context *ctx) {
-    if (lsp_obj_is_nil(seq)) {
+lsp_obj * lsp_primitive_save_image(lsp_obj **argv, int argc,
+                                   lsp_context *ctx) {
+    if (lsp_obj_type(argv[0]) != STRING) {
+        TRACE("save-image needs a file name");
         return lsp_obj_nil();
-    } else {
-        return lsp_obj_cons(lsp_eval(lsp_car(seq), ctx),
-                            lsp_eval_seq(lsp_cdr(seq), ctx),
-                            ctx);
     }
+    return lsp_save_image(lsp_obj_as_string(argv[0]), ctx) ?
+        ctx->sym_t : lsp_obj_nil();
 }
 
-bool lsp_is_true(lsp_obj *value) {
-    return ! lsp_obj_is_nil(value);
-}
+/* A mapped image and the objects made for its records. A reference
+   that does not fit the image makes it bad. */
+typedef struct lsp_image {
+    const lsp_image_header *header;
+    const lsp_image_obj *objs;
+    const lsp_image_code *codes;
+    const lsp_image_cell *cells;
+    const uint64_t *constant;
+    const lsp_image_global *globals;
+    const lsp_image_ref *words;
+    const char *bytes;
+    lsp_obj **obj_at;
+    lsp_obj **cell_at;
+    bool bad;
+} lsp_image;
+
+/* The sections follow the header when the counts fit the size */
+bool lsp_image_map(lsp_image *img, const void *data, size_t size) {
+    const lsp_image_header *h = data;
+    if (size < sizeof(*h) ||
+        memcmp(h->magic, LSP_IMAGE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != LSP_IMAGE_VERSION ||
+        h->word_size != sizeof(lsp_obj *))
+        return false;
 
-lsp_obj * lsp_if(lsp_obj *args,
-                 lsp_context *ctx) {
-    lsp_obj *pred = lsp_eval(lsp_car(args), ctx);
-    
-    lsp_obj *then_clause = lsp_car(lsp_cdr(args));
-    lsp_obj *else_clause = lsp_car(lsp_cdr(lsp_cdr(args)));
+    uint64_t counts[] = {h->n_objs, h->n_codes, h->n_cells,
+                         lsp_image_n_bits(h->n_cells), h->n_globals,
+                         h->n_words, h->n_bytes};
+    size_t sizes[] = {sizeof(lsp_image_obj), sizeof(lsp_image_code),
+                      sizeof(lsp_image_cell), sizeof(uint64_t),
+                      sizeof(lsp_image_global), sizeof(lsp_image_ref), 1};
+    const char *sections[7];
+    size_t offset = sizeof(*h);
+    for (int i = 0; i < 7; i++) {
+        if (counts[i] > (size - offset) / sizes[i])
+            return false;
+        sections[i] = (const char *) data + offset;
+        offset += counts[i] * sizes[i];
+    }
 
-    lsp_obj *res = lsp_obj_nil();
-    
-    if (lsp_is_true(pred))
-        res = lsp_eval(then_clause, ctx);
-    else
-        res = lsp_eval(else_clause, ctx);
+    /* Texts end before the bytes do */
+    if (offset != size || (h->n_bytes > 0 && sections[6][h->n_bytes - 1]))
+        return false;
 
-    lsp_obj_mark(pred, UNUSED);
-    return res;
+    img->header = h;
+    img->objs = (const lsp_image_obj *) sections[0];
+    img->codes = (const lsp_image_code *) sections[1];
+    img->cells = (const lsp_image_cell *) sections[2];
+    img->constant = (const uint64_t *) sections[3];
+    img->globals = (const lsp_image_global *) sections[4];
+    img->words = (const lsp_image_ref *) sections[5];
+    img->bytes = sections[6];
+    return true;
 }
 
-lsp_obj * lsp_list(lsp_obj *objs, lsp_context *ctx) {
-    return lsp_eval_seq(objs, ctx);
-}
+static lsp_obj * lsp_image_obj_of(lsp_image *img, lsp_image_ref ref) {
+    if (ref & LSP_TAG_FIXNUM)
+        return (lsp_obj *) (uintptr_t) ref;
+    if (ref == LSP_IMAGE_NIL)
+        return lsp_obj_nil();
 
-void lsp_eval_bindings(lsp_obj *bindings, lsp_context *ctx) {
-    lsp_obj *cur = bindings;
-    while (! lsp_obj_is_nil(cur)) {
-        lsp_obj *name = lsp_car(lsp_car(cur));
-        lsp_obj *value = lsp_eval(
-            lsp_car(lsp_cdr(lsp_car(cur))), ctx);
-        lsp_env_add(&(lsp_car(ctx->env_top)->value.env),
-                    name, value, ctx);
+    uint64_t i = ref >> 2;
+    if ((ref & 3) == LSP_TAG_CONS && i < img->header->n_cells)
+        return img->cell_at[i];
+    if ((ref & 3) == 0 && i >= LSP_IMAGE_FIRST_OBJ &&
+        i - LSP_IMAGE_FIRST_OBJ < img->header->n_objs)
+        return img->obj_at[i - LSP_IMAGE_FIRST_OBJ];
 
-        cur = lsp_cdr(cur);
-    }
+    img->bad = true;
+    return lsp_obj_nil();
 }
 
-
-void lsp_context_push_env(lsp_context *ctx, lsp_obj *env) {
-    ctx->env_top = lsp_obj_cons((env ?
-                                 env :
-                                 lsp_env_create(NULL, NULL, ctx)),
-                                ctx->env_top,
-                                ctx);
+static lsp_obj * lsp_image_obj_or_null(lsp_image *img, lsp_image_ref ref) {
+    return ref == LSP_IMAGE_NULL ? NULL : lsp_image_obj_of(img, ref);
 }
 
-void lsp_context_pop_env(lsp_context *ctx) {
-    lsp_obj *env = ctx->env_top;
-    lsp_obj_mark(env, UNUSED);
-    ctx->env_top = lsp_cdr(env);
+static const char * lsp_image_text_at(lsp_image *img, uint64_t offset) {
+    if (offset < img->header->n_bytes)
+        return img->bytes + offset;
+    img->bad = true;
+    return "";
 }
 
-lsp_obj * lsp_eval_body(lsp_obj *b, lsp_context *ctx) {
-    lsp_obj *cur = b;
-    lsp_obj *res = NULL;
-    while (! lsp_obj_is_nil(cur)) {
-        res = lsp_eval(lsp_car(cur), ctx);
-        cur = lsp_cdr(cur);
+/* Builtins first, then the natives the host has registered. A name
+   that is neither spoils the image. */
+lsp_obj * lsp_image_primitive(lsp_image *img, const char *name,
+                              lsp_context *ctx) {
+    const lsp_primitive *p = NULL;
+    int n = sizeof(lsp_primitives) / sizeof(lsp_primitives[0]);
+    for (int i = 0; i < n && p == NULL; i++) {
+        if (strcmp(lsp_primitives[i].name, name) == 0)
+            p = &lsp_primitives[i];
     }
-    return res;
+    for (int i = 0; i < ctx->natives.n && p == NULL; i++) {
+        if (strcmp(ctx->natives.prims[i]->name, name) == 0)
+            p = ctx->natives.prims[i];
+    }
+    if (p == NULL) {
+        TRACE("Image refers to an unknown primitive: %s", name);
+        img->bad = true;
+        return lsp_obj_nil();
+    }
+
+    lsp_obj *o = lsp_obj_alloc(PRIMITIVE, ctx);
+    o->value.prim = p;
+    return o;
 }
 
-lsp_obj * lsp_apply(lsp_obj *proc, lsp_obj * args,
-                    lsp_context *ctx) {
-    lsp_obj *res = NULL;
-    
-    if (proc->type == LAMBDA) {
-        lsp_context_push_env(ctx,
-                             lsp_env_create(proc->value.lambda.args,
-                                            args,
-                                            ctx));
-        res = lsp_eval_body(proc->value.lambda.body, ctx);
-        lsp_context_pop_env(ctx);
-    } else {
-        const char *proc_name = lsp_obj_as_string(proc);
-        res =  (*lsp_get_proc(proc_name))(args, ctx);
+lsp_obj * lsp_image_alloc(lsp_image *img, const lsp_image_obj *r,
+                          lsp_context *ctx) {
+    lsp_obj *o = NULL;
+    switch (r->type) {
+    case NIL:
+        return lsp_obj_nil();
+    case SYMBOL:
+        return lsp_obj_symbol(lsp_image_text_at(img, r->f[0]), ctx);
+    case PRIMITIVE:
+        return lsp_image_primitive(img, lsp_image_text_at(img, r->f[0]),
+                                   ctx);
+    case STRING:
+        o = lsp_obj_string(lsp_image_text_at(img, r->f[0]), ctx);
+        break;
+    case NUM:
+        o = lsp_obj_alloc(NUM, ctx);
+        o->value.num = (long int) r->f[0];
+        break;
+    case CODE:
+        o = lsp_code_obj(lsp_code_create(lsp_obj_nil(), lsp_obj_nil()), ctx);
+        break;
+    case QUOTE:
+    case ENV:
+    case LAMBDA:
+    case LOCAL:
+    case GLOBAL:
+        o = lsp_obj_alloc(r->type, ctx);
+        break;
+    default:
+        img->bad = true;
+        return lsp_obj_nil();
     }
-    return res;
+    o->flags |= r->flags & LSP_FLAG_CONST;
+    return o;
 }
 
-lsp_obj * lsp_let(lsp_obj *args, lsp_context *ctx) {
-    lsp_obj *bindings = lsp_car(args);
-    lsp_obj *body = lsp_cdr(args);
+void lsp_image_relocate_code(lsp_image *img, lsp_code *code, uint64_t i) {
+    if (i >= img->header->n_codes) {
+        img->bad = true;
+        return;
+    }
 
-    lsp_context_push_env(ctx, NULL);
-    lsp_eval_bindings(bindings, ctx);
+    const lsp_image_code *r = &img->codes[i];
+    if (r->ops > img->header->n_bytes ||
+        r->n_ops > img->header->n_bytes - r->ops ||
+        r->consts > img->header->n_words ||
+        r->n_consts > img->header->n_words - r->consts) {
+        img->bad = true;
+        return;
+    }
 
-    lsp_obj *res = lsp_eval_body(body, ctx);
+    code->args = lsp_image_obj_of(img, r->args);
+    code->body = lsp_image_obj_of(img, r->body);
+    code->n_params = r->n_params;
+    code->n_locals = r->n_locals;
 
-    lsp_context_pop_env(ctx);
-    return res;
-}
+    code->ops = lsp_alloc(r->n_ops);
+    memcpy(code->ops, img->bytes + r->ops, r->n_ops);
+    code->n_ops = code->ops_size = r->n_ops;
 
-lsp_obj * lsp_set(lsp_obj *name, lsp_obj *value,
-                  lsp_context *ctx) {
-    lsp_env_add(&lsp_car(ctx->env_top)->value.env, name, value, ctx);
-    return value;
+    code->consts = lsp_alloc(r->n_consts * sizeof(lsp_obj *));
+    for (uint32_t j = 0; j < r->n_consts; j++)
+        code->consts[j] = lsp_image_obj_of(img, img->words[r->consts + j]);
+    code->n_consts = code->consts_size = r->n_consts;
 }
 
-lsp_obj * lsp_obj_lambda(lsp_obj *o, lsp_context *ctx) {
-    lsp_obj *args = lsp_obj_copy(lsp_car(o), ctx);
-    lsp_obj *body = lsp_obj_copy(lsp_cdr(o), ctx);
-
-    lsp_obj *l = lsp_obj_alloc(ctx);
-    l->type = LAMBDA;
-    l->value.lambda.args = args;
-    l->value.lambda.body = body;
+void lsp_image_relocate(lsp_image *img, const lsp_image_obj *r,
+                        lsp_obj *o) {
+    switch (r->type) {
+    case QUOTE:
+        o->value.expr = lsp_image_obj_of(img, r->f[0]);
+        break;
+    case ENV:
+        o->value.env.names = lsp_image_obj_of(img, r->f[0]);
+        o->value.env.values = lsp_image_obj_of(img, r->f[1]);
+        break;
+    case LAMBDA:
+        o->value.lambda.args = lsp_image_obj_of(img, r->f[0]);
+        o->value.lambda.body = lsp_image_obj_of(img, r->f[1]);
+        o->value.lambda.code = lsp_image_obj_or_null(img, r->f[2]);
+        o->value.lambda.closed = lsp_image_obj_or_null(img, r->f[3]);
+        if (o->value.lambda.code != NULL &&
+            lsp_obj_type(o->value.lambda.code) != CODE)
+            img->bad = true;
+        break;
+    case LOCAL:
+        o->value.local.depth = r->f[0];
+        o->value.local.slot = r->f[1];
+        o->value.local.captured = r->f[2] != 0;
+        o->value.local.name = lsp_image_obj_of(img, r->f[3]);
+        break;
+    case GLOBAL:
+        o->value.global.name = lsp_image_obj_of(img, r->f[0]);
+        break;
+    case CODE:
+        lsp_image_relocate_code(img, o->value.code, r->f[0]);
+        break;
+    default:
+        break;
+    }
+}
 
-    return l;
+/* Makes room in the old space for every record, so that no collection
+   runs while the objects are not reachable yet */
+bool lsp_image_reserve(lsp_mem *m, const lsp_image_header *h) {
+    while ((uint64_t) m->n_free < h->n_objs) {
+        if (! lsp_mem_can_grow(m, sizeof(lsp_chunk)))
+            return false;
+        lsp_mem_add_chunk(m);
+    }
+    while ((uint64_t) m->n_free_cells < h->n_cells) {
+        if (! lsp_mem_can_grow(m, LSP_CELL_CHUNK_BYTES))
+            return false;
+        lsp_mem_add_cell_chunk(m);
+    }
+    return true;
 }
 
-lsp_obj * lsp_defun(lsp_obj *o, lsp_context *ctx) {
-    lsp_obj *name = lsp_obj_copy(lsp_car(o), ctx);
-    lsp_obj *proc = lsp_obj_lambda(lsp_cdr(o), ctx);
+/* Binds the globals of the image over those of ctx, with the records
+   that could not be loaded left out */
+void lsp_image_bind(lsp_image *img, lsp_context *ctx) {
+    lsp_globals *g = &ctx->globals;
+    for (uint64_t i = 0; i < img->header->n_globals; i++) {
+        const lsp_image_global *r = &img->globals[i];
+        lsp_obj *name = lsp_image_obj_of(img, r->name);
+        lsp_obj *value = lsp_image_obj_of(img, r->value);
+        if (lsp_obj_type(name) != SYMBOL) {
+            img->bad = true;
+            return;
+        }
 
-    lsp_set(name, proc, ctx);
-    return name;
+        lsp_global_define(name, value,
+                          lsp_image_obj_or_null(img, r->source), ctx);
+        g->depends[lsp_globals_slot(g, name)] =
+            lsp_image_obj_or_null(img, r->depends);
+    }
 }
 
-#define MAX_FILE_SIZE 10000
-char * lsp_load_file(lsp_obj *args, lsp_context *ctx) {
-    const char *file_name = lsp_obj_as_string(lsp_car(args));
-    static char buf[MAX_FILE_SIZE];
+bool lsp_image_load(lsp_image *img, lsp_context *ctx) {
+    const lsp_image_header *h = img->header;
+    if (! lsp_image_reserve(&ctx->mem, h)) {
+        TRACE("No room for the image");
+        return false;
+    }
 
-    FILE *fp = fopen(file_name, "r");
-    if (fp != NULL) {
-        char * cur = buf;
-        while (1) {
-            size_t len = fread(cur, sizeof(char), 1, fp);
+    img->obj_at = lsp_alloc(h->n_objs * sizeof(lsp_obj *) + 1);
+    img->cell_at = lsp_alloc(h->n_cells * sizeof(lsp_obj *) + 1);
+    CHECK(img->obj_at != NULL && img->cell_at != NULL);
+
+    ctx->mem.pretenure++;
+    for (uint64_t i = 0; i < h->n_objs; i++)
+        img->obj_at[i] = lsp_image_alloc(img, &img->objs[i], ctx);
+    for (uint64_t i = 0; i < h->n_cells; i++) {
+        lsp_cell *c = lsp_mem_get_cell(ctx);
+        c->car = lsp_obj_nil();
+        c->cdr = lsp_obj_nil();
+        img->cell_at[i] = lsp_cell_obj(c);
+    }
+    ctx->mem.pretenure--;
 
-            if (len == 0) {
-                *cur = '\0';
-                return buf;
-            }
-            
-            if (*cur != '\n' && *cur != '\t') {
-                cur++;
-            }
-        }
+    for (uint64_t i = 0; i < h->n_objs; i++) {
+        if (! lsp_obj_is_nil(img->obj_at[i]))
+            lsp_image_relocate(img, &img->objs[i], img->obj_at[i]);
     }
-    return NULL;
+    for (uint64_t i = 0; i < h->n_cells; i++) {
+        lsp_cell *c = lsp_cell_of(img->cell_at[i]);
+        c->car = lsp_image_obj_of(img, img->cells[i].car);
+        c->cdr = lsp_image_obj_of(img, img->cells[i].cdr);
+        if (img->constant[i / 64] & (uint64_t) 1 << (i % 64))
+            lsp_obj_set_const(img->cell_at[i]);
+    }
+
+    if (! img->bad)
+        lsp_image_bind(img, ctx);
+
+    lsp_free(img->obj_at);
+    lsp_free(img->cell_at);
+    return ! img->bad;
 }
 
-lsp_obj * lsp_eval_cons(lsp_obj *o, lsp_context *ctx) {
-    lsp_obj *res = NULL;
-    const char *op = lsp_obj_as_string(lsp_car(o));
-    lsp_obj *args = lsp_cdr(o);
-    
-    if (lsp_string_equal(op, "if")) {
-        res = lsp_if(lsp_cdr(o), ctx);
-    } else if (lsp_string_equal(op, "list")) {
-        res = lsp_list(lsp_cdr(o), ctx);
-    } else if (lsp_string_equal(op, "let")) {
-        res = lsp_let(lsp_cdr(o), ctx);
-    } else if (lsp_string_equal(op, "set")) {
-        lsp_obj *args = lsp_cdr(o);
-        lsp_obj *name = lsp_eval(lsp_car(args), ctx);
-        lsp_obj *value = lsp_eval(lsp_car(lsp_cdr(args)), ctx);
-        res = lsp_set(name, value, ctx);
-    } else if (lsp_string_equal(op, "lambda")) {
-        res = lsp_obj_lambda(args, ctx);
-    } else if (lsp_string_equal(op, "defun")) {
-        res = lsp_defun(lsp_cdr(o), ctx);
-    } else if (lsp_string_equal(op, "progn")) {
-        res = lsp_eval_body(lsp_cdr(o), ctx);
-    } else if (lsp_string_equal(op, "cons")) {
-        lsp_obj *car = lsp_eval(lsp_car(args), ctx);
-        lsp_obj *cdr = lsp_eval(lsp_car(lsp_cdr(args)), ctx);
-        res = lsp_obj_cons(car, cdr, ctx);
-    } else if (lsp_string_equal(op, "car")) {
-        lsp_obj *e = lsp_eval(lsp_car(args), ctx);
-        res = lsp_car(e);
-        e->value.con.car = lsp_obj_nil();
-        lsp_obj_mark(e, UNUSED);
-    } else if (lsp_string_equal(op, "cdr")) {
-        lsp_obj *e = lsp_eval(lsp_car(args), ctx);
-        res = lsp_cdr(e);
-        e->value.con.cdr = lsp_obj_nil();
-        lsp_obj_mark(e, UNUSED);
-    } else if (lsp_string_equal(op, "equal")) {
-        lsp_obj *a = lsp_eval(lsp_car(args), ctx);
-        lsp_obj *b = lsp_eval(lsp_car(lsp_cdr(args)), ctx);
-        res = lsp_truth(lsp_obj_equal(a, b), ctx);
-        lsp_obj_mark(a, UNUSED);
-        lsp_obj_mark(b, UNUSED);
-    } else if (lsp_string_equal(op, "load")) {
-        char *code = lsp_load_file(args, ctx);
-        lsp_obj *ro = lsp_read(code, ctx);
-        lsp_obj *eo = lsp_eval(ro, ctx);
-        lsp_obj_mark(ro, UNUSED);
-        res = eo;
+bool lsp_load_image(lsp_context *ctx, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        TRACE("Unable to open image: %s", path);
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        TRACE("Unable to map image: %s", path);
+        return false;
+    }
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    lsp_image img;
+    memset(&img, 0, sizeof(img));
+    bool loaded = false;
+    if (! lsp_image_map(&img, data, st.st_size)) {
+        TRACE("Not an image: %s", path);
     } else {
-        lsp_obj *proc = lsp_eval(lsp_car(o), ctx);
-        lsp_obj *args = lsp_eval_seq(lsp_cdr(o), ctx);
-        res = lsp_apply(proc, args, ctx);
-        lsp_obj_mark(proc, UNUSED);
-        lsp_obj_mark(args, UNUSED);
+        loaded = lsp_image_load(&img, ctx);
+        if (! loaded) {
+            TRACE("Unable to load image: %s", path);
+        }
     }
-    return res;
-}
 
-lsp_obj * lsp_eval_symbol(lsp_obj *name, lsp_context *ctx) {
-    lsp_obj *value = lsp_env_lookup(ctx->env_top, name, ctx);
-    return value;
+    munmap(data, st.st_size);
+    return loaded;
 }
 
-lsp_obj * lsp_eval(lsp_obj *expr, lsp_context *ctx) {
-    lsp_obj *res = lsp_obj_nil();
-    
-    switch (expr->type) {
-    case SYMBOL:
-        res = lsp_eval_symbol(expr, ctx);
-        break;
-    case STRING:
-    case NUM:
-        res = expr;
-        break;
-    case CONS:
-        if (! lsp_obj_is_nil(expr))
-            res = lsp_eval_cons(expr, ctx);
-        break;
-    case NIL:
-        res = lsp_obj_nil();
-        break;
-    case QUOTE:
-        res = lsp_eval_quote(expr, ctx);
-        break;
-    default:
-        SHOULD_NEVER_BE_HERE;
+lsp_context * lsp_init_from_image(const char *path,
+                                  const lsp_config *config) {
+    lsp_context *ctx = lsp_init(config);
+    if (! lsp_load_image(ctx, path)) {
+        lsp_shutdown(ctx);
+        return NULL;
     }
-    return res;
+    return ctx;
 }
@@ -1,4 +1,9 @@
+/* stat */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -8,14 +13,32 @@ static void load_library(lsp_context *ctx) {
     printf("loading library bs.lsp...\n");
     lsp_obj *ro = lsp_read("(load \"bs.lsp\")", ctx);
     lsp_obj *eo = lsp_eval(ro, ctx);
-    lsp_obj_mark(ro, UNUSED);
+    lsp_obj_release(ro, ctx);
+    lsp_obj_release(eo, ctx);
+}
+
+/* The image of the library is used until bs.lsp changes */
+static lsp_context * start(void) {
+    struct stat lib, img;
+    if (stat("bs.lsp", &lib) == 0 && stat("bs.img", &img) == 0 &&
+        img.st_mtime >= lib.st_mtime) {
+        lsp_context *ctx = lsp_init_from_image("bs.img", NULL);
+        if (ctx != NULL)
+            return ctx;
+    }
+
+    lsp_context *ctx = lsp_init(NULL);
+    load_library(ctx);
+    lsp_obj *ro = lsp_read("(save-image \"bs.img\")", ctx);
+    lsp_obj_release(lsp_eval(ro, ctx), ctx);
+    lsp_obj_release(ro, ctx);
+    return ctx;
 }
 
 int main() {
     printf("-- Welcome to LSP! --\n\n");
     
-    lsp_context *ctx = lsp_init();
-    load_library(ctx);
+    lsp_context *ctx = start();
     
     while (1) {
         char * line = readline("\nLSP> ");
@@ -28,11 +51,12 @@ int main() {
         lsp_obj *ro = lsp_read(line, ctx);
         lsp_obj *eo = lsp_eval(ro, ctx);
 
-        char *res = lsp_print(eo);
-        printf(": %s\n", res);
+        printf(": ");
+        lsp_print_file(eo, stdout);
+        printf("\n");
         
-        lsp_obj_mark(ro, UNUSED);
-        lsp_obj_mark(eo, UNUSED);
+        lsp_obj_release(ro, ctx);
+        lsp_obj_release(eo, ctx);
     }
     
     lsp_shutdown(ctx);
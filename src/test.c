@@ -1,39 +1,100 @@
 #include "minitest.h"
 #include "lsp.h"
 
+#include <stdlib.h>
+
 static lsp_context *context = 0;
 
 #define LSP_R(expr_) lsp_read((expr_), context)
 
 char * read_print(char *expr) {
     lsp_obj *o = lsp_read((expr), context);
-    char *p = lsp_print(o);
-    lsp_obj_mark(o, UNUSED);
+    char *p = lsp_print(o, context);
+    lsp_obj_release(o, context);
     return p;
 }
 
 char * read_eval_print(char *expr) {
     lsp_obj *ro = lsp_read(expr, context);
     lsp_obj *eo = lsp_eval(ro, context);
-    char *p = lsp_print(eo);
-    lsp_obj_mark(ro, UNUSED);
-    lsp_obj_mark(eo, UNUSED);
+    char *p = lsp_print(eo, context);
+    lsp_obj_release(ro, context);
+    lsp_obj_release(eo, context);
     
     return p;
 }
 
+char * read_vm_eval_print(char *expr) {
+    lsp_obj *ro = lsp_read(expr, context);
+    lsp_obj *eo = lsp_vm_eval(ro, context);
+    char *p = lsp_print(eo, context);
+    lsp_obj_release(ro, context);
+    lsp_obj_release(eo, context);
+
+    return p;
+}
+
+/* Printed text outlives the next call on the context */
+char * copy_text(const char *text) {
+    char *copy = malloc(strlen(text) + 1);
+    return strcpy(copy, text);
+}
+
+/* head, then item n times with %d replaced by its index, then tail */
+char * repeat_text(const char *head, const char *item, int n,
+                   const char *tail) {
+    size_t size = strlen(head) + n * (strlen(item) + 8) + strlen(tail) + 1;
+    char *text = malloc(size);
+    size_t len = sprintf(text, "%s", head);
+    for (int i = 0; i < n; i++)
+        len += sprintf(text + len, item, i);
+    strcpy(text + len, tail);
+    return text;
+}
 
 #define LSP_RP(expr_) read_print((expr_))
 
 #define LSP_REP(expr_)  read_eval_print((expr_))
 
+#define LSP_VREP(expr_)  read_vm_eval_print((expr_))
+
+static int type_index(const char *name) {
+    int type = 1;
+    while (lsp_type_name(type) && strcmp(lsp_type_name(type), name) != 0)
+        type++;
+    return type;
+}
+
+static lsp_obj * native_sum_squares(lsp_obj **argv, int argc,
+                                   lsp_context *ctx) {
+    long int sum = 0;
+    for (int i = 0; i < argc; i++)
+        sum += lsp_obj_as_num(argv[i]) * lsp_obj_as_num(argv[i]);
+    return lsp_obj_num(sum, ctx);
+}
+
+static lsp_obj * native_reverse_args(lsp_obj **argv, int argc,
+                                    lsp_context *ctx) {
+    lsp_obj *items[8];
+    for (int i = 0; i < argc; i++)
+        items[i] = argv[argc - 1 - i];
+    return lsp_obj_list(items, argc, ctx);
+}
+
+static lsp_obj * native_greeting(lsp_obj **argv, int argc,
+                                 lsp_context *ctx) {
+    return lsp_obj_string("hello", ctx);
+}
+
 TEST_SETUP(lsp) {
-    context = lsp_init();
+    context = lsp_init(NULL);
+
+    lsp_obj *names = lsp_read("(a b c)", context);
+    lsp_obj *values = lsp_read("(1 2 3)", context);
     lsp_context_push_env(context,
-                            lsp_env_create(
-                                lsp_read("(a b c)", context),
-                                lsp_read("(1 2 3)", context),
-                                context));
+                            lsp_env_create(names, values, context));
+    lsp_obj_release(names, context);
+    lsp_obj_release(values, context);
 }
 
 TEST_TEARDOWN(lsp) {
@@ -68,7 +129,7 @@ TEST_EQ_STR("\"foo\"", LSP_RP("\"foo\""));
 TEST_EQ_STR("\'1", LSP_RP("\'1"));
 
 /* lists */
-TEST_EQ_STR("nil", lsp_print(lsp_obj_nil()));
+TEST_EQ_STR("nil", lsp_print(lsp_obj_nil(), context));
 
 TEST_EQ_STR("(1 2)", LSP_RP("(1 2)"));
 TEST_EQ_STR("(foo 1 2)", LSP_RP("(foo 1 2)"));
@@ -112,6 +173,8 @@ TEST_EQ_STR("5", LSP_REP("(+ (- 4 1) 2)"));
 
 TEST_EQ_STR("6", LSP_REP("(* 3 2)"));
 TEST_EQ_STR("6", LSP_REP("(* (+ 1 2) (- 3 1))"));
+TEST_EQ_STR("10000000000", LSP_REP("(* 100000 100000)"));
+TEST_EQ_STR("-10000000000", LSP_VREP("(* 100000 (- 0 100000))"));
 
 /* Primitive operations and global variables */
 TEST_EQ_STR("6", LSP_REP("(+ (+ a b) c)"));
@@ -141,6 +204,14 @@ for (int j = 0; j < 10000; j++) {
 /* defun */
 TEST_EQ_STR("add", LSP_REP("(defun add (a b) (+ a b))"));
 
+/* lexical addressing */
+TEST_EQ_STR("addc", LSP_REP("(defun addc (x) (+ x c))"));
+TEST_EQ_STR("4", LSP_REP("(addc 1)"));
+TEST_EQ_STR("4", LSP_REP("(let ((c 10)) (addc 1))"));
+TEST_EQ_STR("nest", LSP_REP("(defun nest (a b) (let ((a (+ a 1)) (c (+ a b))) (let ((b c)) (list a b c))))"));
+TEST_EQ_STR("(2 3 3)", LSP_REP("(nest 1 1)"));
+TEST_EQ_STR("(2 3 3)", LSP_VREP("(nest 1 1)"));
+
 /* cons */
 TEST_EQ_STR("(1)", LSP_REP("(cons 1 nil)"));
 TEST_EQ_STR("(1 2)", LSP_REP("(cons 1 (cons 2 nil))"));
@@ -161,5 +232,696 @@ TEST_EQ_STR("nil", LSP_REP("(equal \"a\" \"b\")"));
 
 TEST_EQ_STR("t", LSP_REP("(equal 1 1)"));
 TEST_EQ_STR("nil", LSP_REP("(equal 1 2)"));
+TEST_EQ_STR("t", LSP_REP("(< 1 2)"));
+TEST_EQ_STR("nil", LSP_REP("(< 2 2)"));
+
+/* numbers */
+TEST_EQ_STR("-4", LSP_REP("(- 1 5)"));
+TEST_EQ_STR("t", LSP_REP("(equal (- 1 5) (- 0 4))"));
+TEST_EQ_STR("4611686018427387904", LSP_REP("(+ 4611686018427387903 1)"));
+TEST_EQ_STR("t", LSP_REP("(equal 4611686018427387904 (+ 4611686018427387903 1))"));
+TEST_EQ_STR("4611686018427387903", LSP_REP("(- 4611686018427387904 1)"));
+
+/* symbols */
+TEST_EQ_STR("t", LSP_REP("(equal 'foo 'foo)"));
+TEST_EQ_STR("nil", LSP_REP("(equal 'foo 'bar)"));
+TEST_EQ(LSP_R("foo"), LSP_R("foo"));
+TEST_EQ_STR("a-symbol-name-longer-than-thirty-two-characters",
+            LSP_RP("a-symbol-name-longer-than-thirty-two-characters"));
+
+/* vm */
+TEST_EQ_STR("1", LSP_VREP("a"));
+TEST_EQ_STR("\"bar\"", LSP_VREP("\"bar\""));
+TEST_EQ_STR("nil", LSP_VREP("()"));
+TEST_EQ_STR("(1 2 3)", LSP_VREP("'(1 2 3)"));
+TEST_EQ_STR("'foo", LSP_VREP("''foo"));
+TEST_EQ_STR("6", LSP_VREP("(* (+ 1 2) (- 3 1))"));
+TEST_EQ_STR("6", LSP_VREP("(+ (+ a b) c)"));
+TEST_EQ_STR("5", LSP_VREP("(if (if 1 (- 2 1) ()) (+ 2 3) 6)"));
+TEST_EQ_STR("nil", LSP_VREP("(if () 4)"));
+TEST_EQ_STR("(1 2 3)", LSP_VREP("(list 1 (+ 1 1) (if 1 3))"));
+TEST_EQ_STR("1", LSP_VREP("(let ((a 1) (b (let ((a 2)) a))) (- b a))"));
+TEST_EQ_STR("(1 2 . 3)", LSP_VREP("(cons 1 (cons 2 3))"));
+TEST_EQ_STR("(2 3)", LSP_VREP("(cdr '(1 2 3))"));
+TEST_EQ_STR("nil", LSP_VREP("(car '())"));
+TEST_EQ_STR("3", LSP_VREP("(progn 1 2 (+ 2 1))"));
+TEST_EQ_STR("t", LSP_VREP("(equal \"a\" \"a\")"));
+TEST_EQ_STR("nil", LSP_VREP("(equal 1 2)"));
+TEST_EQ_STR("t", LSP_VREP("(< 1 2)"));
+TEST_EQ_STR("nil", LSP_VREP("(< 2 1)"));
+
+/* vm - procedures */
+TEST_EQ_STR("sub", LSP_VREP("(defun sub (a b) (- a b))"));
+TEST_EQ_STR("2", LSP_VREP("(sub 3 1)"));
+TEST_EQ_STR("5", LSP_REP("(add 2 3)"));
+TEST_EQ_STR("5", LSP_VREP("(add 2 3)"));
+TEST_EQ_STR("7", LSP_VREP("(let ((y 5)) ((lambda (x) (+ x y)) 2))"));
+TEST_EQ_STR("3", LSP_VREP("(((lambda (x) (lambda (y) (+ x y))) 1) 2)"));
+
+/* vm - operands past a byte */
+{
+    char *text = repeat_text("(if nil (progn ", "(+ 1 1) ", 7000, ") 5)");
+    TEST_EQ_STR("5", LSP_REP(text));
+    TEST_EQ_STR("5", LSP_VREP(text));
+    free(text);
+
+    text = repeat_text("(+ ", "1 ", 300, ")");
+    TEST_EQ_STR("300", LSP_REP(text));
+    TEST_EQ_STR("300", LSP_VREP(text));
+    free(text);
+
+    text = repeat_text("(let (", "(v%d 1) ", 300,
+                       ") ((lambda () (+ v0 v299))))");
+    TEST_EQ_STR("2", LSP_REP(text));
+    TEST_EQ_STR("2", LSP_VREP(text));
+    free(text);
+
+    text = repeat_text("(defun many (", "p%d ", 300, ") (list p0 p299))");
+    TEST_EQ_STR("many", LSP_VREP(text));
+    free(text);
+    text = repeat_text("(many ", "%d ", 300, ")");
+    TEST_EQ_STR("(0 299)", LSP_REP(text));
+    TEST_EQ_STR("(0 299)", LSP_VREP(text));
+    free(text);
+}
+
+/* vm - library */
+TEST_EQ_STR("n-sets", LSP_VREP("(load \"bs.lsp\")"));
+TEST_EQ_STR("((3 2 1) (2 1) (1))", LSP_VREP("(n-sets 3)"));
+TEST_EQ_STR("8", LSP_VREP("(nth 3 (range 10))"));
+TEST_EQ_STR("(2 2 2)", LSP_VREP("(repeat 2 3)"));
+
+for (int j = 0; j < 20; j++) {
+    TEST_EQ_STR("500500", LSP_VREP("(reduce + (range 1000) 0)"));
+}
+
+/* shared values */
+TEST_EQ_STR("(1 2)", LSP_REP("(set 'q '(1 2))"));
+TEST_EQ_STR("t", LSP_REP("(equal (car q) (car '(1 2)))"));
+TEST_EQ_STR("(2)", LSP_REP("(cdr q)"));
+TEST_EQ_STR("(1 2)", LSP_REP("q"));
+
+for (int j = 0; j < 20; j++) {
+    TEST_EQ_STR("1001", LSP_REP("(car (mapcar (lambda (x) (+ x 1)) (range 1000)))"));
+    TEST_EQ_STR("500500", LSP_REP("(reduce + (range 1000) 0)"));
+}
+
+/* generations */
+TEST_EQ_STR("3998", LSP_REP("(car (cdr (set 'keep (mapcar (lambda (x) (* x 2)) (range 2000)))))"));
+for (int j = 0; j < 5; j++) {
+    TEST_EQ_STR("4501500", LSP_VREP("(reduce + (range 3000) 0)"));
+}
+TEST_EQ_STR("2002", LSP_REP("(nth 1000 keep)"));
+TEST_EQ_STR("2002", LSP_VREP("(nth 1000 keep)"));
+
+/* tail calls */
+TEST_EQ_STR("count-down", LSP_REP("(defun count-down (n) (if (equal n 0) 'done (count-down (- n 1))))"));
+TEST_EQ_STR("done", LSP_REP("(count-down 200000)"));
+TEST_EQ_STR("count-let", LSP_REP("(defun count-let (n a) (let ((m (- n 1))) (if (equal n 0) a (progn (count-let m (+ a 1))))))"));
+TEST_EQ_STR("100000", LSP_REP("(count-let 100000 0)"));
+TEST_EQ_STR("2", LSP_REP("(let ((x 2)) (count-down 10) x)"));
+TEST_EQ_STR("100", LSP_REP("(nth 100 (reduce (lambda (x a) (cons x a)) (range 5000) nil))"));
+
+/* marking long and deep data */
+{
+    TEST_EQ_STR("build", LSP_REP("(defun build (n a) (if (equal n 0) a (build (- n 1) (cons n a))))"));
+    TEST_EQ_STR("nest", LSP_REP("(defun nest (n a) (if (equal n 0) a (nest (- n 1) (cons a nil))))"));
+    TEST_EQ_STR("(1 2 3)", LSP_REP("(build 3 nil)"));
+    TEST_EQ_STR("((nil))", LSP_REP("(nest 2 nil)"));
+
+    lsp_gc_stats st;
+    lsp_stats(context, &st);
+    unsigned long n_major = st.n_major;
+    TEST_EQ_STR("2", LSP_REP("(car (cdr (set 'long (build 100 (build 50000 nil)))))"));
+    TEST_EQ_STR("nest", LSP_REP("(car (cdr (set 'deep (list (nest 50000 nil) 'nest))))"));
+    lsp_stats(context, &st);
+    unsigned long n_set = st.n_major;
+    for (int j = 0; j < 2; j++) {
+        TEST_EQ_STR("50000", LSP_REP("(nth 50000 (build 50000 nil))"));
+    }
+
+    /* until a whole cycle has run since, it may take several while
+       collections are incremental */
+    for (int j = 0; j < 50 && st.n_major < n_set + 2; j++) {
+        LSP_REP("(build 50000 nil)");
+        lsp_stats(context, &st);
+    }
+    TEST_EQ_STR("50000", LSP_REP("(nth 50100 long)"));
+    lsp_stats(context, &st);
+    TEST_EQ(true, st.n_major > n_major);
+    TEST_EQ(true, st.last_marked > 100000);
+}
+
+/* allocation and gc statistics */
+{
+    lsp_gc_stats before, after;
+    lsp_stats(context, &before);
+    TEST_EQ_STR("1000", LSP_REP("(nth 1000 (build 1000 nil))"));
+    lsp_stats(context, &after);
+    int cons = type_index("CONS");
+    TEST_EQ_STR("CONS", lsp_type_name(cons));
+    TEST_EQ(true, after.allocated[cons] >= before.allocated[cons] + 1000);
+    TEST_EQ(true, after.n_allocated > before.n_allocated);
+    TEST_EQ(true, after.n_minor + after.n_major > 0);
+    TEST_EQ(true, after.n_freed > 0);
+    TEST_EQ(true, after.in_use > 0);
+    TEST_EQ(true, after.peak_live >= after.last_marked);
+    TEST_EQ(true, after.max_pause <= after.pause_time);
+    TEST_EQ(NULL, lsp_type_name(-1));
+
+    TEST_EQ_STR("allocated", LSP_REP("(car (car (gc-stats)))"));
+    TEST_EQ_STR("types", LSP_REP("(car (nth 10 (gc-stats)))"));
+    TEST_EQ_STR("symbol", LSP_REP("(car (car (cdr (nth 10 (gc-stats)))))"));
+    TEST_EQ_STR("t", LSP_REP("(< 0 (cdr (car (gc-stats))))"));
+}
+
+/* global bindings */
+{
+    char expr[64];
+    for (int j = 0; j < 5000; j++) {
+        snprintf(expr, sizeof(expr), "(set 'global-%d %d)", j, j);
+        LSP_REP(expr);
+    }
+    TEST_EQ_STR("0", LSP_REP("global-0"));
+    TEST_EQ_STR("4999", LSP_VREP("global-4999"));
+    TEST_EQ_STR("5000", LSP_REP("(+ global-1 global-4999)"));
+
+    TEST_EQ_STR("redefined", LSP_REP("(defun redefined () 1)"));
+    TEST_EQ_STR("redefined", LSP_VREP("(defun redefined () 2)"));
+    TEST_EQ_STR("2", LSP_REP("(redefined)"));
+    TEST_EQ_STR("3", LSP_REP("(set 'global-0 3)"));
+    TEST_EQ_STR("3", LSP_VREP("global-0"));
+    TEST_EQ_STR("1", LSP_REP("(let ((global-0 1)) global-0)"));
+    TEST_EQ_STR("3", LSP_REP("global-0"));
+    TEST_EQ_STR("nil", LSP_REP("unbound-global"));
+}
+
+/* primitives */
+TEST_EQ_STR("+", LSP_REP("+"));
+TEST_EQ_STR("gc-stats", LSP_VREP("gc-stats"));
+TEST_EQ_STR("t", LSP_REP("(equal + +)"));
+TEST_EQ_STR("nil", LSP_VREP("(equal + -)"));
+TEST_EQ_STR("3", LSP_REP("((lambda (f) (f 1 2)) +)"));
+TEST_EQ_STR("3", LSP_VREP("((lambda (f) (f 1 2)) +)"));
+TEST_EQ_STR("+", LSP_REP("(set 'plus +)"));
+TEST_EQ_STR("5", LSP_VREP("(plus 2 3)"));
+TEST_EQ_STR("nil", LSP_REP("(< 1)"));
+TEST_EQ_STR("nil", LSP_VREP("(< 1 2 3)"));
+TEST_EQ_STR("nil", LSP_REP("(unbound-proc 1)"));
+TEST_EQ_STR("nil", LSP_VREP("(unbound-proc 1)"));
+
+/* arguments and frames on the value stack */
+{
+    TEST_EQ_STR("fib2", LSP_REP("(defun fib2 (n) (if (< n 2) n (+ (fib2 (- n 1)) (fib2 (- n 2)))))"));
+    lsp_gc_stats before, after;
+    lsp_stats(context, &before);
+    TEST_EQ_STR("610", LSP_REP("(fib2 15)"));
+    lsp_stats(context, &after);
+    TEST_EQ(true, after.n_allocated - before.n_allocated < 100);
+
+    TEST_EQ_STR("nil", LSP_REP("((lambda (a b) b) 1)"));
+    TEST_EQ_STR("1", LSP_REP("((lambda (a) a) 1 2)"));
+    TEST_EQ_STR("7", LSP_REP("((lambda (a b) (let ((c (+ a b)) (d (+ a a))) (+ c d b))) 1 2)"));
+    TEST_EQ_STR("3", LSP_REP("(let ((a 1) (b (+ a 1))) (+ a b))"));
+    TEST_EQ_STR("5000", LSP_REP("(car (range 5000))"));
+}
+
+/* closures */
+{
+    TEST_EQ_STR("adder", LSP_REP("(defun adder (n) (lambda (x) (+ x n)))"));
+    TEST_EQ_STR("5", LSP_REP("((adder 2) 3)"));
+    TEST_EQ_STR("5", LSP_VREP("((adder 2) 3)"));
+    TEST_EQ_STR("(11 12 13)", LSP_REP("(mapcar (adder 10) (list 1 2 3))"));
+    TEST_EQ_STR("vadder", LSP_VREP("(defun vadder (n) (lambda (x) (+ x n)))"));
+    TEST_EQ_STR("7", LSP_REP("((vadder 3) 4)"));
+
+    TEST_EQ_STR("mk", LSP_REP("(defun mk (a) (let ((b (* a 10))) (lambda (c) (lambda (d) (list a b c d)))))"));
+    TEST_EQ_STR("(1 10 2 3)", LSP_REP("(((mk 1) 2) 3)"));
+    TEST_EQ_STR("(1 10 2 3)", LSP_VREP("(((mk 1) 2) 3)"));
+    TEST_EQ_STR("6", LSP_REP("(let ((y 5)) ((lambda (x) (+ x y)) 1))"));
+    TEST_EQ_STR("gety", LSP_REP("(let ((y 7)) (defun gety () y))"));
+    TEST_EQ_STR("7", LSP_REP("(gety)"));
+    TEST_EQ_STR("7", LSP_VREP("(gety)"));
+    TEST_EQ_STR("outer", LSP_REP("(defun outer (x) (defun inner () x) (inner))"));
+    TEST_EQ_STR("42", LSP_REP("(outer 42)"));
+
+    /* a lambda that captures nothing is shared, one that does is a
+       single object and a cons for each captured value */
+    int lambda = type_index("LAMBDA");
+    lsp_gc_stats before, after;
+    TEST_EQ_STR("n-sets", LSP_REP("(defun n-sets (n) (mapcar (lambda (x) (range x)) (range n)))"));
+    lsp_stats(context, &before);
+    TEST_EQ_STR("(1)", LSP_REP("(nth 100 (n-sets 100))"));
+    lsp_stats(context, &after);
+    TEST_EQ(0, after.allocated[lambda] - before.allocated[lambda]);
+    lsp_stats(context, &before);
+    TEST_EQ_STR("101", LSP_REP("(nth 5 (mapcar (lambda (x) ((adder x) 5)) (range 100)))"));
+    lsp_stats(context, &after);
+    TEST_EQ(true, after.allocated[lambda] - before.allocated[lambda] <= 101);
+}
+
+/* folding and inlining at defun */
+{
+    TEST_EQ_STR("twelve", LSP_REP("(defun twelve () (* 3 (+ 1 (- 5 2))))"));
+    TEST_EQ_STR("12", LSP_REP("(twelve)"));
+    TEST_EQ_STR("12", LSP_VREP("(twelve)"));
+    TEST_EQ_STR("big", LSP_REP("(defun big () (* 100000 (+ 99999 1)))"));
+    TEST_EQ_STR("10000000000", LSP_REP("(big)"));
+    TEST_EQ_STR("10000000000", LSP_VREP("(big)"));
+    TEST_EQ_STR("pick", LSP_REP("(defun pick (x) (if (< 1 2) (list 'yes x) (car x)))"));
+    TEST_EQ_STR("(yes 1)", LSP_REP("(pick 1)"));
+    TEST_EQ_STR("(yes 1)", LSP_VREP("(pick 1)"));
+    TEST_EQ_STR("pick-else", LSP_REP("(defun pick-else (x) (if (equal 1 2) x))"));
+    TEST_EQ_STR("nil", LSP_REP("(pick-else 1)"));
+    TEST_EQ_STR("nil", LSP_VREP("(pick-else 1)"));
+
+    TEST_EQ_STR("sq", LSP_REP("(defun sq (x) (* x x))"));
+    TEST_EQ_STR("sq-sum", LSP_REP("(defun sq-sum (a b) (+ (sq a) (sq (+ b 0))))"));
+    TEST_EQ_STR("25", LSP_REP("(sq-sum 3 4)"));
+    TEST_EQ_STR("25", LSP_VREP("(sq-sum 3 4)"));
+    TEST_EQ_STR("sq-const", LSP_REP("(defun sq-const () (sq-sum 1 2))"));
+    TEST_EQ_STR("5", LSP_REP("(sq-const)"));
+
+    /* redefining a procedure rebuilds the ones that inlined it */
+    TEST_EQ_STR("sq", LSP_REP("(defun sq (x) (+ x x))"));
+    TEST_EQ_STR("14", LSP_REP("(sq-sum 3 4)"));
+    TEST_EQ_STR("14", LSP_VREP("(sq-sum 3 4)"));
+    TEST_EQ_STR("6", LSP_REP("(sq-const)"));
+    TEST_EQ_STR("sq", LSP_VREP("(defun sq (x) (- x 1))"));
+    TEST_EQ_STR("5", LSP_REP("(sq-sum 3 4)"));
+    TEST_EQ_STR("5", LSP_VREP("(sq-sum 3 4)"));
+    TEST_EQ_STR("0", LSP_REP("(progn (set 'sq (lambda (x) 0)) (sq-sum 3 4))"));
+    TEST_EQ_STR("0", LSP_VREP("(sq-sum 3 4)"));
+
+    /* and so does rebinding a folded builtin */
+    TEST_EQ_STR("*", LSP_REP("(set 'times *)"));
+    TEST_EQ_STR("+", LSP_REP("(set '* +)"));
+    TEST_EQ_STR("7", LSP_REP("(twelve)"));
+    TEST_EQ_STR("7", LSP_VREP("(twelve)"));
+    TEST_EQ_STR("*", LSP_REP("(set '* times)"));
+    TEST_EQ_STR("12", LSP_REP("(twelve)"));
+
+    /* arguments are evaluated once, and names bound around a call or
+       by the inlined procedure keep their meaning */
+    TEST_EQ_STR("0", LSP_REP("(set 'cnt 0)"));
+    TEST_EQ_STR("dbl", LSP_REP("(defun dbl (x) (+ x x))"));
+    TEST_EQ_STR("count-up", LSP_REP("(defun count-up () (set 'cnt (+ cnt 1)))"));
+    TEST_EQ_STR("2", LSP_REP("((lambda () (dbl (count-up))))"));
+    TEST_EQ_STR("dbl-count", LSP_REP("(defun dbl-count () (dbl (count-up)))"));
+    TEST_EQ_STR("4", LSP_REP("(dbl-count)"));
+    TEST_EQ_STR("6", LSP_VREP("(dbl-count)"));
+    TEST_EQ_STR("3", LSP_REP("cnt"));
+    TEST_EQ_STR("100", LSP_REP("(set 'g 100)"));
+    TEST_EQ_STR("addg", LSP_REP("(defun addg (x) (+ x g))"));
+    TEST_EQ_STR("useg", LSP_REP("(defun useg (g) (addg g))"));
+    TEST_EQ_STR("101", LSP_REP("(useg 1)"));
+    TEST_EQ_STR("101", LSP_VREP("(useg 1)"));
+    TEST_EQ_STR("5", LSP_REP("(set 'x 5)"));
+    TEST_EQ_STR("call-x", LSP_REP("(defun call-x (y) (let ((z (* y 2))) (dbl (+ x z))))"));
+    TEST_EQ_STR("14", LSP_REP("(call-x 1)"));
+    TEST_EQ_STR("14", LSP_VREP("(call-x 1)"));
+    TEST_EQ_STR("call-x2", LSP_REP("(defun call-x2 (x) (dbl x))"));
+    TEST_EQ_STR("4", LSP_REP("(call-x2 2)"));
+
+    /* procedures relying on each other are not inlined into each other */
+    TEST_EQ_STR("c1", LSP_REP("(defun c1 (x) (+ x 1))"));
+    TEST_EQ_STR("d1", LSP_REP("(defun d1 (x) (c1 x))"));
+    TEST_EQ_STR("c1", LSP_REP("(defun c1 (x) (if (< x 10) (d1 (+ x 1)) x))"));
+    TEST_EQ_STR("10", LSP_REP("(c1 1)"));
+    TEST_EQ_STR("10", LSP_VREP("(d1 1)"));
+    TEST_EQ_STR("c1", LSP_REP("(defun c1 (x) (* x 2))"));
+    TEST_EQ_STR("10", LSP_REP("(d1 5)"));
+    TEST_EQ_STR("10", LSP_VREP("(d1 5)"));
+}
+
+/* inline caches at call sites */
+{
+    int global = type_index("GLOBAL");
+    lsp_gc_stats before, after;
+    TEST_EQ_STR("later", LSP_REP("(defun later (x) (+ x 1))"));
+    TEST_EQ_STR("call-later", LSP_REP("(defun call-later (x) (later (later x)))"));
+    TEST_EQ_STR("vcall-later", LSP_VREP("(defun vcall-later (x) (later (later x)))"));
+    TEST_EQ_STR("3", LSP_REP("(call-later 1)"));
+    TEST_EQ_STR("3", LSP_VREP("(vcall-later 1)"));
+    TEST_EQ_STR("cfib", LSP_REP("(defun cfib (n) (if (< n 2) n (+ (cfib (- n 1)) (cfib (- n 2)))))"));
+    lsp_stats(context, &before);
+    TEST_EQ_STR("610", LSP_REP("(cfib 15)"));
+    TEST_EQ_STR("610", LSP_VREP("(cfib 15)"));
+    lsp_stats(context, &after);
+    /* the VM's top-level call has its own */
+    TEST_EQ(1, after.allocated[global] - before.allocated[global]);
+
+    /* rebinding a global makes every cache look it up again */
+    TEST_EQ_STR("later", LSP_REP("(defun later (x) (* x 10))"));
+    TEST_EQ_STR("100", LSP_REP("(call-later 1)"));
+    TEST_EQ_STR("100", LSP_VREP("(vcall-later 1)"));
+    TEST_EQ_STR("2", LSP_REP("(progn (set 'later (lambda (x) (car x))) (call-later '((2))))"));
+    TEST_EQ_STR("2", LSP_VREP("(vcall-later '((2)))"));
+
+    /* a call of a name bound later finds it */
+    TEST_EQ_STR("call-unbound", LSP_REP("(defun call-unbound (x) (unbound-yet x))"));
+    TEST_EQ_STR("nil", LSP_REP("(call-unbound 1)"));
+    TEST_EQ_STR("unbound-yet", LSP_REP("(defun unbound-yet (x) (list x))"));
+    TEST_EQ_STR("(1)", LSP_REP("(call-unbound 1)"));
+    TEST_EQ_STR("(1)", LSP_VREP("(call-unbound 1)"));
+
+    /* a young closure cached in old code survives collections */
+    TEST_EQ_STR("call-h", LSP_REP("(defun call-h (x) (h x))"));
+    TEST_EQ_STR("vcall-h", LSP_VREP("(defun vcall-h (x) (h x))"));
+    TEST_EQ_STR("6", LSP_REP("(progn (set 'h (adder 5)) (call-h 1))"));
+    TEST_EQ_STR("7", LSP_VREP("(vcall-h 2)"));
+    TEST_EQ_STR("8", LSP_REP("(progn (n-sets 300) (call-h 3))"));
+    TEST_EQ_STR("9", LSP_VREP("(progn (n-sets 300) (vcall-h 4))"));
+}
+
+/* contexts share nothing */
+{
+    lsp_context *other = lsp_init(NULL);
+    lsp_obj *ro = lsp_read("(set 'only-other '(1 2))", other);
+    lsp_obj *eo = lsp_eval(ro, other);
+    const char *text = lsp_print(eo, other);
+    TEST_EQ_STR("(3 4)", LSP_RP("(3 4)"));
+    TEST_EQ_STR("(1 2)", text);
+    TEST_EQ_STR("nil", LSP_REP("only-other"));
+    lsp_obj_release(ro, other);
+    lsp_obj_release(eo, other);
+    lsp_shutdown(other);
+}
+
+/* natives */
+lsp_register_native(context, "sum-squares", native_sum_squares, 0, -1);
+lsp_register_native(context, "reverse-args", native_reverse_args, 0, 8);
+lsp_register_native(context, "greeting", native_greeting, 0, 0);
+TEST_EQ_STR("14", LSP_REP("(sum-squares 1 2 3)"));
+TEST_EQ_STR("14", LSP_VREP("(sum-squares 1 2 3)"));
+TEST_EQ_STR("0", LSP_REP("(sum-squares)"));
+TEST_EQ_STR("(4 a 1)", LSP_REP("(reverse-args 1 'a (sum-squares 2))"));
+TEST_EQ_STR("(4 a 1)", LSP_VREP("(reverse-args 1 'a (sum-squares 2))"));
+TEST_EQ_STR("nil", LSP_REP("(reverse-args)"));
+TEST_EQ_STR("nil", LSP_VREP("(reverse-args 1 2 3 4 5 6 7 8 9)"));
+TEST_EQ_STR("\"hello\"", LSP_REP("(greeting)"));
+TEST_EQ_STR("\"hello\"", LSP_VREP("(greeting)"));
+TEST_EQ_STR("(1 (2 (3 nil)))", LSP_REP("(reduce (lambda (x a) (reverse-args a x)) (list 3 2 1) nil)"));
+TEST_EQ_STR("(1 (2 (3 nil)))", LSP_VREP("(reduce (lambda (x a) (reverse-args a x)) (list 3 2 1) nil)"));
+TEST_EQ_STR("3", LSP_REP("(car (car (cdr (car (cdr (reduce (lambda (x a) (reverse-args a x)) (range 5000) nil))))))"));
+TEST_EQ_STR("3", LSP_VREP("(car (car (cdr (car (cdr (reduce (lambda (x a) (reverse-args a x)) (range 5000) nil))))))"));
+
+/* loading top-level forms */
+{
+    FILE *fp = fopen("load_test.lsp", "w");
+    fprintf(fp, "(defun twice (x)\n\t(+ x x))\n");
+    for (int j = 0; j < 2000; j++)
+        fprintf(fp, "(set 'v\t%d)\n", j);
+    fprintf(fp, "\n(twice v)\n");
+    fclose(fp);
+
+    TEST_EQ_STR("3998", LSP_REP("(load \"load_test.lsp\")"));
+    TEST_EQ_STR("3998", LSP_VREP("(load \"load_test.lsp\")"));
+
+    /* A file that ends on a page boundary */
+    fp = fopen("load_test.lsp", "w");
+    int n = fprintf(fp, "(set 'w 1)\n(twice 21)");
+    for (; n < 8192; n++)
+        fputc(' ', fp);
+    fclose(fp);
+
+    TEST_EQ_STR("42", LSP_REP("(load \"load_test.lsp\")"));
+    TEST_EQ_STR("42", LSP_VREP("(load \"load_test.lsp\")"));
+
+    /* Malformed forms end the load after the forms before them */
+    const char *malformed[] = {"(set 'w 2)\n)\n(set 'w 3)\n",
+                               "(set 'w 2)\n(set 'w \"abc",
+                               "(set 'w 2)\n(set 'w (list 3"};
+    for (int j = 0; j < 3; j++) {
+        fp = fopen("load_test.lsp", "w");
+        fputs(malformed[j], fp);
+        fclose(fp);
+        TEST_EQ_STR("2", LSP_REP("(load \"load_test.lsp\")"));
+        TEST_EQ_STR("2", LSP_VREP("(load \"load_test.lsp\")"));
+        TEST_EQ_STR("2", LSP_REP("w"));
+    }
+
+    /* An unterminated string that ends the page */
+    fp = fopen("load_test.lsp", "w");
+    n = fprintf(fp, "(set 'w 4)\n\"");
+    for (; n < 4095; n++)
+        fputc('a', fp);
+    fclose(fp);
+
+    TEST_EQ_STR("4", LSP_REP("(load \"load_test.lsp\")"));
+    TEST_EQ_STR("4", LSP_VREP("(load \"load_test.lsp\")"));
+    remove("load_test.lsp");
+
+    TEST_EQ_STR("nil", LSP_REP("(load \"load_test.lsp\")"));
+    TEST_EQ_STR("nil", LSP_VREP("(load \"load_test.lsp\")"));
+}
+
+/* printer */
+{
+    TEST_EQ_STR("-4611686018427387904", LSP_REP("(- 0 4611686018427387903 1)"));
+    TEST_EQ_STR("-9223372036854775808", LSP_REP("(- 0 9223372036854775807 1)"));
+    TEST_EQ_STR("(1 \"a\" 'b (nil))", LSP_RP("(1 \"a\" 'b (nil))"));
+
+    lsp_obj *ro = lsp_read("(range 3000)", context);
+    lsp_obj *eo = lsp_eval(ro, context);
+    const char *text = lsp_print(eo, context);
+    TEST_EQ(true, strlen(text) > 10000);
+    TEST_EQ(0, strncmp(text, "(3000 2999 2998 ", 16));
+    TEST_EQ(0, strcmp(text + strlen(text) - 5, " 2 1)"));
+
+    lsp_buf b;
+    lsp_buf_init(&b, NULL);
+    lsp_print_to(eo, &b);
+    lsp_print_to(ro, &b);
+    TEST_EQ(0, strncmp(b.data, text, strlen(text)));
+    TEST_EQ_STR("(range 3000)", b.data + strlen(text));
+    lsp_buf_free(&b);
+
+    FILE *fp = tmpfile();
+    lsp_print_file(eo, fp);
+    TEST_EQ(strlen(text), (size_t) ftell(fp));
+    fclose(fp);
+
+    lsp_obj_release(ro, context);
+    lsp_obj_release(eo, context);
+}
+
+/* parallel map and reduce */
+TEST_EQ_STR("nil", LSP_REP("(pmapcar (lambda (x) x) nil)"));
+TEST_EQ_STR("(4)", LSP_REP("(pmapcar (lambda (x) (* x x)) '(2))"));
+TEST_EQ_STR("(1 4 9 16 25)", LSP_REP("(pmapcar (lambda (x) (* x x)) '(1 2 3 4 5))"));
+TEST_EQ_STR("(1 4 9 16 25)", LSP_VREP("(pmapcar (lambda (x) (* x x)) '(1 2 3 4 5))"));
+TEST_EQ_STR("(11 12 13)", LSP_REP("(let ((k 10)) (pmapcar (lambda (x) (+ x k)) '(1 2 3)))"));
+TEST_EQ_STR("(11 12 13)", LSP_VREP("(let ((k 10)) (pmapcar (lambda (x) (+ x k)) '(1 2 3)))"));
+TEST_EQ_STR("((\"a\" b) ((1) b) (c b))", LSP_REP("(pmapcar (lambda (x) (list x 'b)) '(\"a\" (1) c))"));
+TEST_EQ_STR("(3 7)", LSP_REP("(pmapcar (lambda (l) (preduce + l 0)) '((1 2) (3 4)))"));
+TEST_EQ_STR("7", LSP_REP("(preduce + nil 7)"));
+TEST_EQ_STR("16", LSP_REP("(preduce (lambda (x a) (+ x a)) '(1 2 3) 10)"));
+TEST_EQ_STR("5050", LSP_REP("(preduce + (range 100) 0)"));
+TEST_EQ_STR("5050", LSP_VREP("(preduce + (range 100) 0)"));
+TEST_EQ_STR("pscore", LSP_REP("(defun pscore (x) (+ (* x x) (reduce + (range x) 0)))"));
+{
+    char *seq = copy_text(LSP_REP("(mapcar pscore (range 300))"));
+    TEST_EQ_STR(seq, LSP_REP("(pmapcar pscore (range 300))"));
+    TEST_EQ_STR(seq, LSP_VREP("(pmapcar pscore (range 300))"));
+    free(seq);
+}
+TEST_EQ_STR("pscore", LSP_REP("(defun pscore (x) (- 0 x))"));
+TEST_EQ_STR("(-3 -2 -1)", LSP_REP("(pmapcar pscore (range 3))"));
+TEST_EQ_STR("(\"hello\" \"hello\")", LSP_REP("(pmapcar (lambda (x) (greeting)) '(1 2))"));
+TEST_EQ_STR("(1 2)", LSP_REP("(pmapcar (lambda (x) (set 'pvar x)) '(1 2))"));
+TEST_EQ_STR("nil", LSP_REP("pvar"));
+{
+    lsp_context *saved = context;
+    lsp_config config = {1, 0, 4};
+    context = lsp_init(&config);
+
+    TEST_EQ_STR("n-sets", LSP_REP("(load \"bs.lsp\")"));
+    char *seq = copy_text(LSP_REP("(mapcar (lambda (s) (reduce + s 0)) (n-sets 60))"));
+    TEST_EQ_STR(seq, LSP_REP("(pmapcar (lambda (s) (reduce + s 0)) (n-sets 60))"));
+    free(seq);
+    seq = copy_text(LSP_REP("(mapcar (lambda (n) (range n)) (range 200))"));
+    TEST_EQ_STR(seq, LSP_VREP("(pmapcar (lambda (n) (range n)) (range 200))"));
+    free(seq);
+    TEST_EQ_STR("2001000", LSP_REP("(preduce + (pmapcar (lambda (x) x) (range 2000)) 0)"));
+    TEST_EQ_STR("37820", LSP_VREP("(preduce + (pmapcar (lambda (s) (reduce + s 0)) (n-sets 60)) 0)"));
+
+    /* shared structure is copied once each way */
+    TEST_EQ_STR("dag", LSP_REP("(defun dag (n x) (if (equal n 0) x (let ((d (dag (- n 1) x))) (cons d d))))"));
+    TEST_EQ_STR("left", LSP_REP("(defun left (d n) (if (equal n 0) d (left (car d) (- n 1))))"));
+    TEST_EQ_STR("(1 1 1 1)", LSP_REP("(pmapcar (lambda (y) 1) (list (dag 22 1) 2 3 4))"));
+    TEST_EQ_STR("(7 8)", LSP_VREP("(mapcar (lambda (d) (left d 40)) (pmapcar (lambda (d) d) (list (dag 40 7) (dag 40 8))))"));
+    TEST_EQ_STR("(3 3)", LSP_REP("(let ((table (dag 40 3))) (pmapcar (lambda (r) (left (cdr r) 40)) (list (cons 1 table) (cons 2 table))))"));
+    TEST_EQ_STR("6", LSP_VREP("(preduce (lambda (d a) (+ (left d 40) a)) (list (dag 40 1) (dag 40 2) (dag 40 3)) 0)"));
+
+    lsp_shutdown(context);
+    context = saved;
+}
+
+/* growable heap */
+{
+    lsp_context *saved = context;
+    lsp_config config = {1, 0};
+    context = lsp_init(&config);
+
+    TEST_EQ_STR("n-sets", LSP_REP("(load \"bs.lsp\")"));
+    TEST_EQ_STR("2001000", LSP_REP("(reduce + (range 2000) 0)"));
+    TEST_EQ_STR("12502500", LSP_VREP("(reduce + (range 5000) 0)"));
+    TEST_EQ_STR("21", LSP_REP("(car (nth 20 (n-sets 40)))"));
+
+    lsp_shutdown(context);
+    context = saved;
+}
+
+/* major collections in tiny steps and in whole pauses */
+{
+    lsp_context *saved = context;
+    long budgets[] = {1, -1};
+    for (int i = 0; i < 2; i++) {
+        lsp_config config = {1, 0, 0, budgets[i]};
+        context = lsp_init(&config);
+
+        TEST_EQ_STR("n-sets", LSP_REP("(load \"bs.lsp\")"));
+        TEST_EQ_STR("build", LSP_REP("(defun build (n a) (if (equal n 0) a (build (- n 1) (cons n a))))"));
+        TEST_EQ_STR("nest", LSP_REP("(defun nest (n a) (if (equal n 0) a (nest (- n 1) (cons a nil))))"));
+        TEST_EQ_STR("2", LSP_REP("(car (cdr (set 'long (build 100 (build 50000 nil)))))"));
+        TEST_EQ_STR("nest", LSP_REP("(car (cdr (set 'deep (list (nest 20000 nil) 'nest))))"));
+        lsp_gc_stats st;
+        lsp_stats(context, &st);
+        unsigned long n_set = st.n_major;
+        for (int j = 0; j < 3 || (j < 50 && st.n_major < n_set + 2); j++) {
+            TEST_EQ_STR("50000", LSP_VREP("(nth 50000 (build 50000 nil))"));
+            TEST_EQ_STR("size", LSP_REP("(defun size (l) (reduce + (mapcar (lambda (x) 1) l) 0))"));
+            TEST_EQ_STR("20000", LSP_VREP("(size (build 20000 nil))"));
+            lsp_stats(context, &st);
+        }
+        TEST_EQ_STR("50000", LSP_REP("(nth 50100 long)"));
+        TEST_EQ_STR("nest", LSP_REP("(car (cdr deep))"));
+
+        lsp_stats(context, &st);
+        TEST_EQ(true, st.n_major >= n_set + 2);
+        TEST_EQ(true, st.last_marked > 50000);
+
+        lsp_shutdown(context);
+    }
+    context = saved;
+}
+
+/* steps keep a cycle out of the pauses, and the sweep gives back the
+   chunks it empties. The lists are built a thousand conses at a time,
+   so minor collections do not scan a deep stack. */
+{
+    lsp_context *saved = context;
+    long budgets[] = {1, -1};
+    double max_pause[2];
+    for (int i = 0; i < 2; i++) {
+        lsp_config config = {1, 0, 0, budgets[i]};
+        context = lsp_init(&config);
+
+        TEST_EQ_STR("n-sets", LSP_REP("(load \"bs.lsp\")"));
+        TEST_EQ_STR("nil", LSP_REP("(set 'keep nil)"));
+        for (int j = 0; j < 1000; j++)
+            LSP_VREP("(car (car (set 'keep (cons (range 1000) keep))))");
+        TEST_EQ_STR("1000", LSP_VREP("(car (nth 1000 keep))"));
+
+        lsp_gc_stats st;
+        lsp_stats(context, &st);
+        TEST_EQ(true, st.n_major >= 2);
+        max_pause[i] = st.max_pause;
+
+        size_t heap_size = st.heap_size;
+        TEST_EQ_STR("nil", LSP_REP("(set 'keep nil)"));
+        unsigned long n_set = st.n_major;
+        for (int j = 0; j < 2000 && st.n_major < n_set + 2; j++) {
+            LSP_VREP("(car (car (mapcar (lambda (x) (range 100)) (range 100))))");
+            lsp_stats(context, &st);
+        }
+        TEST_EQ(true, st.n_major >= n_set + 2);
+        TEST_EQ(true, st.heap_size < heap_size / 2);
+
+        lsp_shutdown(context);
+    }
+    TEST_EQ(true, max_pause[0] < max_pause[1]);
+    context = saved;
+}
+
+/* heap images */
+{
+    lsp_context *saved = context;
+    context = lsp_init(NULL);
+
+    TEST_EQ_STR("n-sets", LSP_REP("(load \"bs.lsp\")"));
+    TEST_EQ_STR("add3", LSP_REP("(defun add3 (x) (+ x 3))"));
+    TEST_EQ_STR("7", LSP_VREP("(add3 4)"));
+    TEST_EQ_STR("make-adder", LSP_REP("(defun make-adder (n) (lambda (x) (+ x n)))"));
+    TEST_EQ_STR("15", LSP_VREP("((set 'add10 (make-adder 10)) 5)"));
+    TEST_EQ_STR("\"hi there\"", LSP_REP("(set 'text \"hi there\")"));
+    TEST_EQ_STR("4611686018427387904", LSP_REP("(set 'big 4611686018427387904)"));
+    TEST_EQ_STR("(a (b \"c\") 7)", LSP_REP("(set 'quoted '(a (b \"c\") 7))"));
+    TEST_EQ_STR("sq", LSP_REP("(defun sq (x) (* x x))"));
+    TEST_EQ_STR("sq-sum", LSP_REP("(defun sq-sum (a b) (+ (sq a) (sq b)))"));
+    TEST_EQ_STR("25", LSP_VREP("(sq-sum 3 4)"));
+    char *sets = copy_text(LSP_REP("(n-sets 5)"));
+    TEST_EQ_STR("t", LSP_REP("(save-image \"test.img\")"));
+    TEST_EQ_STR("nil", LSP_REP("(save-image 1)"));
+    lsp_shutdown(context);
+
+    context = lsp_init_from_image("test.img", NULL);
+    TEST_EQ(true, context != NULL);
+    TEST_EQ_STR(sets, LSP_REP("(n-sets 5)"));
+    TEST_EQ_STR(sets, LSP_VREP("(n-sets 5)"));
+    TEST_EQ_STR("7", LSP_REP("(add3 4)"));
+    TEST_EQ_STR("7", LSP_VREP("(add3 4)"));
+    TEST_EQ_STR("15", LSP_VREP("(add10 5)"));
+    TEST_EQ_STR("8", LSP_REP("((make-adder 5) 3)"));
+    TEST_EQ_STR("\"hi there\"", LSP_REP("text"));
+    TEST_EQ_STR("4611686018427387904", LSP_REP("big"));
+    TEST_EQ_STR("(a (b \"c\") 7)", LSP_VREP("quoted"));
+    TEST_EQ_STR("t", LSP_REP("(equal (car quoted) 'a)"));
+    TEST_EQ_STR("5050", LSP_VREP("(preduce + (range 100) 0)"));
+    TEST_EQ_STR("25", LSP_REP("(sq-sum 3 4)"));
+
+    /* what was inlined is still rebuilt */
+    TEST_EQ_STR("sq", LSP_REP("(defun sq (x) (+ x x))"));
+    TEST_EQ_STR("14", LSP_REP("(sq-sum 3 4)"));
+    TEST_EQ_STR("14", LSP_VREP("(sq-sum 3 4)"));
+    lsp_shutdown(context);
+    free(sets);
+
+    /* a short image is refused */
+    FILE *in = fopen("test.img", "rb");
+    char data[4096];
+    size_t n = fread(data, 1, sizeof(data), in);
+    fclose(in);
+    FILE *out = fopen("short.img", "wb");
+    fwrite(data, 1, n / 2, out);
+    fclose(out);
+
+    TEST_EQ(NULL, lsp_init_from_image("short.img", NULL));
+    TEST_EQ(NULL, lsp_init_from_image("bs.lsp", NULL));
+    TEST_EQ(NULL, lsp_init_from_image("no-such.img", NULL));
+
+    /* natives held by the image are registered before it is loaded */
+    context = lsp_init(NULL);
+    lsp_register_native(context, "greeting", native_greeting, 0, 0);
+    TEST_EQ_STR("greeting", LSP_REP("(set 'greet greeting)"));
+    TEST_EQ_STR("t", LSP_REP("(save-image \"test.img\")"));
+    lsp_shutdown(context);
+
+    context = lsp_init(NULL);
+    lsp_register_native(context, "greeting", native_greeting, 0, 0);
+    TEST_EQ(true, lsp_load_image(context, "test.img"));
+    TEST_EQ_STR("\"hello\"", LSP_REP("(greet)"));
+    TEST_EQ_STR("\"hello\"", LSP_VREP("(greet)"));
+    lsp_shutdown(context);
+
+    context = lsp_init(NULL);
+    TEST_EQ(false, lsp_load_image(context, "test.img"));
+    lsp_shutdown(context);
+    TEST_EQ(NULL, lsp_init_from_image("test.img", NULL));
+    remove("test.img");
+    remove("short.img");
+    context = saved;
+}
 
 TEST_END(lsp);